@@ -47,7 +47,8 @@ fi
 if ls | grep "lprf.ko" &> /dev/null && 
 		[ lprf.c -ot lprf.ko ] &&
 		[ lprf.h -ot lprf.ko ] &&
-		[ lprf_registers.h -ot lprf.ko ]
+		[ lprf_registers.h -ot lprf.ko ] &&
+		[ lprf_ioctl.h -ot lprf.ko ]
 then
 	echo "Lprf kernel module already up to date."
 else
@@ -35,15 +35,29 @@
 #include <linux/spi/spi.h>
 #include <linux/regmap.h>
 #include <linux/of_gpio.h>
+#include <linux/of.h>
 #include <linux/ieee802154.h>
 #include <linux/debugfs.h>
 #include <linux/kfifo.h>
+#include <linux/spinlock.h>
+#include <linux/slab.h>
+#include <linux/workqueue.h>
+#include <linux/vmalloc.h>
+#include <linux/mm.h>
+#include <linux/highmem.h>
+#include <linux/log2.h>
+#include <linux/poll.h>
+#include <linux/list.h>
+#include <linux/kref.h>
+#include <linux/rtnetlink.h>
+#include <asm/unaligned.h>
 
 #include <net/mac802154.h>
 #include <net/cfg802154.h>
 
 #include "lprf.h"
 #include "lprf_registers.h"
+#include "lprf_ioctl.h"
 
 struct lprf_local;
 struct lprf_state_change;
@@ -102,10 +116,8 @@ struct lprf_phy_status {
  * 	to complete one state change before initiating another state change
  * @tx_complete: Used to detect when transmitting data finished and
  * 	ieee802154_xmit_complete() can be called.
- * @sm_main_value: Cached value of the SM_MAIN register to enable writing
- * 	 to sub registers without reading the register first.
- * @dem_main_value: Cached value of the DEM_MAIN register to enable writing
- * 	 to sub registers without reading the register first.
+ * @tx_burst: true while queued frames are sent back-to-back in TX idle
+ * 	mode (see lprf_burst_next_frame())
  *
  * This struct contains data specifically needed for state changes.
  * This includes particularly SPI data like rx and tx buffers as well as
@@ -122,9 +134,367 @@ struct lprf_state_change {
         uint8_t to_state;
         atomic_t transition_in_progress;
         bool tx_complete;
+        bool tx_burst;
+};
+
+/**
+ * lprf_reg_shadow contains the value of every register as it was last
+ * written to the chip, regardless of whether it was written synchronously
+ * via regmap or asynchronously via spi_async().
+ *
+ * @lock: protects value, as asynchronous writes happen in interrupt context
+ * @value: last written value of each register. The state machine command
+ * 	is only a trigger and is therefore not stored (see
+ * 	lprf_shadow_modify()).
+ * @async_dirty: registers written asynchronously since the regmap cache was
+ * 	last updated (see lprf_shadow_to_regcache())
+ *
+ * The shadow allows to write any sub register synchronously or
+ * asynchronously without reading the register first.
+ */
+struct lprf_reg_shadow {
+	spinlock_t lock;
+	uint8_t value[LPRF_MAX_REGISTER + 1];
+	DECLARE_BITMAP(async_dirty, LPRF_MAX_REGISTER + 1);
+};
+
+/**
+ * lprf_reg_batch collects sub register writes to merge all writes to the
+ * same register into a single register access.
+ *
+ * @lock: protects the batch from lprf_batch_begin() to lprf_batch_flush()
+ * @value: new values of the registers
+ * @mask: bits of each register that have been set within the batch. Only
+ * 	registers with a non zero mask will be written.
+ * @order: register addresses in the order they were first written to
+ * @count: number of valid entries in order
+ *
+ * See lprf_batch_write_subreg().
+ */
+struct lprf_reg_batch {
+	struct mutex lock;
+	uint8_t value[LPRF_MAX_REGISTER + 1];
+	uint8_t mask[LPRF_MAX_REGISTER + 1];
+	uint8_t order[LPRF_MAX_REGISTER + 1];
+	int count;
+};
+
+/**
+ * lprf_channel contains the register values needed for one RF channel.
+ *
+ * @rx_pll_int: integer part of the PLL divider for RX
+ * @rx_pll_frac: 20 bit fractional part of the PLL divider for RX
+ * @tx_pll_int: integer part of the PLL divider for TX
+ * @tx_pll_frac: 20 bit fractional part of the PLL divider for TX
+ * @vco_tune: VCO tune value for the channel
+ *
+ * The PLL values of all channels are calculated once in the probe function
+ * (see init_lprf_channels()). The VCO tune values are measured by
+ * lprf_calibrate_vco().
+ */
+struct lprf_channel {
+	int rx_pll_int;
+	int rx_pll_frac;
+	int tx_pll_int;
+	int tx_pll_frac;
+	uint8_t vco_tune;
+};
+
+/**
+ * lprf_vco_cal contains data for the recalibration of the VCO.
+ *
+ * @work: work used to recalibrate the current channel (see
+ * 	lprf_vco_cal_work())
+ * @rx_frames: number of received frames in the current window
+ * @rx_errors: number of corrupted frames in the current window
+ * @next_check: jiffies before which no recalibration is started
+ */
+struct lprf_vco_cal {
+	struct work_struct work;
+	atomic_t rx_frames;
+	atomic_t rx_errors;
+	unsigned long next_check;
+};
+
+/**
+ * lprf_hopping contains the channel hopping schedule.
+ *
+ * @timer: timer expiring at every slot boundary
+ * @slot_duration: duration of one slot
+ * @channels: hop sequence
+ * @num_channels: length of the hop sequence, zero if hopping is disabled
+ * @index: index of the channel of the current slot in channels
+ * @pending_channel: channel to switch to as soon as the chip is idle or
+ * 	zero if no channel switch is pending
+ * @lock: serializes lprf_start_hopping() and lprf_stop_hopping()
+ *
+ * See lprf_hop_timer().
+ */
+struct lprf_hopping {
+	struct hrtimer timer;
+	ktime_t slot_duration;
+	u8 channels[LPRF_MAX_HOP_SEQUENCE];
+	int num_channels;
+	int index;
+	atomic_t pending_channel;
+	struct mutex lock;
+};
+
+/**
+ * lprf_scan_result contains the result of a channel scan for one channel.
+ *
+ * @samples: number of samples taken
+ * @busy: number of samples in which the chip received data
+ * @gain_sum: sum of the AGC gain of all samples. The average gain is a
+ * 	measure for the noise floor, a lower gain means more noise.
+ */
+struct lprf_scan_result {
+	u32 samples;
+	u32 busy;
+	u32 gain_sum;
+};
+
+/**
+ * lprf_scan contains data of the channel scan.
+ *
+ * @work: work doing the scan (see lprf_scan_work())
+ * @lock: protects results
+ * @samples: number of samples per channel of the next scan
+ * @results: results of the last scan for all channels
+ */
+struct lprf_scan {
+	struct work_struct work;
+	struct mutex lock;
+	u32 samples;
+	struct lprf_scan_result results[LPRF_NUM_CHANNELS];
+};
+
+/**
+ * lprf_occupancy contains a continuous estimate of the occupancy of one
+ * channel while the channel is in use.
+ *
+ * @polls: number of polls in the current window
+ * @busy_polls: number of polls of the current window in which the chip
+ * 	was receiving data
+ * @busy_avg: moving average of the busy ratio in 1/1000
+ * @frames: number of frames received on the channel
+ * @no_sfd: number of received frames without a valid SFD. These are
+ * 	typically caused by interference.
+ *
+ * The polls are counted in lprf_evaluate_phy_status() and the frames in
+ * lprf_receive_ieee802154_data(), which never run concurrently.
+ */
+struct lprf_occupancy {
+	u32 polls;
+	u32 busy_polls;
+	u32 busy_avg;
+	u32 frames;
+	u32 no_sfd;
+};
+
+/**
+ * State machine startup timers that are set per board. The name is used
+ * for the device tree property "ias,sm-time-<name>" and the debugfs file
+ * sm_time/<name>.
+ */
+static const struct lprf_sm_timer {
+	const char *name;
+	uint8_t addr;
+} lprf_sm_timers[LPRF_NUM_SM_TIMERS] = {
+	{ "power-tx", RG_SM_TIME_POWER_TX },
+	{ "power-rx", RG_SM_TIME_POWER_RX },
+	{ "pll-pon",  RG_SM_TIME_PLL_PON },
+	{ "pll-set",  RG_SM_TIME_PLL_SET },
+	{ "tx",       RG_SM_TIME_TX },
+	{ "pd-en",    RG_SM_TIME_PD_EN },
+};
+
+/**
+ * Settings that depend on the over the air data rate. The chip supports
+ * 250 kbps to 2 Mbps in steps of a factor of two.
+ *
+ * @kbit_rate: data rate in kbps
+ * @data_rate_sel: value of SR_DEM_DATA_RATE_SEL and SR_PLL_MOD_DATA_RATE
+ * @freq_dev: value of SR_PLL_MOD_FREQ_DEV. The frequency deviation is
+ * 	scaled with the data rate to keep the modulation index, 21 / 2^n
+ * 	rounded to the nearest integer with halves rounded up.
+ * @symbol_duration: symbol duration reported to the IEEE 802.15.4 stack
+ */
+static const struct lprf_rate_profile {
+	u16 kbit_rate;
+	u8 data_rate_sel;
+	u8 freq_dev;
+	u8 symbol_duration;
+} lprf_rate_profiles[] = {
+	{ 2000, 3, 21,  16 },
+	{ 1000, 2, 11,  32 },
+	{  500, 1,  5,  64 },
+	{  250, 0,  3, 128 },
+};
+
+/**
+ * lprf_rate contains the data rate dependent state of the driver.
+ *
+ * @profile: current rate profile
+ * @rx_polling_interval: RX_POLLING_INTERVAL for the current data rate
+ * @rx_rx_interval: RX_RX_INTERVAL for the current data rate
+ * @tx_rx_interval: TX_RX_INTERVAL for the current data rate
+ * @retry_interval: RETRY_INTERVAL for the current data rate
+ * @work: work changing the data rate (see lprf_rate_work())
+ * @pending: rate profile to change to by work
+ * @status: result of the last rate change
+ */
+struct lprf_rate {
+	const struct lprf_rate_profile *profile;
+	ktime_t rx_polling_interval;
+	ktime_t rx_rx_interval;
+	ktime_t tx_rx_interval;
+	ktime_t retry_interval;
+	struct work_struct work;
+	const struct lprf_rate_profile *pending;
+	int status;
+};
+
+/**
+ * lprf_mode contains a pending change of the frame format. The change is
+ * applied by lprf_mode_work() while the polling is stopped, as the
+ * asynchronous RX and TX path read the frame format without locking.
+ *
+ * @work: work applying the change
+ * @lock: serializes changes, held from lprf_mode_begin() to
+ * 	lprf_mode_commit()
+ * @shr: synchronization header to change to
+ * @long_frames: long frame mode to change to
+ * @fec: forward error correction mode to change to
+ * @status: result of the last change
+ */
+struct lprf_mode {
+	struct work_struct work;
+	struct mutex lock;
+	struct lprf_shr_config shr;
+	bool long_frames;
+	bool fec;
+	int status;
+};
+
+/**
+ * lprf_channel_switch is used for switching the RF channel asynchronously.
+ *
+ * @spi_message: spi message containing all register writes of a channel
+ * 	switch. The transfers are added to the message once at probe time.
+ * @spi_transfers: one transfer per register, the chip select is toggled
+ * 	between the transfers
+ * @tx_buf: tx buffers of spi_transfers
+ * @is_active: used to make sure only one channel switch is in progress
+ * @channel: channel of the last channel switch
+ * @complete: callback to call after the channel switch completed
+ * @done: completion used by lprf_set_ieee802154_channel() to wait for the
+ * 	channel switch
+ *
+ * See lprf_async_switch_channel().
+ */
+struct lprf_channel_switch {
+	struct spi_message spi_message;
+	struct spi_transfer spi_transfers[LPRF_CHANNEL_SWITCH_REGS];
+	uint8_t tx_buf[LPRF_CHANNEL_SWITCH_REGS][LPRF_REG_WRITE_LENGTH];
+	atomic_t is_active;
+	u8 channel;
+	void (*complete)(struct lprf_local *lprf, int status);
+	struct completion done;
+};
+
+/**
+ * lprf_rx_length is used for adapting the RX length counter to the length of
+ * the frame that is currently received.
+ *
+ * @spi_message: spi message writing all RX length registers
+ * @spi_transfers: one transfer per register
+ * @tx_buf: tx buffers of spi_transfers
+ * @max_counter: RX length counter of a maximum length frame
+ * @shortened: true if the counter has been set for a shorter frame and
+ * 	needs to be set to max_counter before the next reception
+ * @enabled: true if the counter is adapted to received frames
+ * @shortened_frames: number of frames the counter was shortened for
+ *
+ * See lprf_drain_shorten_rx_length().
+ */
+struct lprf_rx_length {
+	struct spi_message spi_message;
+	struct spi_transfer spi_transfers[LPRF_RX_LENGTH_REGS];
+	uint8_t tx_buf[LPRF_RX_LENGTH_REGS][LPRF_REG_WRITE_LENGTH];
+	int max_counter;
+	bool shortened;
+	bool enabled;
+	u32 shortened_frames;
+};
+
+/**
+ * lprf_aggregation packs small payloads of the char driver interface into
+ * one frame.
+ *
+ * @skb: aggregated frame that is currently filled or NULL
+ * @timer: queues skb for transmission at the latest delay after its first
+ * 	payload
+ * @lock: protects skb and delay
+ * @delay: maximum time a payload waits for further payloads
+ * @enabled: true if written payloads are aggregated and received frames are
+ * 	unpacked
+ * @tx_frames: number of aggregated frames queued for transmission
+ * @tx_payloads: number of payloads packed into aggregated frames
+ * @rx_payloads: number of payloads unpacked from received frames
+ *
+ * See lprf_aggregate() and lprf_deaggregate().
+ */
+struct lprf_aggregation {
+	struct sk_buff *skb;
+	struct hrtimer timer;
+	spinlock_t lock;
+	ktime_t delay;
+	bool enabled;
+	u32 tx_frames;
+	u32 tx_payloads;
+	u32 rx_payloads;
+};
+
+/**
+ * lprf_fec contains the state of the forward error correction of the char
+ * driver interface.
+ *
+ * @enabled: true if frames of the char driver interface are encoded and
+ * 	received frames are corrected
+ * @corrected_frames: number of received frames with corrected errors
+ * @corrected_bytes: number of corrected bytes
+ * @failed_frames: number of received frames that could not be corrected
+ *
+ * See lprf_fec_encode() and lprf_fec_decode().
+ */
+struct lprf_fec {
+	bool enabled;
+	u32 corrected_frames;
+	u32 corrected_bytes;
+	u32 failed_frames;
+};
 
-        uint8_t sm_main_value;
-        uint8_t dem_main_value;
+/**
+ * lprf_rx_drain contains the data of a frame that is read from the FIFO
+ * while the chip is still receiving it.
+ *
+ * @data: received data, already preprocessed by preprocess_received_data()
+ * @length: number of valid bytes in data. Non zero while a frame is drained.
+ * @needed: number of bytes of the complete frame as decoded from the
+ * 	physical header, zero if the physical header is not available yet
+ * @enabled: true if the FIFO is drained during reception
+ * @early_frames: number of frames completed before the chip stopped
+ * 	receiving
+ *
+ * See lprf_drain_fifo().
+ */
+struct lprf_rx_drain {
+	uint8_t data[MAX_SPI_BUFFER_SIZE];
+	int length;
+	int needed;
+	bool enabled;
+	u32 early_frames;
 };
 
 /**
@@ -133,16 +503,63 @@ struct lprf_state_change {
  * @spi_device: pointer to the spi device the chip is registered to.
  * @regmap: pointer to the regmap structure needed for synchronous
  * 	register access
+ * @reg_shadow: values of all registers shared by synchronous and
+ * 	asynchronous register access
+ * @reg_batch: batch for merging synchronous sub register writes
+ * @channels: register values of all supported channels, starting with
+ * 	channel LPRF_FIRST_CHANNEL
+ * @channel_switch: channel_switch struct (see above)
+ * @vco_cal: vco_cal struct (see above)
+ * @hopping: hopping struct (see above)
+ * @scan: scan struct (see above)
+ * @occupancy: occupancy estimate of all channels
+ * @sm_time: values of the state machine startup timers in the order of
+ * 	lprf_sm_timers
+ * @sm_time_work: work characterising the startup timers (see
+ * 	lprf_sm_time_work())
+ * @rate: data rate dependent settings
+ * @shr: preamble length and SFD of the synchronization header
+ * @long_frames: true if frames of the char driver interface are sent and
+ * 	frames are received as long frames (see lprf_set_long_frames())
+ * @mode: pending change of shr, long_frames and fec (see above)
+ * @aggregation: aggregation of small char driver payloads (see above)
+ * @fec: forward error correction of the char driver interface (see above)
+ * @wq: ordered workqueue for all works that stop the polling and access the
+ * 	chip synchronously, so they never run concurrently
+ * @debugfs_dir: debugfs directory of the chip
+ * @multi_write_transfers: spi transfers for combining several register
+ * 	writes into one spi message (see lprf_regmap_write())
+ * @multi_write_buf: tx buffers for multi_write_transfers
  * @my_char_dev: char device for the char driver interface.
  * @rx_polling_timer: timer used for polling the chip, as the chip does not
  * 	support an interrupt pin.
  * @hw: ieee802154_hw the chip is registered to.
+ * @run_lock: protects started and char_users, so that the polling is
+ * 	started and stopped consistently with them (see
+ * 	lprf_polling_wanted())
+ * @started: true while the IEEE 802.15.4 interface is up
+ * @char_users: number of open files of the char device
+ * @removing: true once lprf_remove() has stopped the polling for good
  * @rx_polling_active: used for disabling the chip polling
  * @phy_status: phy_status struct (see above)
  * @state_change: state_change struct (see above)
- * @tx_skb: Socket buffer containing pending TX data
- * @free_skb: True if tx_skb got allocated by char driver interface and
- * 	needs to be deleted after transmission.
+ * @rx_drain: rx_drain struct (see above)
+ * @rx_length: rx_length struct (see above)
+ * @tx_queue: frames waiting for transmission, from the IEEE 802.15.4 stack
+ * 	as well as from the char driver interface
+ * @tx_skb: Socket buffer containing the frame that is currently sent
+ * @tx_timer: polls the chip as soon as the send time of the next queued
+ * 	frame is reached (see lprf_tx_dequeue())
+ * @tx_power: TX power level set by the IEEE 802.15.4 stack, which is used
+ * 	for all frames without a TX power of their own
+ * @addr_filt: PAN ID, short address and extended address set by the
+ * 	IEEE 802.15.4 stack. Used for address filtering in software.
+ * @promiscuous: True if address filtering is disabled, e.g. because a
+ * 	monitor interface is active.
+ * @addr_filt_lock: protects addr_filt and promiscuous, as they are read in
+ * 	the RX path from interrupt context.
+ * @restore_work: work used to reset the chip and restore its configuration
+ * 	after an asynchronous spi error (see lprf_async_error())
  *
  * This struct exists once per chip and gets allocated in the probe function
  * that handles all the hardware initialization. It contains all relevant
@@ -151,45 +568,240 @@ struct lprf_state_change {
 struct lprf_local {
 	struct spi_device *spi_device;
 	struct regmap *regmap;
+	struct lprf_reg_shadow reg_shadow;
+	struct lprf_reg_batch reg_batch;
+	struct lprf_channel channels[LPRF_NUM_CHANNELS];
+	struct lprf_channel_switch channel_switch;
+	struct lprf_vco_cal vco_cal;
+	struct lprf_hopping hopping;
+	struct lprf_scan scan;
+	struct lprf_occupancy occupancy[LPRF_NUM_CHANNELS];
+	u8 sm_time[LPRF_NUM_SM_TIMERS];
+	struct work_struct sm_time_work;
+	struct lprf_rate rate;
+	struct lprf_shr_config shr;
+	bool long_frames;
+	struct lprf_mode mode;
+	struct lprf_aggregation aggregation;
+	struct lprf_fec fec;
+	struct workqueue_struct *wq;
+	struct dentry *debugfs_dir;
+	struct spi_transfer multi_write_transfers[LPRF_MAX_MULTI_WRITE];
+	uint8_t multi_write_buf[LPRF_MAX_MULTI_WRITE][LPRF_REG_WRITE_LENGTH];
 	struct cdev my_char_dev;
 	struct hrtimer rx_polling_timer;
 	struct ieee802154_hw *hw;
+	struct mutex run_lock;
+	bool started;
+	unsigned int char_users;
+	bool removing;
 	atomic_t rx_polling_active;
 
 	struct lprf_phy_status phy_status;
 	struct lprf_state_change state_change;
+	struct lprf_rx_drain rx_drain;
+	struct lprf_rx_length rx_length;
 
+	struct sk_buff_head tx_queue;
 	struct sk_buff *tx_skb;
+	struct hrtimer tx_timer;
+	u8 tx_power;
+
+	struct ieee802154_hw_addr_filt addr_filt;
+	bool promiscuous;
+	spinlock_t addr_filt_lock;
+
+	struct work_struct restore_work;
+};
+
+/**
+ * lprf_skb_cb is stored in the control buffer of every sk_buff in the TX
+ * queue.
+ *
+ * @free_skb: True if the sk_buff got allocated by the char driver interface
+ * 	and needs to be deleted after transmission.
+ * @long_frame: True if the frame is sent with the two byte physical header
+ * 	of long frames.
+ * @fec: True if the frame is encoded by lprf_fec_encode() when it is sent.
+ * @report: True if a completion record is written to the char driver
+ * 	interface after transmission (see lprf_report_tx()).
+ * @tx_power: TX power level (SR_TX_PWR_CTRL) of the frame or
+ * 	LPRF_DEFAULT_TX_POWER
+ * @id: identifier of the frame for the completion record
+ * @reader_id: id of the lprf_char_reader the completion record is delivered
+ * 	to
+ * @send_time: The frame is not sent before this time. Zero sends the frame
+ * 	as soon as possible.
+ * @queued: time the frame was queued, for the completion record
+ */
+struct lprf_skb_cb {
 	bool free_skb;
+	bool long_frame;
+	bool fec;
+	bool report;
+	s8 tx_power;
+	u32 id;
+	u32 reader_id;
+	ktime_t send_time;
+	ktime_t queued;
+};
+
+#define LPRF_SKB_CB(skb) ((struct lprf_skb_cb *)(skb)->cb)
+
+/**
+ * Initializes the control buffer of a frame that is sent immediately with
+ * the default TX power.
+ */
+static inline void lprf_init_skb_cb(struct sk_buff *skb, bool free_skb,
+		bool long_frame, bool fec)
+{
+	struct lprf_skb_cb *cb = LPRF_SKB_CB(skb);
+
+	memset(cb, 0, sizeof(*cb));
+	cb->free_skb = free_skb;
+	cb->long_frame = long_frame;
+	cb->fec = fec;
+	cb->tx_power = LPRF_DEFAULT_TX_POWER;
+}
+
+/**
+ * lprf_rx_ring is a ring of received frames that is shared with user space
+ * by mmap().
+ *
+ * @slots: memory of the ring allocated by vmalloc_user() or NULL
+ * @num_slots: number of slots, a power of two
+ * @head: index of the slot the next frame is stored in
+ * @mapped: number of memory mappings of the ring
+ * @lock: protects slots, num_slots and head while a frame is stored
+ * @mutex: serializes changes of the ring against mmap()
+ * @overflow: true if frames were dropped since the last stored frame
+ * @dropped: number of frames dropped, because the next slot still belonged
+ * 	to user space
+ *
+ * See lprf_rx_ring_store().
+ */
+struct lprf_rx_ring {
+	struct lprf_rx_slot *slots;
+	u32 num_slots;
+	u32 head;
+	atomic_t mapped;
+	spinlock_t lock;
+	struct mutex mutex;
+	bool overflow;
+	u32 dropped;
+};
+
+/**
+ * lprf_char_frame is received data of the char driver interface that is
+ * shared by all readers it is delivered to.
+ *
+ * @ref: one reference per reader buffer containing the frame
+ * @length: number of bytes of data
+ * @data: raw data or a record with its struct lprf_rx_record header
+ *
+ * See lprf_char_deliver().
+ */
+struct lprf_char_frame {
+	struct kref ref;
+	int length;
+	uint8_t data[];
+};
+
+/**
+ * lprf_char_entry is one entry of the read() buffer of a reader.
+ *
+ * @frame: shared received data
+ * @overflow: true if frames were dropped for the reader right before this
+ * 	frame. Records are read with LPRF_RX_STATUS_OVERFLOW then.
+ */
+struct lprf_char_entry {
+	struct lprf_char_frame *frame;
+	bool overflow;
+};
+
+/**
+ * lprf_char_reader contains the state of one open file of the char driver
+ * interface.
+ *
+ * @lprf: lprf_local struct of the chip
+ * @list: entry of lprf_char_driver_interface.readers
+ * @id: unique nonzero id of the open file. TX completion records refer to
+ * 	their reader by id, as the reader may be closed before the frame is
+ * 	sent.
+ * @frames: received frames that have not been read yet
+ * @offset: number of bytes of the first frame already read in byte stream
+ * 	mode
+ * @records: true if received frames are read as records with a struct
+ * 	lprf_rx_record header instead of raw data (see lprf_char_record())
+ * @read_mutex: serializes reading frames against changes of the buffer
+ * @rx_ring: RX ring shared with user space
+ * @overflow: true if frames were dropped since the last frame that was put
+ * 	into frames
+ * @received: number of frames put into frames
+ * @dropped: number of frames dropped, because frames was full
+ */
+struct lprf_char_reader {
+	struct lprf_local *lprf;
+	struct list_head list;
+	u32 id;
+	DECLARE_KFIFO_PTR(frames, struct lprf_char_entry);
+	unsigned int offset;
+	bool records;
+	struct mutex read_mutex;
+	struct lprf_rx_ring rx_ring;
+	bool overflow;
+	u32 received;
+	u32 dropped;
 };
 
 /**
  * lprf_char_driver_interface is a struct used for the implementation of
  * the char driver interface
  *
- * @is_open: true if the device file is currently opened by as user space
- * 	application.
- * @is_ready: true if is_open and all char driver initializations completed
- * @data_buffer: buffer containing rx data for the char driver interface
+ * @readers: all open files of the char device (struct lprf_char_reader)
+ * @lock: protects readers and the buffers of all readers against the
+ * 	RX path, which runs in interrupt context
  * @wait_for_rx_data: wait queue to wait for rx data to become available
  * @wait_for_tx_ready: wait queue to wait for the chip to get ready for
  * 	tx mode.
+ * @dropped_records: number of records that did not fit into the buffer of
+ * 	a reader
+ * @dropped_data: number of raw data frames that did not fit into the
+ * 	buffer of a reader in byte stream mode
+ * @rx_ring_frames: number of frames stored in RX rings
+ * @rx_ring_dropped: number of frames dropped, because the next slot of an
+ * 	RX ring still belonged to user space
+ * @last_reader_id: id of the last opened reader
  *
  * This struct contains data needed for the char driver interface. The char
  * driver interface is actually not needed for normal chip operation but
  * only used for debugging purposes. This way user space applications are able
  * to read and write raw data to the chip without using the hole IEEE 802.15.4
- * stack.
+ * stack. Any number of applications can open the device file at the same
+ * time and every one of them receives all frames.
  */
 struct lprf_char_driver_interface {
-	atomic_t is_open;
-	atomic_t is_ready;
-	DECLARE_KFIFO_PTR(data_buffer, uint8_t);
+	struct list_head readers;
+	spinlock_t lock;
 	wait_queue_head_t wait_for_rx_data;
 	wait_queue_head_t wait_for_tx_ready;
-
+	u32 dropped_records;
+	u32 dropped_data;
+	atomic_t rx_ring_frames;
+	atomic_t rx_ring_dropped;
+	u32 last_reader_id;
 } lprf_char_driver_interface;
 
+/*
+ * Number of frames the read() buffer of a newly opened file holds. The
+ * value is limited to LPRF_RX_BUFFER_MIN_FRAMES to LPRF_RX_BUFFER_MAX_FRAMES
+ * and rounded up to a power of two.
+ */
+static unsigned int rx_buffer_frames = LPRF_RX_BUFFER_DEFAULT_FRAMES;
+module_param(rx_buffer_frames, uint, 0644);
+MODULE_PARM_DESC(rx_buffer_frames,
+		"frames in the read() buffer of every open file of /dev/lprf");
+
 
 /***
  *      ____   ____  ___      _
@@ -205,6 +817,36 @@ struct lprf_char_driver_interface {
  * is directly handled by asynchronous spi transfers.
  */
 
+/**
+ * lprf_shadow_modify changes bits of a register in the register shadow
+ *
+ * @lprf: lprf_local struct
+ * @addr: 8 bit address of the register
+ * @mask: bits of the register to change
+ * @bits: new value of the masked bits, already aligned to the register
+ *
+ * Returns the new value of the hole register that needs to be written to the
+ * chip. Can be called from interrupt context. The state machine command is
+ * a trigger that must not be repeated by later writes to SM_MAIN, so it is
+ * not stored in the shadow.
+ */
+static uint8_t lprf_shadow_modify(struct lprf_local *lprf,
+		unsigned int addr, unsigned int mask, unsigned int bits)
+{
+	struct lprf_reg_shadow *shadow = &lprf->reg_shadow;
+	unsigned long flags;
+	uint8_t value;
+
+	spin_lock_irqsave(&shadow->lock, flags);
+	value = (shadow->value[addr] & ~mask) | (bits & mask);
+	shadow->value[addr] = value;
+	if (addr == RG_SM_MAIN)
+		shadow->value[addr] &= ~SUBREG_MASK(SR_SM_COMMAND);
+	spin_unlock_irqrestore(&shadow->lock, flags);
+
+	return value;
+}
+
 /**
  * __lprf_write writes one register synchronously.
  *
@@ -219,6 +861,7 @@ static inline int
 __lprf_write(struct lprf_local *lprf, unsigned int address, unsigned int value)
 {
 	int ret = 0;
+	lprf_shadow_modify(lprf, address, 0xff, value);
 	ret = regmap_write(lprf->regmap, address, value);
 	return ret;
 }
@@ -268,12 +911,111 @@ static inline int lprf_read_subreg(struct lprf_local *lprf,
  * @mask: mask for the sub register to read from
  * @shift: shift needed to align data with LSB
  * @data: value to write to subregister
+ *
+ * The remaining bits of the register are taken from the register shadow,
+ * so the register is never read.
  */
 static inline int lprf_write_subreg(struct lprf_local *lprf,
 		unsigned int addr, unsigned int mask,
 		unsigned int shift, unsigned int data)
 {
-	return regmap_update_bits(lprf->regmap, addr, mask, data << shift);
+	uint8_t value = lprf_shadow_modify(lprf, addr, mask, data << shift);
+	return regmap_write(lprf->regmap, addr, value);
+}
+
+/**
+ * Starts a new batch of sub register writes. Has to be followed by
+ * lprf_batch_flush(). Only one batch can be active at a time.
+ */
+static void lprf_batch_begin(struct lprf_local *lprf)
+{
+	mutex_lock(&lprf->reg_batch.lock);
+}
+
+/**
+ * lprf_batch_write_subreg adds a sub register write to the current batch
+ *
+ * @lprf: lprf_local struct
+ * @addr: address of the register to write to
+ * @mask: mask for the sub register to write to
+ * @shift: shift needed to align data with LSB
+ * @data: value to write to subregister
+ *
+ * The value is only stored in the batch. Several sub register writes to the
+ * same register will be merged and written with a single register access
+ * by lprf_batch_flush(). A later write to the same sub register overrides
+ * an earlier one. So writes that need to reach the chip one after another
+ * (like reset pulses) have to be placed in different batches.
+ */
+static void lprf_batch_write_subreg(struct lprf_local *lprf,
+		unsigned int addr, unsigned int mask,
+		unsigned int shift, unsigned int data)
+{
+	struct lprf_reg_batch *batch = &lprf->reg_batch;
+
+	if (!batch->mask[addr])
+		batch->order[batch->count++] = addr;
+
+	batch->value[addr] = (batch->value[addr] & ~mask) |
+			((data << shift) & mask);
+	batch->mask[addr] |= mask;
+}
+
+/**
+ * Writes all registers of the current batch to the chip and ends the batch.
+ * Every register is written once in the order it was first used in the
+ * batch. Bits not set within the batch are taken from the register shadow.
+ * Up to LPRF_MAX_MULTI_WRITE registers are written with a single spi message
+ * by regmap_multi_reg_write().
+ */
+static int lprf_batch_flush(struct lprf_local *lprf)
+{
+	struct lprf_reg_batch *batch = &lprf->reg_batch;
+	struct reg_sequence regs[LPRF_MAX_MULTI_WRITE];
+	unsigned int addr;
+	int num_regs = 0;
+	int ret = 0;
+	int i;
+
+	for (i = 0; i < batch->count && !ret; ++i) {
+		addr = batch->order[i];
+
+		regs[num_regs].reg = addr;
+		regs[num_regs].def = lprf_shadow_modify(lprf, addr,
+				batch->mask[addr], batch->value[addr]);
+		regs[num_regs].delay_us = 0;
+		num_regs++;
+
+		if (num_regs == LPRF_MAX_MULTI_WRITE ||
+				i == batch->count - 1) {
+			ret = regmap_multi_reg_write(lprf->regmap,
+					regs, num_regs);
+			num_regs = 0;
+		}
+	}
+
+	for (i = 0; i < batch->count; ++i) {
+		batch->mask[batch->order[i]] = 0;
+		batch->value[batch->order[i]] = 0;
+	}
+	batch->count = 0;
+
+	mutex_unlock(&batch->lock);
+	return ret;
+}
+
+/**
+ * Writes the RX length counter synchronously. See also
+ * lprf_async_set_rx_length().
+ */
+static int lprf_write_rx_length(struct lprf_local *lprf, int counter)
+{
+	lprf_batch_begin(lprf);
+	lprf_batch_write_subreg(lprf, SR_RX_LENGTH_H, BIT24_H_BYTE(counter));
+	lprf_batch_write_subreg(lprf, SR_RX_LENGTH_M, BIT24_M_BYTE(counter));
+	lprf_batch_write_subreg(lprf, SR_RX_LENGTH_L, BIT24_L_BYTE(counter));
+	lprf->rx_length.shortened = counter != lprf->rx_length.max_counter;
+	return lprf_batch_flush(lprf);
 }
 
 /**
@@ -293,6 +1035,32 @@ static inline int lprf_read_phy_status(struct lprf_local *lprf)
 
 }
 
+/**
+ * lprf_read_agc_gain reads the current gain of all AGC gain stages
+ * synchronously and returns the sum in gain. The gain is between zero and
+ * LPRF_AGC_MAX_GAIN, a low gain means a high input power. RG_DEM_GC_DOUT
+ * only holds the seventh stage in its lower nibble.
+ */
+static int lprf_read_agc_gain(struct lprf_local *lprf, unsigned int *gain)
+{
+	static const unsigned int gain_registers[] = {
+		RG_DEM_GC_AOUT, RG_DEM_GC_BOUT, RG_DEM_GC_COUT, RG_DEM_GC_DOUT
+	};
+	unsigned int value = 0;
+	int ret = 0;
+	int i = 0;
+
+	*gain = 0;
+	for (i = 0; i < ARRAY_SIZE(gain_registers); ++i) {
+		RETURN_ON_ERROR(__lprf_read(lprf, gain_registers[i], &value));
+		if (gain_registers[i] == RG_DEM_GC_DOUT)
+			value &= SUBREG_MASK(SR_DEM_GC7_OUT);
+		*gain += (value >> 4) + (value & 0x0f);
+	}
+	*gain = min_t(unsigned int, *gain, LPRF_AGC_MAX_GAIN);
+	return 0;
+}
+
 /**
  * returns true if the given register is writable. Needed for the regmap
  * caching functionality.
@@ -358,7 +1126,9 @@ static bool lprf_reg_readable(struct device *dev, unsigned int reg)
 
 /**
  * returns true if the given register is volatile and therefore can not be
- * cached.
+ * cached. RG_SM_MAIN holds the state machine command, a trigger that
+ * regcache_sync() must never replay. Its other bits are restored from the
+ * register shadow by lprf_restore_hardware().
  */
 static bool lprf_reg_volatile(struct device *dev, unsigned int reg)
 {
@@ -370,6 +1140,7 @@ static bool lprf_reg_volatile(struct device *dev, unsigned int reg)
 	case RG_GLOBAL_RESETB:
 	case RG_GLOBAL_initALL:
 	case RG_ACTIVATE_ALL:
+	case RG_SM_MAIN:
 		return true;
 	default:
 		return false;
@@ -387,6 +1158,78 @@ static bool lprf_reg_precious(struct device *dev, unsigned int reg)
 	return false;
 }
 
+/**
+ * Write callback of the lprf regmap bus.
+ *
+ * @context: lprf_local struct
+ * @data: formatted register writes, each consisting of a 16 bit register
+ * 	address followed by the value
+ * @count: length of data in bytes
+ *
+ * The lprf chip does not increment the register address automatically,
+ * so every register access needs its own command and address. However,
+ * several register writes can be sent with a single spi message, in which
+ * the chip select is toggled between the transfers. This saves the
+ * overhead of queueing one spi message per register. regmap only sets the
+ * write command for the first register of a multi register write, so the
+ * command is set here for every register.
+ */
+static int lprf_regmap_write(void *context, const void *data, size_t count)
+{
+	struct lprf_local *lprf = context;
+	const uint8_t *buf = data;
+	struct spi_message spi_message;
+	int num_regs = count / LPRF_REG_WRITE_LENGTH;
+	int i;
+
+	if (num_regs <= 1 || count % LPRF_REG_WRITE_LENGTH)
+		return spi_write(lprf->spi_device, data, count);
+
+	if (num_regs > LPRF_MAX_MULTI_WRITE)
+		return -EINVAL;
+
+	spi_message_init(&spi_message);
+	for (i = 0; i < num_regs; ++i) {
+		lprf->multi_write_buf[i][0] = REGW;
+		lprf->multi_write_buf[i][1] = buf[i * LPRF_REG_WRITE_LENGTH + 1];
+		lprf->multi_write_buf[i][2] = buf[i * LPRF_REG_WRITE_LENGTH + 2];
+
+		memset(&lprf->multi_write_transfers[i], 0,
+				sizeof(lprf->multi_write_transfers[i]));
+		lprf->multi_write_transfers[i].tx_buf =
+				lprf->multi_write_buf[i];
+		lprf->multi_write_transfers[i].len = LPRF_REG_WRITE_LENGTH;
+		lprf->multi_write_transfers[i].cs_change = i < num_regs - 1;
+		spi_message_add_tail(&lprf->multi_write_transfers[i],
+				&spi_message);
+	}
+
+	return spi_sync(lprf->spi_device, &spi_message);
+}
+
+/**
+ * Read callback of the lprf regmap bus. Reads one register with a single
+ * spi message.
+ */
+static int lprf_regmap_read(void *context, const void *reg, size_t reg_size,
+		void *val, size_t val_size)
+{
+	struct lprf_local *lprf = context;
+	return spi_write_then_read(lprf->spi_device, reg, reg_size,
+			val, val_size);
+}
+
+/**
+ * regmap bus for the lprf chip. Similar to the regmap spi bus but with
+ * support for writing several registers with one spi message.
+ */
+static const struct regmap_bus lprf_regmap_bus = {
+	.write = lprf_regmap_write,
+	.read = lprf_regmap_read,
+	.reg_format_endian_default = REGMAP_ENDIAN_BIG,
+	.val_format_endian_default = REGMAP_ENDIAN_BIG,
+};
+
 /**
  * Configuration struct for the regmap functionality. The commands for
  * read and write access are specified here.
@@ -399,9 +1242,9 @@ static const struct regmap_config lprf_regmap_spi_config = {
 	.read_flag_mask = 0x80,
 	.write_flag_mask = 0xc0,
 	.fast_io = 0, /* use spinlock instead of mutex for locking */
-	.max_register = 0xF3,
-	.use_single_rw = 1, /* we do not support bulk read write */
-	.can_multi_write = 0,
+	.max_register = LPRF_MAX_REGISTER,
+	.use_single_rw = 1, /* no auto increment of register addresses */
+	.can_multi_write = 1, /* see lprf_regmap_write() */
 	.cache_type = REGCACHE_RBTREE,
 	.writeable_reg = lprf_reg_writeable,
 	.readable_reg = lprf_reg_readable,
@@ -409,34 +1252,6 @@ static const struct regmap_config lprf_regmap_spi_config = {
 	.precious_reg = lprf_reg_precious,
 };
 
-static void lprf_async_write_register(struct lprf_state_change *state_change,
-		uint8_t address, uint8_t value,
-		void (*complete)(void *context));
-static int lprf_phy_status_async(struct lprf_phy_status *phy_status);
-static inline void lprf_stop_polling(struct lprf_local *lprf);
-
-/**
- * Call back for asynchronous error recovery. See lprf_async_error().
- */
-static void lprf_async_error_recover_callback(void *context)
-{
-	struct lprf_local *lprf = context;
-	atomic_set(&lprf->rx_polling_active, 1);
-	lprf_phy_status_async(&lprf->phy_status);
-}
-
-/**
- * Call back for asynchronous error recovery. See lprf_async_error().
- */
-static void lprf_async_error_recover(void *context)
-{
-	struct lprf_local *lprf = context;
-	struct lprf_state_change *state_change = &lprf->state_change;
-
-	lprf_async_write_register(state_change, RG_GLOBAL_RESETB, 0xff,
-			lprf_async_error_recover_callback);
-}
-
 /**
  * Resets the chip after an async error has been received.
  *
@@ -445,17 +1260,18 @@ static void lprf_async_error_recover(void *context)
  * @rc: error code returned by spi_async
  *
  * If spi async returns with an error this function can be used to reset
- * the chip asynchronously and get the chip into normal operation again.
- * Normally there should be no async spi error, so this function will
- * normally not be used at all.
+ * the chip and get the chip into normal operation again. As this function
+ * is typically called in interrupt context, the polling is only disabled
+ * here and the reset and restoring of the configuration is done by
+ * lprf_restore_work(). Normally there should be no async spi error, so this
+ * function will normally not be used at all.
  */
 static inline void lprf_async_error(struct lprf_local *lprf,
 		struct lprf_state_change *state_change, int rc)
 {
 	dev_err(&lprf->spi_device->dev, "spi_async error %d\n", rc);
-	lprf_stop_polling(lprf);
-	lprf_async_write_register(state_change,
-			RG_GLOBAL_RESETB, 0, lprf_async_error_recover);
+	atomic_set(&lprf->rx_polling_active, 0);
+	queue_work(lprf->wq, &lprf->restore_work);
 }
 
 /**
@@ -473,12 +1289,19 @@ static inline void lprf_async_error(struct lprf_local *lprf,
  * access registers asynchronously with using callback functions at the same
  * time. Therefore an asynchronous way of setting registers is needed. This
  * is done by directly calling spi_async(). See also lprf_async_write_subreg().
+ * The value is stored in the register shadow and is written to the regmap
+ * cache by lprf_shadow_to_regcache() before the cache is synced again.
  */
 static void lprf_async_write_register(struct lprf_state_change *state_change,
 		uint8_t address, uint8_t value,
 		void (*complete)(void *context))
 {
+	struct lprf_local *lprf = state_change->lprf;
 	int ret = 0;
+
+	lprf_shadow_modify(lprf, address, 0xff, value);
+	set_bit(address, lprf->reg_shadow.async_dirty);
+
 	state_change->tx_buf[0] = REGW;
 	state_change->tx_buf[1] = address;
 	state_change->tx_buf[2] = value;
@@ -494,7 +1317,6 @@ static void lprf_async_write_register(struct lprf_state_change *state_change,
  * Writes a sub register asynchronously
  *
  * @lprf_state_change: current state change struct
- * @cached value: cached value of the hole register
  * @addr: 8 bit address of the register to write to
  * @mask: sub register mask
  * @shift: shift needed to align sub register with LSB
@@ -505,10 +1327,9 @@ static void lprf_async_write_register(struct lprf_state_change *state_change,
  *
  * The use of spi_async instead of regmap for asynchronous register access
  * has the disadvantage that no automatic caching of register data is performed.
- * To avoid reading the register every time a cached value of the register
- * needs to be provided. Typically it should be enough to save the
- * configuration value once after the initial configuration in the probe
- * function.
+ * To avoid reading the register every time, the remaining bits of the
+ * register are taken from the register shadow, which is shared with the
+ * synchronous register access.
  * The AR86RF230 needs to access sub registers only during the initial
  * configuration and not during regular operation. Therefore it does not have
  * the problem of accessing sub registers asynchronously and needing to
@@ -516,28 +1337,160 @@ static void lprf_async_write_register(struct lprf_state_change *state_change,
  */
 static void
 lprf_async_write_subreg(struct lprf_state_change *state_change,
-		uint8_t cached_val, uint8_t addr, uint8_t mask, uint8_t shift,
+		uint8_t addr, uint8_t mask, uint8_t shift,
 		uint8_t data, void (*complete)(void *context))
 {
-	uint8_t reg_val = (cached_val & ~mask) | (data << shift);
+	uint8_t reg_val = lprf_shadow_modify(state_change->lprf, addr,
+			mask, data << shift);
 	lprf_async_write_register(state_change, addr, reg_val, complete);
 }
 
-static void lprf_evaluate_phy_status(struct lprf_local *lprf,
-		struct lprf_state_change *state_change, uint8_t phy_status);
-
-static void lprf_phy_status_complete(void *context)
+/**
+ * Prepares the tx buffer of an asynchronous register write that is part of
+ * a larger spi message. The remaining bits of the register are taken from
+ * the register shadow.
+ */
+static void lprf_prepare_write_subreg(struct lprf_local *lprf,
+		uint8_t *tx_buf, uint8_t addr, uint8_t mask, uint8_t shift,
+		uint8_t data)
 {
-	struct lprf_local *lprf = context;
-	struct lprf_state_change *state_change = &lprf->state_change;
-	struct lprf_phy_status *phy_status = &lprf->phy_status;
-	uint8_t status = phy_status->rx_buf[0];
-	atomic_dec(&lprf->phy_status.is_active);
-	lprf_evaluate_phy_status(lprf, state_change, status);
+	tx_buf[0] = REGW;
+	tx_buf[1] = addr;
+	tx_buf[2] = lprf_shadow_modify(lprf, addr, mask, data << shift);
+	set_bit(addr, lprf->reg_shadow.async_dirty);
 }
 
 /**
- * reads the physical status of the chip
+ * Sets one register write of the channel switch spi message.
+ */
+static void lprf_channel_switch_write_subreg(struct lprf_local *lprf,
+		int index, uint8_t addr, uint8_t mask, uint8_t shift,
+		uint8_t data)
+{
+	lprf_prepare_write_subreg(lprf, lprf->channel_switch.tx_buf[index],
+			addr, mask, shift, data);
+}
+
+static void __lprf_channel_switch_complete(void *context)
+{
+	struct lprf_local *lprf = context;
+	struct lprf_channel_switch *channel_switch = &lprf->channel_switch;
+	void (*complete)(struct lprf_local *lprf, int status) =
+			channel_switch->complete;
+	int status = channel_switch->spi_message.status;
+
+	atomic_dec(&channel_switch->is_active);
+	if (complete)
+		complete(lprf, status);
+}
+
+/**
+ * Switches the RF channel asynchronously
+ *
+ * @lprf: lprf_local struct
+ * @channel: IEEE 802.15.4 channel number (channel page 0)
+ * @complete: callback to call after the channel switch completed or zero.
+ * 	Note that the callback function will be called in interrupt context
+ * 	as it is directly the callback function of spi_async().
+ *
+ * All register values of the new channel are taken from the channel table
+ * calculated at probe time. The RX PLL, TX PLL and VCO tune registers are
+ * written with one prebuilt spi message, so this function can be called
+ * from atomic context. Returns -EBUSY if another channel switch is still in
+ * progress and -EINVAL for unsupported channels.
+ */
+static int lprf_async_switch_channel(struct lprf_local *lprf, u8 channel,
+		void (*complete)(struct lprf_local *lprf, int status))
+{
+	struct lprf_channel_switch *channel_switch = &lprf->channel_switch;
+	struct lprf_channel *ch = 0;
+	int ret = 0;
+
+	if (channel < LPRF_FIRST_CHANNEL || channel > LPRF_LAST_CHANNEL)
+		return -EINVAL;
+
+	if (atomic_inc_return(&channel_switch->is_active) != 1) {
+		atomic_dec(&channel_switch->is_active);
+		return -EBUSY;
+	}
+
+	ch = &lprf->channels[channel - LPRF_FIRST_CHANNEL];
+
+	lprf_channel_switch_write_subreg(lprf, 0,
+			SR_RX_CHAN_INT, ch->rx_pll_int);
+	lprf_channel_switch_write_subreg(lprf, 1,
+			SR_RX_CHAN_FRAC_H, BIT24_H_BYTE(ch->rx_pll_frac));
+	lprf_channel_switch_write_subreg(lprf, 2,
+			SR_RX_CHAN_FRAC_M, BIT24_M_BYTE(ch->rx_pll_frac));
+	lprf_channel_switch_write_subreg(lprf, 3,
+			SR_RX_CHAN_FRAC_L, BIT24_L_BYTE(ch->rx_pll_frac));
+	lprf_channel_switch_write_subreg(lprf, 4,
+			SR_TX_CHAN_INT, ch->tx_pll_int);
+	lprf_channel_switch_write_subreg(lprf, 5,
+			SR_TX_CHAN_FRAC_H, BIT24_H_BYTE(ch->tx_pll_frac));
+	lprf_channel_switch_write_subreg(lprf, 6,
+			SR_TX_CHAN_FRAC_M, BIT24_M_BYTE(ch->tx_pll_frac));
+	lprf_channel_switch_write_subreg(lprf, 7,
+			SR_TX_CHAN_FRAC_L, BIT24_L_BYTE(ch->tx_pll_frac));
+	lprf_channel_switch_write_subreg(lprf, 8,
+			SR_PLL_VCO_TUNE, ch->vco_tune);
+
+	channel_switch->channel = channel;
+	channel_switch->complete = complete;
+	ret = spi_async(lprf->spi_device, &channel_switch->spi_message);
+	if (ret) {
+		atomic_dec(&channel_switch->is_active);
+		lprf_async_error(lprf, &lprf->state_change, ret);
+	}
+	return ret;
+}
+
+/**
+ * Writes the RX length counter asynchronously
+ *
+ * @lprf: lprf_local struct containing chip information
+ * @counter: new value of the RX length counter
+ * @complete: callback after the registers have been written
+ *
+ * The three counter registers are written with one spi message. Must only
+ * be called with state_change.transition_in_progress held, which makes sure
+ * the message is never used twice at the same time.
+ */
+static void lprf_async_set_rx_length(struct lprf_local *lprf, int counter,
+		void (*complete)(void *context))
+{
+	struct lprf_rx_length *rx_length = &lprf->rx_length;
+	int ret = 0;
+
+	lprf_prepare_write_subreg(lprf, rx_length->tx_buf[0],
+			SR_RX_LENGTH_H, BIT24_H_BYTE(counter));
+	lprf_prepare_write_subreg(lprf, rx_length->tx_buf[1],
+			SR_RX_LENGTH_M, BIT24_M_BYTE(counter));
+	lprf_prepare_write_subreg(lprf, rx_length->tx_buf[2],
+			SR_RX_LENGTH_L, BIT24_L_BYTE(counter));
+	rx_length->shortened = counter != rx_length->max_counter;
+
+	rx_length->spi_message.complete = complete;
+	ret = spi_async(lprf->spi_device, &rx_length->spi_message);
+	if (ret)
+		lprf_async_error(lprf, &lprf->state_change, ret);
+}
+
+static void lprf_evaluate_phy_status(struct lprf_local *lprf,
+		struct lprf_state_change *state_change, uint8_t phy_status);
+
+static void lprf_phy_status_complete(void *context)
+{
+	struct lprf_local *lprf = context;
+	struct lprf_state_change *state_change = &lprf->state_change;
+	struct lprf_phy_status *phy_status = &lprf->phy_status;
+	uint8_t status = phy_status->rx_buf[0];
+	atomic_dec(&lprf->phy_status.is_active);
+	lprf_evaluate_phy_status(lprf, state_change, status);
+}
+
+/**
+ * reads the physical status of the chip
  *
  * @phy_status: lprf_phy_status struct
  *
@@ -662,7 +1615,7 @@ static inline uint32_t calculate_rf_center_freq(int channel_number)
  * Calculates the PLL values from the rf_frequency and the
  * if_frequency. The rf_frequency can be calculated with
  * calculate_rf_center_freq(). The if_frequency should usually be
- * 1000000 for RX case and zero for TX case.
+ * LPRF_RX_IF_FREQ for RX case and zero for TX case.
  *
  * Returns zero on success or -EINVAL for invalid parameters.
  */
@@ -670,23 +1623,20 @@ static int lprf_calculate_pll_values(uint32_t rf_frequency,
 		uint32_t if_frequency,
 		int *int_val, int *frac_val)
 {
-	uint32_t f_lo = 0;
-	int frac_correction = 0;
+	u64 f_lo_x3 = 0;
+	u32 remainder = 0;
 
 	/*2.4 GHz Frontend*/
 	if (rf_frequency > 2000000000) {
-		f_lo = ( rf_frequency - if_frequency) / 3 * 2;
-		*int_val = f_lo  / 16000000;
-
 		/*
-		 * The exact formula would actually be
-		 * frac = (f_lo % 16MHz) * 65536 / 1MHz.
-		 * However, this would result in an integer overflow
-		 * and the linux system seems not to support 64bit
-		 * modulo operation. (228/3479) is the smallest error
-		 * possible without integer overflow.
+		 * f_lo = (f_rf - f_if) * 2 / 3
+		 * int = f_lo / 16MHz
+		 * frac = (f_lo % 16MHz) * 65536 / 1MHz
+		 * To avoid rounding errors f_lo is kept multiplied by three.
 		 */
-		*frac_val = (f_lo % 16000000) * 228 / 3479 + frac_correction;
+		f_lo_x3 = (u64)(rf_frequency - if_frequency) * 2;
+		*int_val = div_u64_rem(f_lo_x3, 3 * 16000000, &remainder);
+		*frac_val = div_u64((u64)remainder << 16, 3 * 1000000);
 		return 0;
 	}
 
@@ -696,6 +1646,304 @@ static int lprf_calculate_pll_values(uint32_t rf_frequency,
 }
 
 
+/*
+ * Tables of the Galois field GF(256) for the Reed-Solomon code of the
+ * forward error correction and generator polynomial of the code. The
+ * exponential table is doubled to save the modulo operation of
+ * multiplications.
+ */
+static u8 lprf_gf_exp[2 * 255];
+static u8 lprf_gf_log[256];
+static u8 lprf_rs_generator_log[LPRF_FEC_PARITY];
+
+/**
+ * Multiplies two elements of GF(256).
+ */
+static inline u8 lprf_gf_mul(u8 a, u8 b)
+{
+	if (!a || !b)
+		return 0;
+	return lprf_gf_exp[lprf_gf_log[a] + lprf_gf_log[b]];
+}
+
+/**
+ * Divides two elements of GF(256). b must not be zero.
+ */
+static inline u8 lprf_gf_div(u8 a, u8 b)
+{
+	if (!a)
+		return 0;
+	return lprf_gf_exp[lprf_gf_log[a] + 255 - lprf_gf_log[b]];
+}
+
+/**
+ * Calculates the tables of GF(256) and the generator polynomial
+ * (x - a^0)(x - a^1)...(x - a^(LPRF_FEC_PARITY - 1)) of the Reed-Solomon
+ * code. The coefficients of the generator polynomial are stored as
+ * logarithms, highest degree first without the leading one.
+ */
+static void lprf_fec_init_tables(void)
+{
+	u8 generator[LPRF_FEC_PARITY + 1] = {1};
+	int x = 1;
+	int i, j;
+
+	for (i = 0; i < 255; ++i) {
+		lprf_gf_exp[i] = x;
+		lprf_gf_exp[i + 255] = x;
+		lprf_gf_log[x] = i;
+		x <<= 1;
+		if (x & 0x100)
+			x ^= LPRF_FEC_POLY;
+	}
+
+	/* generator[j] is the coefficient of x^j */
+	for (i = 0; i < LPRF_FEC_PARITY; ++i) {
+		for (j = i + 1; j > 0; --j)
+			generator[j] = generator[j - 1] ^ lprf_gf_mul(
+					generator[j], lprf_gf_exp[i]);
+		generator[0] = lprf_gf_mul(generator[0], lprf_gf_exp[i]);
+	}
+
+	for (i = 0; i < LPRF_FEC_PARITY; ++i)
+		lprf_rs_generator_log[i] =
+				lprf_gf_log[generator[LPRF_FEC_PARITY - 1 - i]];
+}
+
+/**
+ * Returns the number of parity bytes the forward error correction adds to
+ * data_length bytes of data. The data is split into
+ * DIV_ROUND_UP(data_length, LPRF_FEC_BLOCK_DATA) interleaved codewords with
+ * LPRF_FEC_PARITY parity bytes each.
+ */
+static inline int lprf_fec_parity_length(int data_length)
+{
+	return DIV_ROUND_UP(data_length, LPRF_FEC_BLOCK_DATA) * LPRF_FEC_PARITY;
+}
+
+/**
+ * Returns the maximum number of data bytes that fit into a PSDU of
+ * psdu_length bytes together with their parity bytes.
+ */
+static inline int lprf_fec_max_data(int psdu_length)
+{
+	int remainder = psdu_length % LPRF_FEC_BLOCK;
+
+	return psdu_length / LPRF_FEC_BLOCK * LPRF_FEC_BLOCK_DATA +
+			max(remainder - LPRF_FEC_PARITY, 0);
+}
+
+/**
+ * Returns the offset of the first parity byte of a codeword from the end of
+ * the data, see lprf_fec_encode().
+ */
+static inline int lprf_fec_parity_offset(int codeword, int data_length,
+		int interleave)
+{
+	return (codeword - data_length % interleave + interleave) % interleave;
+}
+
+/**
+ * Encodes data with an interleaved, shortened Reed-Solomon code.
+ *
+ * @data: data to encode, followed by space for the parity bytes (see
+ * 	lprf_fec_parity_length())
+ * @data_length: number of data bytes
+ *
+ * Byte i of the encoded data belongs to codeword i % interleave, for the
+ * data as well as for the appended parity bytes. A burst error of the radio
+ * link is spread over all codewords this way. The data itself is left
+ * unchanged. Every codeword is able to correct LPRF_FEC_PARITY / 2 errors.
+ * The parity is calculated with the logarithms of the generator polynomial
+ * by a linear feedback shift register.
+ */
+static void lprf_fec_encode(u8 *data, int data_length)
+{
+	int interleave = DIV_ROUND_UP(data_length, LPRF_FEC_BLOCK_DATA);
+	u8 *parity = data + data_length;
+	u8 feedback, next;
+	int codeword, i, j;
+	u8 *p;
+
+	memset(parity, 0, interleave * LPRF_FEC_PARITY);
+
+	for (codeword = 0; codeword < interleave; ++codeword) {
+		p = parity + lprf_fec_parity_offset(codeword, data_length,
+				interleave);
+		for (i = codeword; i < data_length; i += interleave) {
+			feedback = data[i] ^ p[0];
+			for (j = 0; j < LPRF_FEC_PARITY; ++j) {
+				next = j < LPRF_FEC_PARITY - 1 ?
+						p[(j + 1) * interleave] : 0;
+				if (feedback)
+					next ^= lprf_gf_exp[
+						lprf_gf_log[feedback] +
+						lprf_rs_generator_log[j]];
+				p[j * interleave] = next;
+			}
+		}
+	}
+}
+
+/**
+ * Corrects one interleaved codeword in place.
+ *
+ * @data: first data byte of the codeword
+ * @data_length: number of data bytes of the codeword
+ * @parity: first parity byte of the codeword
+ * @interleave: distance of two bytes of the codeword
+ *
+ * The syndromes are calculated by Horner's method, the error locator
+ * polynomial by the Berlekamp-Massey algorithm, the error positions by a
+ * Chien search and the error values by the Forney algorithm. Returns the
+ * number of corrected bytes or -EBADMSG if the codeword can not be corrected.
+ */
+static int lprf_fec_decode_codeword(u8 *data, int data_length,
+		u8 *parity, int interleave)
+{
+	u8 syndromes[LPRF_FEC_PARITY];
+	u8 locator[LPRF_FEC_PARITY + 1] = {1};
+	u8 previous[LPRF_FEC_PARITY + 1] = {1};
+	u8 temp[LPRF_FEC_PARITY + 1];
+	u8 evaluator[LPRF_FEC_PARITY];
+	int length = data_length + LPRF_FEC_PARITY;
+	int errors = 0, shift = 1, corrected = 0;
+	u8 discrepancy, last_discrepancy = 1;
+	u8 x_inverse, value, derivative, *byte;
+	bool no_errors = true;
+	int i, j, position;
+
+	/* Syndromes S_i = r(a^i) */
+	for (i = 0; i < LPRF_FEC_PARITY; ++i) {
+		value = 0;
+		for (j = 0; j < length; ++j) {
+			byte = j < data_length ? &data[j * interleave] :
+					&parity[(j - data_length) * interleave];
+			value = lprf_gf_mul(value, lprf_gf_exp[i]) ^ *byte;
+		}
+		syndromes[i] = value;
+		if (value)
+			no_errors = false;
+	}
+	if (no_errors)
+		return 0;
+
+	/* Berlekamp-Massey */
+	for (i = 0; i < LPRF_FEC_PARITY; ++i) {
+		discrepancy = syndromes[i];
+		for (j = 1; j <= errors; ++j)
+			discrepancy ^= lprf_gf_mul(locator[j],
+					syndromes[i - j]);
+		if (!discrepancy) {
+			shift++;
+			continue;
+		}
+
+		memcpy(temp, locator, sizeof(temp));
+		value = lprf_gf_div(discrepancy, last_discrepancy);
+		for (j = shift; j <= LPRF_FEC_PARITY; ++j)
+			locator[j] ^= lprf_gf_mul(value, previous[j - shift]);
+
+		if (2 * errors <= i) {
+			errors = i + 1 - errors;
+			memcpy(previous, temp, sizeof(previous));
+			last_discrepancy = discrepancy;
+			shift = 1;
+		} else {
+			shift++;
+		}
+	}
+	if (errors > LPRF_FEC_PARITY / 2)
+		return -EBADMSG;
+
+	/* Error evaluator Omega(x) = S(x) * Lambda(x) mod x^LPRF_FEC_PARITY */
+	for (i = 0; i < LPRF_FEC_PARITY; ++i) {
+		evaluator[i] = 0;
+		for (j = 0; j <= i && j <= errors; ++j)
+			evaluator[i] ^= lprf_gf_mul(locator[j],
+					syndromes[i - j]);
+	}
+
+	/* Chien search and Forney algorithm */
+	for (j = 0; j < length; ++j) {
+		position = length - 1 - j;
+		x_inverse = lprf_gf_exp[(255 - position) % 255];
+
+		value = 0;
+		for (i = errors; i >= 0; --i)
+			value = lprf_gf_mul(value, x_inverse) ^ locator[i];
+		if (value)
+			continue;
+
+		/* Formal derivative, only odd powers remain in GF(2^m) */
+		derivative = 0;
+		for (i = errors - (errors % 2 == 0); i >= 1; i -= 2)
+			derivative = lprf_gf_mul(derivative, lprf_gf_mul(
+					x_inverse, x_inverse)) ^ locator[i];
+		value = 0;
+		for (i = LPRF_FEC_PARITY - 1; i >= 0; --i)
+			value = lprf_gf_mul(value, x_inverse) ^ evaluator[i];
+		if (!derivative)
+			return -EBADMSG;
+
+		byte = j < data_length ? &data[j * interleave] :
+				&parity[(j - data_length) * interleave];
+		*byte ^= lprf_gf_mul(lprf_gf_exp[position],
+				lprf_gf_div(value, derivative));
+		corrected++;
+	}
+
+	if (corrected != errors)
+		return -EBADMSG;
+
+	return corrected;
+}
+
+/**
+ * Corrects a frame encoded by lprf_fec_encode() in place.
+ *
+ * @fec: statistics of the forward error correction
+ * @psdu: received data including the parity bytes
+ * @psdu_length: number of received bytes
+ * @corrected: set to the number of corrected bytes
+ *
+ * Returns the number of data bytes or -EBADMSG if the frame could not be
+ * corrected.
+ */
+static int lprf_fec_decode(struct lprf_fec *fec, u8 *psdu, int psdu_length,
+		int *corrected)
+{
+	int interleave = DIV_ROUND_UP(psdu_length, LPRF_FEC_BLOCK);
+	int data_length = psdu_length - interleave * LPRF_FEC_PARITY;
+	int codeword, ret;
+
+	*corrected = 0;
+
+	if (data_length <= 0)
+		return -EBADMSG;
+
+	for (codeword = 0; codeword < interleave; ++codeword) {
+		ret = lprf_fec_decode_codeword(psdu + codeword,
+				(data_length - codeword + interleave - 1) /
+				interleave, psdu + data_length +
+				lprf_fec_parity_offset(codeword, data_length,
+				interleave), interleave);
+		if (ret < 0) {
+			fec->failed_frames++;
+			return ret;
+		}
+		*corrected += ret;
+	}
+
+	if (*corrected) {
+		PRINT_KRIT("FEC corrected %d bytes", *corrected);
+		fec->corrected_frames++;
+		fec->corrected_bytes += *corrected;
+	}
+	return data_length;
+}
+
+
 /***
  *      ____   _          _
  *     / ___| | |_  __ _ | |_  ___  ___
@@ -744,6 +1992,37 @@ static inline void lprf_stop_polling(struct lprf_local *lprf)
 	PRINT_KRIT("RX Data Polling stopped.");
 }
 
+/**
+ * Restarts the polling after it has been stopped for synchronous access to
+ * the chip.
+ *
+ * A burst ends and a frame that has not been sent completely is queued
+ * again. A partly drained frame is dropped and the RX length counter is set
+ * for maximum length frames again.
+ */
+static void lprf_resume_polling(struct lprf_local *lprf)
+{
+	struct lprf_state_change *state_change = &lprf->state_change;
+
+	lprf_write_subreg(lprf, RG_SM_TX_SET, LPRF_TX_MODE_MASK, 0,
+			LPRF_TX_MODE_NORMAL);
+	if (lprf->rx_length.shortened)
+		lprf_write_rx_length(lprf, lprf->rx_length.max_counter);
+
+	if (lprf->tx_skb && !state_change->tx_complete) {
+		skb_queue_head(&lprf->tx_queue, lprf->tx_skb);
+		lprf->tx_skb = NULL;
+	}
+	state_change->tx_burst = false;
+	lprf->rx_drain.length = 0;
+
+	atomic_set(&state_change->transition_in_progress, 0);
+	atomic_set(&lprf->phy_status.is_active, 0);
+
+	atomic_set(&lprf->rx_polling_active, 1);
+	lprf_phy_status_async(&lprf->phy_status);
+}
+
 /**
  * Starts the polling of physical status information by executing
  * lprf_phy_status_async(). This function is typically called as a timer
@@ -763,6 +2042,33 @@ static enum hrtimer_restart lprf_start_poll(struct hrtimer *timer)
 	return HRTIMER_NORESTART;
 }
 
+static void lprf_char_deliver(u32 reader_id,
+		const struct lprf_rx_record *record, const uint8_t *data,
+		int length);
+
+/**
+ * Writes a completion record of a sent frame to the reader that queued the
+ * frame. Only frames queued by LPRF_IOC_SEND_BATCH with
+ * LPRF_TX_FRAME_REPORT are reported. The record is dropped if the reader
+ * has been closed in the meantime.
+ */
+static void lprf_report_tx(struct sk_buff *skb)
+{
+	struct lprf_tx_completion completion = {
+		.queued_ns = ktime_to_ns(LPRF_SKB_CB(skb)->queued),
+		.id = LPRF_SKB_CB(skb)->id,
+	};
+	struct lprf_rx_record record = {
+		.timestamp_ns = ktime_get_ns(),
+		.length = sizeof(completion),
+		.status = LPRF_RX_STATUS_TX_DONE,
+	};
+
+	lprf_char_deliver(LPRF_SKB_CB(skb)->reader_id, &record,
+			(uint8_t *)&completion, sizeof(completion));
+	wake_up(&lprf_char_driver_interface.wait_for_rx_data);
+}
+
 /**
  * Calls ieee802154_xmit_complete() to signal the IEEE 802.15.4 stack that
  * the data transmission completed successfully and the chip is ready for
@@ -773,22 +2079,68 @@ static void lprf_tx_complete(struct lprf_local *lprf)
 {
 	struct sk_buff *skb_temp = lprf->tx_skb;
 	lprf->tx_skb = 0;
-	if (lprf->free_skb) /* Data from char driver */
+	if (LPRF_SKB_CB(skb_temp)->report)
+		lprf_report_tx(skb_temp);
+	if (LPRF_SKB_CB(skb_temp)->free_skb) /* Data from char driver */
 		kfree_skb(skb_temp);
 	else /* IEEE 802.15.4 data */
 		ieee802154_xmit_complete(lprf->hw, skb_temp, false);
-	lprf->free_skb = false;
 	lprf->state_change.tx_complete = false;
 	wake_up(&lprf_char_driver_interface.wait_for_tx_ready);
 	PRINT_KRIT("TX data send successfully");
 }
 
+/**
+ * Waits after lprf_stop_polling() until the asynchronous SPI access has
+ * finished and a frame that the chip is still sending has left the chip.
+ * The frame is completed with lprf_tx_complete(), so that
+ * lprf_resume_polling() does not queue it again.
+ *
+ * Returns -ETIMEDOUT if the chip is not idle after LPRF_IDLE_TIMEOUT_MS.
+ */
+static int lprf_wait_for_idle(struct lprf_local *lprf)
+{
+	struct lprf_state_change *state_change = &lprf->state_change;
+	unsigned long timeout = jiffies +
+			msecs_to_jiffies(LPRF_IDLE_TIMEOUT_MS);
+	int phy_status = 0;
+
+	while (atomic_read(&state_change->transition_in_progress) ||
+			atomic_read(&lprf->phy_status.is_active)) {
+		if (time_after(jiffies, timeout))
+			return -ETIMEDOUT;
+		usleep_range(100, 200);
+	}
+
+	while (state_change->tx_complete) {
+		phy_status = lprf_read_phy_status(lprf);
+		if (phy_status < 0)
+			return phy_status;
+
+		if (PHY_SM_STATUS(phy_status) != PHY_SM_SENDING &&
+				(!state_change->tx_burst ||
+				PHY_FIFO_EMPTY(phy_status))) {
+			lprf_tx_complete(lprf);
+			break;
+		}
+
+		if (time_after(jiffies, timeout))
+			return -ETIMEDOUT;
+		usleep_range(100, 200);
+	}
+
+	return 0;
+}
+
 /**
  * Is called after the transition to TX mode completed successfully. Note
  * that the chip is still in TX mode and busy sending data when this
  * function is called. The complete transmission of data is only finished
  * when the chip has changed back to sleep mode or rx mode and
  * lprf_tx_complete() is called.
+ *
+ * In burst mode this is also the callback of the frame write, as the chip
+ * starts sending by itself as soon as the FIFO contains a frame.
  */
 static void lprf_tx_change_complete(void *context)
 {
@@ -798,7 +2150,7 @@ static void lprf_tx_change_complete(void *context)
 	state_change->tx_complete = true;
 	atomic_dec(&lprf->state_change.transition_in_progress);
 
-	lprf_start_polling_timer(lprf, TX_RX_INTERVAL);
+	lprf_start_polling_timer(lprf, lprf->rate.tx_rx_interval);
 }
 
 /**
@@ -812,88 +2164,337 @@ static void __lprf_frame_write_complete(void *context)
 
 	PRINT_KRIT("Spi Frame Write completed");
 
-	lprf_async_write_subreg(state_change, state_change->sm_main_value,
-			SR_SM_COMMAND, STATE_CMD_TX, lprf_tx_change_complete);
+	lprf_async_write_subreg(state_change, SR_SM_COMMAND, STATE_CMD_TX,
+			lprf_tx_change_complete);
 
 	PRINT_KRIT("Change state to TX");
 }
 
 /**
- * Starts a frame write via SPI. The Chip should be in sleep mode and otherwise
- * ready for sending data (see lprf_resets()).
+ * Returns the length of the synchronization header (preamble and SFD) that
+ * is currently used.
  */
-static int lprf_start_frame_write(struct lprf_local *lprf)
+static inline int lprf_shr_length(struct lprf_local *lprf)
+{
+	return lprf->shr.preamble_length + 1;
+}
+
+/**
+ * Returns the length of the physical header of IEEE 802.15.4 frames or of
+ * long frames.
+ */
+static inline int lprf_phr_length(bool long_frame)
+{
+	return long_frame ? LPRF_LONG_PHR_LENGTH : PHY_HEADER_LENGTH;
+}
+
+/**
+ * Returns the maximum PSDU length of IEEE 802.15.4 frames or of long frames.
+ */
+static inline int lprf_max_psdu_length(bool long_frame)
+{
+	return long_frame ? LPRF_LONG_MAX_PSDU : IEEE802154_MTU;
+}
+
+/**
+ * Returns the maximum number of bytes a frame of the char driver interface
+ * carries in the current frame mode, without the parity bytes of the forward
+ * error correction.
+ */
+static inline int lprf_max_char_payload(struct lprf_local *lprf)
+{
+	int max_length = lprf_max_psdu_length(lprf->long_frames);
+
+	if (lprf->fec.enabled)
+		return lprf_fec_max_data(max_length);
+	return max_length;
+}
+
+/**
+ * Returns the maximum number of bytes the chip receives for one frame in the
+ * current frame mode, see FRAME_LENGTH and LPRF_LONG_FRAME_LENGTH.
+ */
+static inline int lprf_max_frame_length(struct lprf_local *lprf)
+{
+	return lprf->long_frames ? LPRF_LONG_FRAME_LENGTH : FRAME_LENGTH;
+}
+
+/**
+ * Builds the spi frame write command for a frame.
+ *
+ * @lprf: lprf_local struct containing chip information
+ * @buf: buffer for the spi transfer, at least MAX_SPI_BUFFER_SIZE bytes
+ * @payload: PSDU of the frame
+ * @payload_length: length of the PSDU
+ * @long_frame: true for the two byte physical header of long frames
+ * @fec: true to append the parity bytes of the forward error correction
+ *
+ * The synchronization header set in lprf.shr and the physical header are
+ * added in front of the payload and the bit order of the frame is reversed
+ * as needed by the chip. Returns the length of the spi transfer.
+ */
+static int lprf_build_frame(struct lprf_local *lprf, uint8_t *buf,
+		const uint8_t *payload, int payload_length, bool long_frame,
+		bool fec)
 {
-	int ret = 0;
 	int i;
-	int payload_length = 0;
 	int frame_length = 0;
 	int shr_index, phr_index, payload_index;
-	struct lprf_state_change *state_change = &lprf->state_change;
+	int shr_length = lprf_shr_length(lprf);
+	int phr_length = lprf_phr_length(long_frame);
+	int data_length = payload_length;
 
-	payload_length = lprf->tx_skb->len;
-	frame_length = sizeof(SYNC_HEADER) +
-			PHY_HEADER_LENGTH +
+	if (fec)
+		payload_length += lprf_fec_parity_length(data_length);
+
+	frame_length = shr_length +
+			phr_length +
 			payload_length;
 
 	shr_index = 2;
-	phr_index = shr_index + sizeof(SYNC_HEADER);
-	payload_index = phr_index + PHY_HEADER_LENGTH;
+	phr_index = shr_index + shr_length;
+	payload_index = phr_index + phr_length;
 
-	state_change->tx_buf[0] = FRMW;
-	state_change->tx_buf[1] = frame_length;
+	buf[0] = FRMW;
+	buf[1] = frame_length;
 
-	memcpy(state_change->tx_buf + shr_index,
-			SYNC_HEADER, sizeof(SYNC_HEADER));
+	memset(buf + shr_index, LPRF_PREAMBLE_BYTE, shr_length - 1);
+	buf[phr_index - 1] = lprf->shr.sfd;
 
-	state_change->tx_buf[phr_index] = payload_length;
+	buf[phr_index] = payload_length;
+	if (long_frame)
+		buf[phr_index + 1] = (payload_length &
+				LPRF_LONG_PSDU_LENGTH_MASK) >> 8;
 
-	memcpy(state_change->tx_buf + payload_index,
-			lprf->tx_skb->data, lprf->tx_skb->len);
+	memcpy(buf + payload_index, payload, data_length);
+	if (fec)
+		lprf_fec_encode(buf + payload_index, data_length);
 
 	for(i = 0; i < frame_length; ++i)
-		reverse_bit_order(&state_change->tx_buf[shr_index + i]);
+		reverse_bit_order(&buf[shr_index + i]);
+
+	return frame_length + 2;
+}
+
+/**
+ * Writes the frame of lprf.tx_skb to the chip FIFO via SPI.
+ *
+ * @lprf: lprf_local struct containing chip information
+ * @complete: callback of the frame write
+ */
+static void __lprf_write_tx_frame(struct lprf_local *lprf,
+		void (*complete)(void *context))
+{
+	int ret = 0;
+	struct lprf_state_change *state_change = &lprf->state_change;
 
-	state_change->spi_message.complete = __lprf_frame_write_complete;
-	state_change->spi_transfer.len = frame_length + 2;
+	state_change->spi_message.complete = complete;
+	state_change->spi_transfer.len = lprf_build_frame(lprf,
+			state_change->tx_buf, lprf->tx_skb->data,
+			lprf->tx_skb->len,
+			LPRF_SKB_CB(lprf->tx_skb)->long_frame,
+			LPRF_SKB_CB(lprf->tx_skb)->fec);
 
 	ret = spi_async(lprf->spi_device, &state_change->spi_message);
 	if (ret)
-		PRINT_KRIT("Async_spi returned with error code %d", ret);
-	return 0;
+		lprf_async_error(lprf, state_change, ret);
 }
 
 /**
- * callback function of CMD_RX command. Called after the chip successfully
- * changed to RX mode.
+ * Starts a frame write via SPI. The Chip should be in sleep mode and otherwise
+ * ready for sending data (see lprf_resets()).
  */
-void lprf_rx_change_complete(void *context)
+static void lprf_start_frame_write(void *context)
 {
-	struct lprf_local *lprf = context;
-	struct lprf_state_change *state_change = &lprf->state_change;
-
-	atomic_dec(&state_change->transition_in_progress);
+	__lprf_write_tx_frame(context, __lprf_frame_write_complete);
+}
 
-	lprf_start_polling_timer(lprf, RX_RX_INTERVAL);
+/**
+ * Sets the TX related state machine settings in RG_SM_TX_SET asynchronously
+ *
+ * @state_change: current state change struct
+ * @mode: LPRF_TX_MODE_NORMAL or LPRF_TX_MODE_BURST
+ * @complete: completion callback of the register write
+ */
+static void lprf_async_set_tx_mode(struct lprf_state_change *state_change,
+		uint8_t mode, void (*complete)(void *context))
+{
+	lprf_async_write_subreg(state_change, RG_SM_TX_SET,
+			LPRF_TX_MODE_MASK, 0, mode, complete);
 }
 
+static void lprf_rx_resets(void *context);
+
 /**
- * Compares number_of_bits bits starting from the LSB and returns
- * the number of equal bits. This is needed to find the start of frame
- * delimiter of received data.
+ * Returns the TX power level (SR_TX_PWR_CTRL) a queued frame is sent with.
  */
-static inline int number_of_equal_bits(uint32_t x1, uint32_t x2,
-		int number_of_bits)
+static inline int lprf_tx_power_level(struct lprf_local *lprf,
+		struct sk_buff *skb)
 {
-	int i = 0;
-	int counter = 0;
-	uint32_t combined = ~(x1 ^ x2);
+	int level = LPRF_SKB_CB(skb)->tx_power;
 
-	for (i = 0; i < number_of_bits; ++i) {
-		counter += combined & 1;
-		combined >>= 1;
-	}
-	return counter;
+	return level == LPRF_DEFAULT_TX_POWER ? lprf->tx_power : level;
+}
+
+/**
+ * Returns the TX power level that is currently set on the chip.
+ */
+static inline int lprf_chip_tx_power(struct lprf_local *lprf)
+{
+	return (lprf->reg_shadow.value[RG_SM_TX_POWER_CTRL] &
+			SUBREG_MASK(SR_TX_PWR_CTRL)) >>
+			SUBREG_SHIFT(SR_TX_PWR_CTRL);
+}
+
+/**
+ * Returns true if a queued frame may be sent now.
+ *
+ * @lprf: lprf_local struct
+ * @skb: queued frame
+ * @power_level: TX power level the frame has to be sent with or
+ * 	LPRF_DEFAULT_TX_POWER if the TX power level does not matter
+ * @now: current time
+ */
+static bool lprf_tx_frame_ready(struct lprf_local *lprf, struct sk_buff *skb,
+		int power_level, ktime_t now)
+{
+	if (ktime_after(LPRF_SKB_CB(skb)->send_time, now))
+		return false;
+
+	return power_level == LPRF_DEFAULT_TX_POWER ||
+			lprf_tx_power_level(lprf, skb) == power_level;
+}
+
+/**
+ * Dequeues the next frame of the TX queue if it may be sent now.
+ *
+ * @lprf: lprf_local struct
+ * @power_level: TX power level of the current burst or
+ * 	LPRF_DEFAULT_TX_POWER if no burst is active
+ *
+ * Frames are sent in the order they were queued. If the send time of the
+ * next frame has not been reached yet, tx_timer is started to poll the chip
+ * at the send time. Returns NULL if no frame may be sent now.
+ */
+static struct sk_buff *lprf_tx_dequeue(struct lprf_local *lprf,
+		int power_level)
+{
+	struct sk_buff *skb;
+	unsigned long flags;
+	ktime_t now = ktime_get();
+
+	spin_lock_irqsave(&lprf->tx_queue.lock, flags);
+	skb = skb_peek(&lprf->tx_queue);
+	if (skb && lprf_tx_frame_ready(lprf, skb, power_level, now)) {
+		__skb_unlink(skb, &lprf->tx_queue);
+	} else {
+		if (skb && ktime_after(LPRF_SKB_CB(skb)->send_time, now))
+			hrtimer_start(&lprf->tx_timer,
+					LPRF_SKB_CB(skb)->send_time,
+					HRTIMER_MODE_ABS);
+		skb = NULL;
+	}
+	spin_unlock_irqrestore(&lprf->tx_queue.lock, flags);
+
+	return skb;
+}
+
+/**
+ * Returns true if the next frame of the TX queue may be sent now with the
+ * given TX power level, so it can follow the current frame in a burst.
+ */
+static bool lprf_tx_next_ready(struct lprf_local *lprf, int power_level)
+{
+	struct sk_buff *skb;
+	unsigned long flags;
+	bool ready = false;
+
+	spin_lock_irqsave(&lprf->tx_queue.lock, flags);
+	skb = skb_peek(&lprf->tx_queue);
+	if (skb)
+		ready = lprf_tx_frame_ready(lprf, skb, power_level,
+				ktime_get());
+	spin_unlock_irqrestore(&lprf->tx_queue.lock, flags);
+
+	return ready;
+}
+
+/**
+ * Timer callback polling the chip when the send time of the next queued
+ * frame is reached.
+ */
+static enum hrtimer_restart lprf_tx_timer(struct hrtimer *timer)
+{
+	struct lprf_local *lprf =
+			container_of(timer, struct lprf_local, tx_timer);
+
+	if (atomic_read(&lprf->rx_polling_active))
+		lprf_phy_status_async(&lprf->phy_status);
+
+	return HRTIMER_NORESTART;
+}
+
+/**
+ * Continues a burst transmission. Must only be called if the chip is in TX
+ * idle mode with an empty FIFO.
+ *
+ * In burst mode the chip stays in TX idle mode after sending a frame and
+ * starts sending again as soon as the next frame is written to the FIFO
+ * (SR_TX_IDLE_MODE_EN and SR_TX_ON_FIFO_IDLE). This way the PLL keeps
+ * running and no state change and no resets are needed between the frames.
+ * If the TX queue is empty or the next frame is not due yet or needs another
+ * TX power level, the normal TX settings are restored and the chip changes
+ * back to RX mode.
+ */
+static void lprf_burst_next_frame(struct lprf_local *lprf)
+{
+	struct lprf_state_change *state_change = &lprf->state_change;
+
+	lprf->tx_skb = lprf_tx_dequeue(lprf, lprf_chip_tx_power(lprf));
+	if (lprf->tx_skb) {
+		__lprf_write_tx_frame(lprf, lprf_tx_change_complete);
+		PRINT_KRIT("Next frame of TX burst");
+		return;
+	}
+
+	state_change->tx_burst = false;
+	state_change->to_state = STATE_CMD_RX;
+	lprf_async_set_tx_mode(state_change, LPRF_TX_MODE_NORMAL,
+			lprf_rx_resets);
+	PRINT_KRIT("TX burst finished, will change state to RX...");
+}
+
+/**
+ * callback function of CMD_RX command. Called after the chip successfully
+ * changed to RX mode.
+ */
+void lprf_rx_change_complete(void *context)
+{
+	struct lprf_local *lprf = context;
+	struct lprf_state_change *state_change = &lprf->state_change;
+
+	atomic_dec(&state_change->transition_in_progress);
+
+	lprf_start_polling_timer(lprf, lprf->rate.rx_rx_interval);
+}
+
+/**
+ * Compares number_of_bits bits starting from the LSB and returns
+ * the number of equal bits. This is needed to find the start of frame
+ * delimiter of received data.
+ */
+static inline int number_of_equal_bits(uint32_t x1, uint32_t x2,
+		int number_of_bits)
+{
+	int i = 0;
+	int counter = 0;
+	uint32_t combined = ~(x1 ^ x2);
+
+	for (i = 0; i < number_of_bits; ++i) {
+		counter += combined & 1;
+		combined >>= 1;
+	}
+	return counter;
 }
 
 /**
@@ -959,6 +2560,360 @@ static int find_SFD_and_shift_data(uint8_t *data, int *data_length,
 	return shift;
 }
 
+/**
+ * Decides by the MAC header of a received frame whether the frame needs to
+ * be delivered to the IEEE 802.15.4 stack.
+ *
+ * @lprf: lprf_local struct
+ * @psdu: received frame starting with the frame control field
+ * @psdu_length: length of the frame in bytes
+ *
+ * The lprf chip has no hardware address filter. Therefore the filtering is
+ * done in software before a socket buffer is allocated for the frame. Frames
+ * without destination address (like acknowledgements and beacons), broadcast
+ * frames and frames addressed to the values set in lprf_set_hw_addr_filt()
+ * are accepted. In promiscuous mode every frame is accepted.
+ */
+static bool lprf_frame_is_for_us(struct lprf_local *lprf,
+		const uint8_t *psdu, int psdu_length)
+{
+	struct ieee802154_hw_addr_filt addr_filt;
+	unsigned long flags;
+	bool promiscuous;
+	uint16_t frame_control;
+	uint16_t dst_pan_id;
+	int dst_addr_mode;
+
+	spin_lock_irqsave(&lprf->addr_filt_lock, flags);
+	addr_filt = lprf->addr_filt;
+	promiscuous = lprf->promiscuous;
+	spin_unlock_irqrestore(&lprf->addr_filt_lock, flags);
+
+	if (promiscuous)
+		return true;
+
+	if (psdu_length < MAC_DST_PAN_OFFSET)
+		return false;
+
+	frame_control = get_unaligned_le16(psdu);
+	dst_addr_mode = MAC_FC_DST_ADDR_MODE(frame_control);
+	if (dst_addr_mode == MAC_ADDR_MODE_NONE)
+		return true;
+
+	if (psdu_length < MAC_DST_ADDR_OFFSET +
+			(dst_addr_mode == MAC_ADDR_MODE_LONG ? 8 : 2))
+		return false;
+
+	dst_pan_id = get_unaligned_le16(psdu + MAC_DST_PAN_OFFSET);
+	if (dst_pan_id != MAC_BROADCAST &&
+			dst_pan_id != le16_to_cpu(addr_filt.pan_id))
+		return false;
+
+	switch (dst_addr_mode) {
+	case MAC_ADDR_MODE_SHORT:
+		return get_unaligned_le16(psdu + MAC_DST_ADDR_OFFSET) ==
+				MAC_BROADCAST ||
+			get_unaligned_le16(psdu + MAC_DST_ADDR_OFFSET) ==
+				le16_to_cpu(addr_filt.short_addr);
+	case MAC_ADDR_MODE_LONG:
+		return get_unaligned_le64(psdu + MAC_DST_ADDR_OFFSET) ==
+				le64_to_cpu(addr_filt.ieee_addr);
+	default:
+		return false;
+	}
+}
+
+/**
+ * Counts received frames with a valid SFD and those of them with a bad
+ * length. If too many frames of one window are corrupted, the VCO tune value
+ * of the current channel is probably wrong and a recalibration is started,
+ * at most once every LPRF_VCO_CAL_INTERVAL_MS. Frames without SFD are
+ * mostly noise and are not counted. Called in interrupt context.
+ */
+static void lprf_count_rx_frame(struct lprf_local *lprf, bool corrupted)
+{
+	struct lprf_vco_cal *vco_cal = &lprf->vco_cal;
+	int errors = 0;
+
+	if (corrupted)
+		errors = atomic_inc_return(&vco_cal->rx_errors);
+	else
+		errors = atomic_read(&vco_cal->rx_errors);
+
+	if (atomic_inc_return(&vco_cal->rx_frames) < LPRF_VCO_CAL_WINDOW)
+		return;
+
+	atomic_set(&vco_cal->rx_frames, 0);
+	atomic_set(&vco_cal->rx_errors, 0);
+
+	if (errors > LPRF_VCO_CAL_MAX_ERRORS && time_after_eq(jiffies,
+			READ_ONCE(vco_cal->next_check))) {
+		PRINT_DEBUG("%d of %d frames corrupted, recalibrate VCO",
+				errors, LPRF_VCO_CAL_WINDOW);
+		queue_work(lprf->wq, &vco_cal->work);
+	}
+}
+
+/**
+ * Returns the PSDU length of the two byte physical header of a long frame.
+ */
+static inline int lprf_long_psdu_length(const uint8_t *phr)
+{
+	return (phr[0] | (phr[1] << 8)) & LPRF_LONG_PSDU_LENGTH_MASK;
+}
+
+/**
+ * Returns true if the char device is opened by at least one reader.
+ */
+static inline bool lprf_char_has_readers(void)
+{
+	return !list_empty(&lprf_char_driver_interface.readers);
+}
+
+/**
+ * Stores a received frame as record in the next slot of an RX ring.
+ *
+ * @rx_ring: RX ring of a reader
+ * @record: header of the record
+ * @data: frame bytes following the header
+ * @length: number of frame bytes
+ *
+ * The slot is handed to user space by its status word after the record has
+ * been written completely. The data cache is flushed for the status word,
+ * as user space accesses the slot by another virtual address. A frame is
+ * dropped if the next slot still belongs to user space, the next stored
+ * record has LPRF_RX_STATUS_OVERFLOW set then. Returns false if the ring
+ * does not exist.
+ */
+static bool lprf_rx_ring_store(struct lprf_rx_ring *rx_ring,
+		const struct lprf_rx_record *record, const uint8_t *data,
+		int length)
+{
+	struct lprf_rx_slot *slot;
+	struct page *page;
+	unsigned long flags;
+
+	spin_lock_irqsave(&rx_ring->lock, flags);
+	if (!rx_ring->slots) {
+		spin_unlock_irqrestore(&rx_ring->lock, flags);
+		return false;
+	}
+
+	slot = &rx_ring->slots[rx_ring->head];
+	page = vmalloc_to_page(slot);
+	flush_dcache_page(page);
+	if (smp_load_acquire(&slot->status) != LPRF_SLOT_KERNEL) {
+		rx_ring->overflow = true;
+		rx_ring->dropped++;
+		atomic_inc(&lprf_char_driver_interface.rx_ring_dropped);
+		goto unlock;
+	}
+
+	slot->record = *record;
+	slot->record.length = min_t(int, length, sizeof(slot->data));
+	if (rx_ring->overflow)
+		slot->record.status |= LPRF_RX_STATUS_OVERFLOW;
+	rx_ring->overflow = false;
+	memcpy(slot->data, data, slot->record.length);
+	smp_store_release(&slot->status, LPRF_SLOT_USER);
+	flush_dcache_page(page);
+
+	rx_ring->head = (rx_ring->head + 1) & (rx_ring->num_slots - 1);
+	atomic_inc(&lprf_char_driver_interface.rx_ring_frames);
+
+unlock:
+	spin_unlock_irqrestore(&rx_ring->lock, flags);
+	return true;
+}
+
+static void lprf_char_frame_release(struct kref *ref)
+{
+	kfree(container_of(ref, struct lprf_char_frame, ref));
+}
+
+/**
+ * Counts a frame that is dropped for a reader, because its read() buffer is
+ * full or no memory is available. The next record of the reader gets
+ * LPRF_RX_STATUS_OVERFLOW. Needs to be called with
+ * lprf_char_driver_interface.lock held.
+ */
+static void lprf_char_drop(struct lprf_char_reader *reader, bool record)
+{
+	reader->overflow = true;
+	reader->dropped++;
+	if (record)
+		lprf_char_driver_interface.dropped_records++;
+	else
+		lprf_char_driver_interface.dropped_data++;
+}
+
+/**
+ * Delivers received data to all readers of the char driver interface.
+ *
+ * @reader_id: id of the only reader to deliver the data to or zero for all
+ * 	readers. Nothing is delivered if the reader has been closed.
+ * @record: header of a record for readers in record mode or NULL for raw
+ * 	data, which is delivered to readers in byte stream mode
+ * @data: received data following the header
+ * @length: number of bytes of data
+ *
+ * Records are stored in the RX ring of readers that created one, raw data
+ * is not delivered to them. For all other readers the data is copied only
+ * once into a reference counted struct lprf_char_frame, which every reader
+ * buffer refers to. Frames that do not fit into the buffer of a reader are
+ * dropped and counted for this reader (see lprf_char_drop()), so a reader
+ * never gets a partial record.
+ */
+static void lprf_char_deliver(u32 reader_id,
+		const struct lprf_rx_record *record, const uint8_t *data,
+		int length)
+{
+	struct lprf_char_driver_interface *char_driver =
+			&lprf_char_driver_interface;
+	int header_length = record ? sizeof(*record) : 0;
+	struct lprf_char_frame *frame = NULL;
+	struct lprf_char_reader *reader;
+	struct lprf_char_entry entry;
+	bool no_memory = false;
+	unsigned long flags;
+
+	spin_lock_irqsave(&char_driver->lock, flags);
+	list_for_each_entry(reader, &char_driver->readers, list) {
+		if (reader_id && reader->id != reader_id)
+			continue;
+		if (record && lprf_rx_ring_store(&reader->rx_ring, record,
+				data, length))
+			continue;
+		if (reader->records != !!record ||
+				READ_ONCE(reader->rx_ring.slots))
+			continue;
+
+		if (!frame && !no_memory && !kfifo_is_full(&reader->frames)) {
+			frame = kmalloc(sizeof(*frame) + header_length +
+					length, GFP_ATOMIC);
+			no_memory = !frame;
+			if (frame) {
+				kref_init(&frame->ref);
+				frame->length = header_length + length;
+				if (record)
+					memcpy(frame->data, record,
+							header_length);
+				memcpy(frame->data + header_length, data,
+						length);
+			}
+		}
+
+		if (!frame || kfifo_is_full(&reader->frames)) {
+			lprf_char_drop(reader, record);
+			continue;
+		}
+
+		kref_get(&frame->ref);
+		entry.frame = frame;
+		entry.overflow = reader->overflow;
+		kfifo_put(&reader->frames, entry);
+		reader->overflow = false;
+		reader->received++;
+	}
+	spin_unlock_irqrestore(&char_driver->lock, flags);
+
+	if (frame)
+		kref_put(&frame->ref, lprf_char_frame_release);
+}
+
+/**
+ * Delivers a received frame as one record to all readers in record mode and
+ * to all RX rings.
+ *
+ * @record: header of the record, completed by the length of data
+ * @data: frame bytes following the header
+ * @length: number of frame bytes
+ */
+static void lprf_char_record(struct lprf_rx_record *record,
+		const uint8_t *data, int length)
+{
+	if (!lprf_char_has_readers())
+		return;
+
+	record->length = length;
+	lprf_char_deliver(0, record, data, length);
+}
+
+/**
+ * Unpacks the payloads of a received aggregated frame into the char driver
+ * buffer.
+ *
+ * @lprf: lprf_local struct
+ * @record: record header of the frame
+ * @psdu: received frame, starting with the first sub-frame header
+ * @psdu_length: length of the frame in bytes
+ *
+ * Every payload is written together with its sub-frame header, so a reader
+ * is able to separate the payloads again. Readers in record mode and RX
+ * rings get every payload as record of its own instead. Unpacking stops at
+ * the first sub-frame header that is zero or exceeds the frame.
+ */
+static void lprf_deaggregate(struct lprf_local *lprf,
+		struct lprf_rx_record *record, const uint8_t *psdu,
+		int psdu_length)
+{
+	int offset = 0;
+	int length = 0;
+
+	if (!lprf_char_has_readers())
+		return;
+
+	record->status |= LPRF_RX_STATUS_AGGREGATED;
+	while (offset + LPRF_AGG_HEADER_LENGTH < psdu_length) {
+		length = LPRF_AGG_HEADER_LENGTH + psdu[offset];
+		if (length == LPRF_AGG_HEADER_LENGTH ||
+				offset + length > psdu_length)
+			break;
+
+		lprf_char_record(record,
+				psdu + offset + LPRF_AGG_HEADER_LENGTH,
+				length - LPRF_AGG_HEADER_LENGTH);
+		lprf_char_deliver(0, NULL, psdu + offset, length);
+		lprf->aggregation.rx_payloads++;
+		offset += length;
+	}
+}
+
+/**
+ * Delivers the PSDU of a received frame of the char driver interface. The
+ * frame is corrected by the forward error correction and unpacked by
+ * lprf_deaggregate() if enabled. To readers in byte stream mode, long frames
+ * without both are delivered by write_data_to_char_driver() as raw data.
+ */
+static void lprf_receive_raw_psdu(struct lprf_local *lprf,
+		struct lprf_rx_record *record, uint8_t *psdu, int psdu_length)
+{
+	int data_length = psdu_length;
+	int corrected = 0;
+
+	if (lprf->fec.enabled) {
+		data_length = lprf_fec_decode(&lprf->fec, psdu, psdu_length,
+				&corrected);
+		if (data_length < 0) {
+			PRINT_KRIT("FEC failed, ignoring frame");
+			record->status |= LPRF_RX_STATUS_FEC_FAILED;
+			lprf_char_record(record, psdu, psdu_length);
+			return;
+		}
+		if (corrected)
+			record->status |= LPRF_RX_STATUS_FEC_CORRECTED;
+	}
+
+	if (lprf->aggregation.enabled) {
+		lprf_deaggregate(lprf, record, psdu, data_length);
+		return;
+	}
+
+	lprf_char_record(record, psdu, data_length);
+	if (lprf->fec.enabled && lprf_char_has_readers())
+		lprf_char_deliver(0, NULL, psdu, data_length);
+}
+
 /**
  * Processes the raw data received from the chip and delegates the corrected
  * data to the IEEE 802.15.4 network stack.
@@ -969,26 +2924,91 @@ static int lprf_receive_ieee802154_data(struct lprf_local *lprf,
 	int frame_length = 0;
 	struct sk_buff *skb;
 	int ret = 0;
-	int lqi = 0;
-
-	if (find_SFD_and_shift_data(buffer, &buffer_length, 0xe5, 4) == 0) {
+	int shift = 0;
+	bool corrupted = false;
+	struct lprf_rx_record record = {
+		.timestamp_ns = ktime_get_ns(),
+		.raw_length = buffer_length,
+	};
+
+	struct lprf_occupancy *occupancy = &lprf->occupancy[
+			lprf->channel_switch.channel - LPRF_FIRST_CHANNEL];
+
+	occupancy->frames++;
+	shift = find_SFD_and_shift_data(buffer, &buffer_length, lprf->shr.sfd,
+			lprf->shr.preamble_length);
+	if (shift <= 0) {
 		PRINT_KRIT("SFD not found, ignoring frame");
+		occupancy->no_sfd++;
+		record.status = LPRF_RX_STATUS_NO_SFD;
+		lprf_char_record(&record, buffer, buffer_length);
 		return -EINVAL;
 	}
+	record.shift = shift;
+
+	/* Long frames are only delivered by the char driver interface */
+	if (lprf->long_frames) {
+		frame_length = lprf_long_psdu_length(buffer);
+		corrupted = frame_length > LPRF_LONG_MAX_PSDU ||
+				frame_length + LPRF_LONG_PHR_LENGTH >
+				buffer_length;
+		lprf_count_rx_frame(lprf, corrupted);
+		if (corrupted) {
+			record.status = LPRF_RX_STATUS_BAD_LENGTH;
+			lprf_char_record(&record, buffer, buffer_length);
+		} else {
+			lprf_receive_raw_psdu(lprf, &record,
+					buffer + LPRF_LONG_PHR_LENGTH,
+					frame_length);
+		}
+		return 0;
+	}
 
 	frame_length = buffer[0];
+	corrupted = !ieee802154_is_valid_psdu_len(frame_length);
 
-	if (!ieee802154_is_valid_psdu_len(frame_length)) {
+	if (corrupted) {
 		dev_vdbg(&lprf->spi_device->dev, "corrupted frame received\n");
 		frame_length = IEEE802154_MTU;
+		record.status = LPRF_RX_STATUS_BAD_LENGTH;
 	}
 
 	if (frame_length > buffer_length) {
 		PRINT_KRIT("frame length greater than received data length");
+		lprf_count_rx_frame(lprf, true);
+		record.status = LPRF_RX_STATUS_BAD_LENGTH;
+		lprf_char_record(&record, buffer, buffer_length);
 		return -EINVAL;
 	}
+	lprf_count_rx_frame(lprf, corrupted);
 	PRINT_KRIT("Length of received frame is %d", frame_length);
 
+	/*
+	 * Aggregated and error corrected frames are only delivered to the char
+	 * driver interface. Both are only enabled while the IEEE 802.15.4
+	 * interface is down, see lprf_set_aggregation() and lprf_set_fec().
+	 * Frames with an invalid length are only recorded, like long frames.
+	 */
+	if (lprf->aggregation.enabled || lprf->fec.enabled) {
+		if (corrupted)
+			lprf_char_record(&record, buffer + 1, frame_length);
+		else
+			lprf_receive_raw_psdu(lprf, &record, buffer + 1,
+					frame_length);
+		return 0;
+	}
+
+	lprf_char_record(&record, buffer + 1, frame_length);
+
+	/* The chip is also polled for the char device while the IF is down */
+	if (!READ_ONCE(lprf->started))
+		return 0;
+
+	if (!lprf_frame_is_for_us(lprf, buffer + 1, frame_length)) {
+		PRINT_KRIT("Frame not addressed to us, ignoring frame");
+		return 0;
+	}
+
 	skb = dev_alloc_skb(frame_length);
 	if (!skb) {
 		dev_vdbg(&lprf->spi_device->dev,
@@ -997,7 +3017,8 @@ static int lprf_receive_ieee802154_data(struct lprf_local *lprf,
 	}
 
 	memcpy(skb_put(skb, frame_length), buffer + 1, frame_length);
-	ieee802154_rx_irqsafe(lprf->hw, skb, lqi);
+	/* The chip does not report the link quality of a frame */
+	ieee802154_rx_irqsafe(lprf->hw, skb, 0);
 
 	return ret;
 }
@@ -1015,67 +3036,269 @@ static void preprocess_received_data(uint8_t *data, int length)
 }
 
 /**
- * Writes the received raw data to the char driver buffer, if a user space
- * application has actually opened the device file and is waiting for data.
+ * Writes the received raw data to the buffers of all readers in byte stream
+ * mode, if user space applications have actually opened the device file.
+ * Aggregated and error corrected frames are delivered by
+ * lprf_receive_raw_psdu() and records by lprf_char_record() instead.
  */
-static void write_data_to_char_driver(uint8_t *data, int length)
+static void write_data_to_char_driver(struct lprf_local *lprf, uint8_t *data,
+		int length)
 {
-	if (!atomic_read(&lprf_char_driver_interface.is_ready))
+	if (!lprf_char_has_readers() ||
+			lprf->aggregation.enabled || lprf->fec.enabled)
 		return;
 
-	kfifo_in(&lprf_char_driver_interface.data_buffer, data, length);
+	lprf_char_deliver(0, NULL, data, length);
 }
 
 /**
- * Completion callback of the frame read command. Processes the received data
- * by calling lprf_receive_ieee802154_data(). The physical status information
- * will be polled from the chip, after the data was received successfully.
+ * Appends preprocessed data to the frame that is currently drained.
  */
-static void __lprf_read_frame_complete(void *context)
+static void lprf_drain_append(struct lprf_local *lprf, const uint8_t *data,
+		int length)
 {
-	uint8_t *data_buf = 0;
-	uint8_t phy_status = 0;
-	int rc;
-	int length = 0;
-	struct lprf_local *lprf = context;
-	struct lprf_state_change *state_change = &lprf->state_change;
-
-	PRINT_KRIT("Frame read via SPI completed");
+	struct lprf_rx_drain *rx_drain = &lprf->rx_drain;
 
-	data_buf = state_change->rx_buf + 2;
+	length = min_t(int, length, sizeof(rx_drain->data) - rx_drain->length);
+	memcpy(rx_drain->data + rx_drain->length, data, length);
+	rx_drain->length += length;
+}
 
-	phy_status = state_change->rx_buf[0];
-	length = state_change->rx_buf[1];
+/**
+ * Decodes the physical header of the frame that is currently drained.
+ *
+ * Returns the number of received bytes that make up the complete frame, zero
+ * if not enough data is available yet or INT_MAX if the frame can not be
+ * decoded. In the latter case the frame is completed when the chip stops
+ * receiving.
+ */
+static int lprf_drain_decode_phr(struct lprf_local *lprf)
+{
+	struct lprf_rx_drain *rx_drain = &lprf->rx_drain;
+	uint8_t header[LPRF_RX_PHR_BYTES(LPRF_MAX_PREAMBLE_LENGTH,
+			LPRF_LONG_PHR_LENGTH)];
+	int phr_bytes = LPRF_RX_PHR_BYTES(lprf->shr.preamble_length,
+			lprf_phr_length(lprf->long_frames));
+	int length = phr_bytes;
+	int frame_length = 0;
 
-	preprocess_received_data(data_buf, length);
-	write_data_to_char_driver(data_buf, length);
-	wake_up(&lprf_char_driver_interface.wait_for_rx_data);
+	if (rx_drain->length < phr_bytes)
+		return 0;
 
-	lprf_receive_ieee802154_data(lprf, data_buf, length);
-	atomic_dec(&state_change->transition_in_progress);
-	rc = lprf_phy_status_async(&lprf->phy_status);
-	if (rc)
-		PRINT_KRIT("PHY_STATUS BUSY in __lprf_read_frame_complete");
+	memcpy(header, rx_drain->data, phr_bytes);
+	if (find_SFD_and_shift_data(header, &length, lprf->shr.sfd,
+			lprf->shr.preamble_length) <= 0)
+		return INT_MAX;
+
+	if (lprf->long_frames) {
+		frame_length = lprf_long_psdu_length(header);
+		if (frame_length > LPRF_LONG_MAX_PSDU)
+			return INT_MAX;
+	} else {
+		frame_length = header[0];
+		if (!ieee802154_is_valid_psdu_len(frame_length))
+			return INT_MAX;
+	}
 
+	PRINT_KRIT("Early PHR decoded, frame length %d", frame_length);
+	return phr_bytes + frame_length;
 }
 
+static void lprf_async_state_change(struct lprf_local *lprf, uint8_t state);
+
 /**
- * Starts reading RX data from the chip. The chip should actually have data
- * available and be in sleep mode that no new data is received during the
- * read process.
+ * Ends the critical section of a FIFO read during reception and polls again
+ * for the next part of the frame.
  */
-static void read_lprf_fifo(struct lprf_local *lprf)
+static void __lprf_drain_continue(void *context)
 {
-	int ret = 0;
-	struct lprf_state_change *state_change = &lprf->state_change;
-	state_change->spi_message.complete = __lprf_read_frame_complete;
-	state_change->spi_transfer.len = MAX_SPI_BUFFER_SIZE;
-
-	memset(state_change->tx_buf, 0, sizeof(state_change->tx_buf));
-	state_change->tx_buf[0] = FRMR;
+	struct lprf_local *lprf = context;
 
+	atomic_dec(&lprf->state_change.transition_in_progress);
+	lprf_start_polling_timer(lprf, lprf->rate.retry_interval);
+}
 
-	PRINT_KRIT("Will start async SPI read for frame read");
+/**
+ * Sets the RX length counter to the length of the frame that is currently
+ * drained, so the chip stops receiving right after the frame ended instead
+ * of after the airtime of a maximum length frame.
+ *
+ * @lprf: lprf_local struct
+ * @fifo_level: number of bytes in the FIFO as reported by the last frame
+ * 	read, including those that did not fit into the read
+ *
+ * The counter is only changed if at least LPRF_RX_LENGTH_MIN_REMAINING bytes
+ * of the frame are still to be received by the chip. The chip has received
+ * the drained bytes and the bytes left in the FIFO. Otherwise the counter
+ * might already have passed the new value. Returns true if the counter is
+ * written, the critical section is then left by the completion callback.
+ */
+static bool lprf_drain_shorten_rx_length(struct lprf_local *lprf,
+		int fifo_level)
+{
+	struct lprf_rx_drain *rx_drain = &lprf->rx_drain;
+	struct lprf_rx_length *rx_length = &lprf->rx_length;
+	int received = rx_drain->length +
+			max(fifo_level - LPRF_RX_DRAIN_CHUNK, 0);
+
+	if (!rx_length->enabled || rx_drain->needed == INT_MAX ||
+			rx_drain->needed - received <
+			LPRF_RX_LENGTH_MIN_REMAINING)
+		return false;
+
+	/*
+	 * The bytes needed for decoding are as many as the synchronization
+	 * header, the physical header and the PSDU take on air.
+	 */
+	rx_length->shortened_frames++;
+	lprf_async_set_rx_length(lprf, get_rx_length_counter(
+			lprf->rate.profile->kbit_rate,
+			rx_drain->needed + LPRF_RX_LENGTH_MARGIN),
+			__lprf_drain_continue);
+	return true;
+}
+
+/**
+ * Restarts RX mode after the chip has been stopped by a drained frame.
+ */
+static void lprf_drain_restart_rx(void *context)
+{
+	lprf_async_state_change(context, STATE_CMD_RX);
+}
+
+/**
+ * Completion callback of a FIFO read during reception. Appends the data to
+ * the drained frame and processes the frame as soon as it is complete.
+ *
+ * A complete frame ends the reception early. The chip is put to sleep mode
+ * and changes to RX mode again, the remaining bytes of the RX length counter
+ * are discarded with the FIFO reset in lprf_rx_resets().
+ */
+static void __lprf_drain_complete(void *context)
+{
+	struct lprf_local *lprf = context;
+	struct lprf_state_change *state_change = &lprf->state_change;
+	struct lprf_rx_drain *rx_drain = &lprf->rx_drain;
+	uint8_t *data_buf = state_change->rx_buf + 2;
+	int length = min_t(int, state_change->rx_buf[1], LPRF_RX_DRAIN_CHUNK);
+
+	preprocess_received_data(data_buf, length);
+	lprf_drain_append(lprf, data_buf, length);
+
+	if (!rx_drain->needed) {
+		rx_drain->needed = lprf_drain_decode_phr(lprf);
+		if (rx_drain->needed && lprf_drain_shorten_rx_length(lprf,
+				state_change->rx_buf[1]))
+			return;
+	}
+
+	if (!rx_drain->needed || rx_drain->length < rx_drain->needed) {
+		__lprf_drain_continue(lprf);
+		return;
+	}
+
+	PRINT_KRIT("Drained frame complete while receiving");
+	rx_drain->early_frames++;
+	write_data_to_char_driver(lprf, rx_drain->data, rx_drain->length);
+	lprf_receive_ieee802154_data(lprf, rx_drain->data, rx_drain->length);
+	wake_up(&lprf_char_driver_interface.wait_for_rx_data);
+	rx_drain->length = 0;
+
+	lprf_async_write_subreg(state_change, SR_SM_COMMAND, STATE_CMD_SLEEP,
+			lprf_drain_restart_rx);
+}
+
+/**
+ * Reads the data that is available in the FIFO while the chip is still
+ * receiving.
+ *
+ * Without draining the FIFO is only read after the RX length counter
+ * expired and the chip changed to sleep mode, which takes the airtime of a
+ * maximum length frame even for short frames. With draining the physical
+ * header is decoded as soon as it arrives and the frame is processed when
+ * all of its bytes have been read (see __lprf_drain_complete()). If the chip
+ * stops receiving first, the rest of the frame is read by read_lprf_fifo()
+ * and appended to the drained data.
+ */
+static void lprf_drain_fifo(struct lprf_local *lprf)
+{
+	int ret = 0;
+	struct lprf_state_change *state_change = &lprf->state_change;
+
+	if (!lprf->rx_drain.length)
+		lprf->rx_drain.needed = 0;
+
+	state_change->spi_message.complete = __lprf_drain_complete;
+	state_change->spi_transfer.len = LPRF_RX_DRAIN_CHUNK + 2;
+
+	memset(state_change->tx_buf, 0, LPRF_RX_DRAIN_CHUNK + 2);
+	state_change->tx_buf[0] = FRMR;
+
+	ret = spi_async(lprf->spi_device, &state_change->spi_message);
+	if (ret)
+		lprf_async_error(lprf, state_change, ret);
+}
+
+/**
+ * Completion callback of the frame read command. Processes the received data
+ * by calling lprf_receive_ieee802154_data(). The physical status information
+ * will be polled from the chip, after the data was received successfully.
+ */
+static void __lprf_read_frame_complete(void *context)
+{
+	uint8_t *data_buf = 0;
+	uint8_t phy_status = 0;
+	int rc;
+	int length = 0;
+	struct lprf_local *lprf = context;
+	struct lprf_state_change *state_change = &lprf->state_change;
+
+	PRINT_KRIT("Frame read via SPI completed");
+
+	data_buf = state_change->rx_buf + 2;
+
+	phy_status = state_change->rx_buf[0];
+	length = min_t(int, state_change->rx_buf[1],
+			lprf_max_frame_length(lprf));
+
+	preprocess_received_data(data_buf, length);
+
+	/* Add the rest of a frame that has been drained partly before */
+	if (lprf->rx_drain.length) {
+		lprf_drain_append(lprf, data_buf, length);
+		data_buf = lprf->rx_drain.data;
+		length = lprf->rx_drain.length;
+		lprf->rx_drain.length = 0;
+	}
+
+	write_data_to_char_driver(lprf, data_buf, length);
+	lprf_receive_ieee802154_data(lprf, data_buf, length);
+	wake_up(&lprf_char_driver_interface.wait_for_rx_data);
+
+	atomic_dec(&state_change->transition_in_progress);
+	rc = lprf_phy_status_async(&lprf->phy_status);
+	if (rc)
+		PRINT_KRIT("PHY_STATUS BUSY in __lprf_read_frame_complete");
+
+}
+
+/**
+ * Starts reading RX data from the chip. The chip should actually have data
+ * available and be in sleep mode that no new data is received during the
+ * read process.
+ */
+static void read_lprf_fifo(struct lprf_local *lprf)
+{
+	int ret = 0;
+	struct lprf_state_change *state_change = &lprf->state_change;
+	state_change->spi_message.complete = __lprf_read_frame_complete;
+	state_change->spi_transfer.len = lprf_max_frame_length(lprf) + 2;
+
+	memset(state_change->tx_buf, 0, sizeof(state_change->tx_buf));
+	state_change->tx_buf[0] = FRMR;
+
+
+	PRINT_KRIT("Will start async SPI read for frame read");
 
 	ret = spi_async(lprf->spi_device, &state_change->spi_message);
 	if (ret)
@@ -1091,16 +3314,26 @@ static void read_lprf_fifo(struct lprf_local *lprf)
  * does not reset all parts of the chip correctly. To avoid data
  * corruption and ensure a correct function of the chip some of those
  * resets need to be handled manually. This needs to be done every time
- * before the chip changes to RX mode or to TX mode.
+ * before the chip changes to RX mode or to TX mode. Before the chip changes
+ * to TX mode, the TX power level of the frame is set if the chip currently
+ * uses another one.
  */
 static void lprf_rx_resets(void *context)
 {
 	static int reset_counter = 0;
 	struct lprf_local *lprf = context;
 	struct lprf_state_change *state_change = &lprf->state_change;
+	int level = 0;
 
 	switch (reset_counter) {
 	case 0:
+		/* Receive maximum length frames again */
+		if (lprf->rx_length.shortened) {
+			lprf_async_set_rx_length(lprf,
+					lprf->rx_length.max_counter,
+					lprf_rx_resets);
+			return;
+		}
 		lprf_async_write_register(state_change, RG_SM_MAIN,
 				0x05, lprf_rx_resets);
 		reset_counter++;
@@ -1111,25 +3344,35 @@ static void lprf_rx_resets(void *context)
 		reset_counter++;
 		return;
 	case 2:
-		lprf_async_write_subreg(state_change,
-				state_change->dem_main_value,
-				SR_DEM_RESETB, 0, lprf_rx_resets);
+		lprf_async_write_subreg(state_change, SR_DEM_RESETB, 0,
+				lprf_rx_resets);
 		reset_counter++;
 		return;
 	case 3:
-		lprf_async_write_subreg(state_change,
-				state_change->dem_main_value,
-				SR_DEM_RESETB, 1, lprf_rx_resets);
+		lprf_async_write_subreg(state_change, SR_DEM_RESETB, 1,
+				lprf_rx_resets);
 		reset_counter++;
 		return;
 	case 4:
 		if (state_change->to_state == STATE_CMD_TX) {
-			lprf_start_frame_write(lprf);
+			/* TX power level of the frame */
+			level = lprf_tx_power_level(lprf, lprf->tx_skb);
+			if (level != lprf_chip_tx_power(lprf)) {
+				lprf_async_write_subreg(state_change,
+						SR_TX_PWR_CTRL, level,
+						lprf_rx_resets);
+				return;
+			}
+			if (state_change->tx_burst)
+				lprf_async_set_tx_mode(state_change,
+						LPRF_TX_MODE_BURST,
+						lprf_start_frame_write);
+			else
+				lprf_start_frame_write(lprf);
 			reset_counter = 0;
 		}
 		else {
 			lprf_async_write_subreg(state_change,
-					state_change->sm_main_value,
 					SR_SM_COMMAND, STATE_CMD_RX,
 					lprf_rx_resets);
 			reset_counter++;
@@ -1137,7 +3380,6 @@ static void lprf_rx_resets(void *context)
 		return;
 	case 5:
 		lprf_async_write_subreg(state_change,
-				state_change->sm_main_value,
 				SR_SM_COMMAND, STATE_CMD_NONE,
 				lprf_rx_change_complete);
 		reset_counter = 0;
@@ -1158,6 +3400,9 @@ static void lprf_async_state_change(struct lprf_local *lprf, uint8_t state)
 	struct lprf_state_change *state_change = &lprf->state_change;
 	state_change->to_state = state;
 
+	/* A frame that is not completely drained yet gets lost */
+	lprf->rx_drain.length = 0;
+
 	switch (state) {
 	case STATE_CMD_RX:
 		PRINT_KRIT("Will change state to RX...");
@@ -1165,7 +3410,6 @@ static void lprf_async_state_change(struct lprf_local *lprf, uint8_t state)
 		break;
 	case STATE_CMD_TX:
 		lprf_async_write_subreg(state_change,
-				state_change->sm_main_value,
 				SR_SM_COMMAND, STATE_CMD_SLEEP,
 				lprf_rx_resets);
 		PRINT_KRIT("Changed state to sleep, will change to TX");
@@ -1175,6 +3419,184 @@ static void lprf_async_state_change(struct lprf_local *lprf, uint8_t state)
 	}
 }
 
+/**
+ * Updates the occupancy estimate of the current channel with the physical
+ * status of one poll. The chip is busy if it is receiving and already
+ * wrote data to the FIFO.
+ */
+static void lprf_update_occupancy(struct lprf_local *lprf, uint8_t phy_status)
+{
+	struct lprf_occupancy *occupancy = &lprf->occupancy[
+			lprf->channel_switch.channel - LPRF_FIRST_CHANNEL];
+	u32 busy_ratio = 0;
+
+	occupancy->polls++;
+	if (PHY_SM_STATUS(phy_status) == PHY_SM_RECEIVING &&
+			!PHY_FIFO_EMPTY(phy_status))
+		occupancy->busy_polls++;
+
+	if (occupancy->polls < LPRF_OCCUPANCY_WINDOW)
+		return;
+
+	busy_ratio = occupancy->busy_polls * 1000 / occupancy->polls;
+	occupancy->busy_avg = (occupancy->busy_avg *
+			(LPRF_OCCUPANCY_WEIGHT - 1) + busy_ratio) /
+			LPRF_OCCUPANCY_WEIGHT;
+	occupancy->polls = 0;
+	occupancy->busy_polls = 0;
+}
+
+/**
+ * Callback of the channel switch of a hop. Changes back to RX mode.
+ */
+static void lprf_hop_switch_complete(struct lprf_local *lprf, int status)
+{
+	if (status)
+		PRINT_DEBUG("Channel switch failed with %d", status);
+
+	lprf->state_change.to_state = STATE_CMD_RX;
+	lprf_rx_resets(lprf);
+}
+
+/**
+ * Switches to the channel of the current hopping slot. The chip has to be
+ * in sleep mode.
+ */
+static void lprf_hop_switch_channel(void *context)
+{
+	struct lprf_local *lprf = context;
+	struct lprf_hopping *hopping = &lprf->hopping;
+	int channel = atomic_xchg(&hopping->pending_channel, 0);
+	int ret = 0;
+
+	ret = lprf_async_switch_channel(lprf, channel,
+			lprf_hop_switch_complete);
+	if (ret) {
+		/* try again with the next phy status */
+		if (ret == -EBUSY)
+			atomic_cmpxchg(&hopping->pending_channel, 0, channel);
+		lprf_hop_switch_complete(lprf, ret);
+	}
+}
+
+/**
+ * Returns true if the chip is neither receiving nor sending a frame and the
+ * channel can be changed without losing data. While the chip is receiving,
+ * the FIFO is still empty until the first bytes of the frame arrive.
+ */
+static bool lprf_chip_is_idle(struct lprf_local *lprf, uint8_t phy_status)
+{
+	if (lprf->rx_drain.length)
+		return false;
+
+	switch (PHY_SM_STATUS(phy_status)) {
+	case PHY_SM_SLEEP:
+	case PHY_SM_RX_RDY:
+		return PHY_FIFO_EMPTY(phy_status);
+	default:
+		return false;
+	}
+}
+
+/**
+ * Timer callback at every slot boundary of the hopping schedule.
+ *
+ * The channel of the new slot is only marked as pending. The channel switch
+ * itself is initiated by lprf_evaluate_phy_status() as soon as the chip is
+ * idle, so a frame in flight is never interrupted. To initiate the channel
+ * switch as fast as possible the physical status is polled immediately.
+ * If slot boundaries have been missed, the hop sequence is advanced
+ * accordingly to stay in sync with the schedule.
+ */
+static enum hrtimer_restart lprf_hop_timer(struct hrtimer *timer)
+{
+	struct lprf_hopping *hopping =
+			container_of(timer, struct lprf_hopping, timer);
+	struct lprf_local *lprf =
+			container_of(hopping, struct lprf_local, hopping);
+	u64 slots = hrtimer_forward_now(timer, hopping->slot_duration);
+	u32 index = 0;
+
+	div_u64_rem(hopping->index + slots, hopping->num_channels, &index);
+	hopping->index = index;
+	atomic_set(&hopping->pending_channel, hopping->channels[index]);
+
+	if (atomic_read(&lprf->rx_polling_active))
+		lprf_phy_status_async(&lprf->phy_status);
+
+	return HRTIMER_RESTART;
+}
+
+/**
+ * Stops channel hopping and changes back to the channel set by the
+ * IEEE 802.15.4 stack.
+ */
+static void lprf_stop_hopping(struct lprf_local *lprf)
+{
+	struct lprf_hopping *hopping = &lprf->hopping;
+
+	mutex_lock(&hopping->lock);
+	hrtimer_cancel(&hopping->timer);
+	if (hopping->num_channels) {
+		hopping->num_channels = 0;
+		atomic_set(&hopping->pending_channel,
+				lprf->hw->phy->current_channel);
+		if (atomic_read(&lprf->rx_polling_active))
+			lprf_phy_status_async(&lprf->phy_status);
+	}
+	mutex_unlock(&hopping->lock);
+}
+
+/**
+ * Starts channel hopping.
+ *
+ * @lprf: lprf_local struct
+ * @config: hopping schedule from user space
+ *
+ * A running schedule is replaced. The first channel of the sequence is used
+ * from config->start_time_ns on, every following slot uses the next channel
+ * of the sequence.
+ */
+static int lprf_start_hopping(struct lprf_local *lprf,
+		const struct lprf_hop_config *config)
+{
+	struct lprf_hopping *hopping = &lprf->hopping;
+	ktime_t start_time;
+	int i = 0;
+
+	if (config->num_channels == 0 ||
+			config->num_channels > LPRF_MAX_HOP_SEQUENCE ||
+			config->slot_duration_us < LPRF_MIN_HOP_SLOT_US)
+		return -EINVAL;
+
+	for (i = 0; i < config->num_channels; ++i) {
+		if (config->channels[i] < LPRF_FIRST_CHANNEL ||
+				config->channels[i] > LPRF_LAST_CHANNEL)
+			return -EINVAL;
+	}
+
+	mutex_lock(&hopping->lock);
+	hrtimer_cancel(&hopping->timer);
+
+	memcpy(hopping->channels, config->channels, config->num_channels);
+	hopping->num_channels = config->num_channels;
+	hopping->index = config->num_channels - 1;
+	hopping->slot_duration = ns_to_ktime(
+			(u64)config->slot_duration_us * NSEC_PER_USEC);
+
+	if (config->start_time_ns)
+		start_time = ns_to_ktime(config->start_time_ns);
+	else
+		start_time = ktime_get();
+
+	hrtimer_start(&hopping->timer, start_time, HRTIMER_MODE_ABS);
+	mutex_unlock(&hopping->lock);
+
+	PRINT_DEBUG("Hopping over %d channels with %u us slots",
+			config->num_channels, config->slot_duration_us);
+	return 0;
+}
+
 /**
  * Decides what action needs to be done dependent on the physical status of
  * the chip.
@@ -1188,14 +3610,18 @@ static void lprf_async_state_change(struct lprf_local *lprf, uint8_t state)
  * and decides what action will be performed. If the chip is busy or a
  * state transition is currently in progress this
  * function will do nothing. If the chip has RX data available an RX read
- * will be started. If there is pending TX data the chip will change to TX
- * mode.
+ * will be started. If a channel switch of the hopping schedule is pending
+ * and the chip is idle, the channel will be changed. If there is pending TX
+ * data the chip will change to TX mode. During a burst the next queued frame
+ * is written as soon as the chip is back in TX idle mode.
  */
 static void lprf_evaluate_phy_status(struct lprf_local *lprf,
 		struct lprf_state_change *state_change, uint8_t phy_status)
 {
 	PRINT_KRIT("Phy_status in lprf_evaluate_phy_status 0x%X", phy_status);
 
+	lprf_update_occupancy(lprf, phy_status);
+
 	/* try lock following section. If already locked: return. */
 	if (atomic_inc_return(&state_change->transition_in_progress) != 1) {
 		atomic_dec(&state_change->transition_in_progress);
@@ -1208,22 +3634,59 @@ static void lprf_evaluate_phy_status(struct lprf_local *lprf,
 	 * successfully.
 	 */
 	if(PHY_SM_STATUS(phy_status) != PHY_SM_SENDING &&
-			state_change->tx_complete)
+			state_change->tx_complete &&
+			(!state_change->tx_burst || PHY_FIFO_EMPTY(phy_status)))
 		lprf_tx_complete(lprf);
 
-	/* Read data from chip, if RX data is available */
+	/* Send the next queued frame of a burst or end the burst */
+	if (state_change->tx_burst &&
+			PHY_SM_STATUS(phy_status) == PHY_SM_TX_RDY &&
+			PHY_FIFO_EMPTY(phy_status)) {
+		lprf_burst_next_frame(lprf);
+		return;
+	}
+
+	/*
+	 * Read data from chip, if RX data is available or the reception of a
+	 * partly drained frame ended
+	 */
 	if(PHY_SM_STATUS(phy_status) == PHY_SM_SLEEP &&
-			!PHY_FIFO_EMPTY(phy_status)) {
+			(!PHY_FIFO_EMPTY(phy_status) || lprf->rx_drain.length)) {
 		read_lprf_fifo(lprf);
 		return;
 	}
 
-	/* Send TX data, if TX data is pending */
-	if (lprf->tx_skb && PHY_FIFO_EMPTY(phy_status)) {
-		lprf_async_state_change(lprf, STATE_CMD_TX);
+	/*
+	 * Change the channel if a new hopping slot started. A frame that is
+	 * currently received or sent is never interrupted.
+	 */
+	if (atomic_read(&lprf->hopping.pending_channel) &&
+			lprf_chip_is_idle(lprf, phy_status)) {
+		if (PHY_SM_STATUS(phy_status) == PHY_SM_SLEEP)
+			lprf_hop_switch_channel(lprf);
+		else
+			lprf_async_write_subreg(state_change,
+					SR_SM_COMMAND, STATE_CMD_SLEEP,
+					lprf_hop_switch_channel);
 		return;
 	}
 
+	/*
+	 * Send TX data, if TX data is pending and due. If more frames with the
+	 * same TX power are due, they are sent as a burst.
+	 */
+	if (!lprf->tx_skb && !skb_queue_empty(&lprf->tx_queue) &&
+			PHY_FIFO_EMPTY(phy_status) && !lprf->rx_drain.length) {
+		lprf->tx_skb = lprf_tx_dequeue(lprf, LPRF_DEFAULT_TX_POWER);
+		if (lprf->tx_skb) {
+			state_change->tx_burst = lprf_tx_next_ready(lprf,
+					lprf_tx_power_level(lprf,
+						lprf->tx_skb));
+			lprf_async_state_change(lprf, STATE_CMD_TX);
+			return;
+		}
+	}
+
 	/*
 	 * Change to RX state again, if chip is in an idle state
 	 * (RX data transferred to driver, chip still in sleep mode)
@@ -1234,18 +3697,28 @@ static void lprf_evaluate_phy_status(struct lprf_local *lprf,
 		return;
 	}
 
+	/* Drain the FIFO while the chip is still receiving */
+	if (lprf->rx_drain.enabled &&
+			PHY_SM_STATUS(phy_status) == PHY_SM_RECEIVING &&
+			!PHY_FIFO_EMPTY(phy_status)) {
+		lprf_drain_fifo(lprf);
+		return;
+	}
+
 	/* unlock critical section */
 	atomic_dec(&state_change->transition_in_progress);
 
 	if(PHY_SM_STATUS(phy_status) == PHY_SM_RECEIVING) {
-		if (PHY_FIFO_EMPTY(phy_status))
-			lprf_start_polling_timer(lprf, RX_POLLING_INTERVAL);
+		if (PHY_FIFO_EMPTY(phy_status) && !lprf->rx_drain.length)
+			lprf_start_polling_timer(lprf,
+					lprf->rate.rx_polling_interval);
 		else
-			lprf_start_polling_timer(lprf, RETRY_INTERVAL);
+			lprf_start_polling_timer(lprf,
+					lprf->rate.retry_interval);
 		return;
 	}
 
-	lprf_start_polling_timer(lprf, RETRY_INTERVAL);
+	lprf_start_polling_timer(lprf, lprf->rate.retry_interval);
 }
 
 
@@ -1260,141 +3733,247 @@ static void lprf_evaluate_phy_status(struct lprf_local *lprf,
  */
 
 /**
- * Called when the WPAN device is activated from user space. Starts the
- * polling of the chip.
+ * Writes the values of the state machine startup timers to the chip.
  */
-static int lprf_start_ieee802154(struct ieee802154_hw *hw)
+static int lprf_write_sm_time(struct lprf_local *lprf)
 {
-	struct lprf_local *lprf = hw->priv;
+	int i = 0;
 
-	PRINT_DEBUG("Call lprf_start_ieee802154...");
+	lprf_batch_begin(lprf);
+	for (i = 0; i < LPRF_NUM_SM_TIMERS; ++i)
+		lprf_batch_write_subreg(lprf, lprf_sm_timers[i].addr, 0xff, 0,
+				lprf->sm_time[i]);
+	return lprf_batch_flush(lprf);
+}
+
+/**
+ * Returns true if the chip is polled, which is the case while the IEEE
+ * 802.15.4 interface is up or the char device is open, until the chip gets
+ * removed. Called with lprf.run_lock held.
+ */
+static inline bool lprf_polling_wanted(struct lprf_local *lprf)
+{
+	return !lprf->removing && (lprf->started || lprf->char_users);
+}
+
+/**
+ * Starts the polling of the chip when it becomes wanted. Changed values of
+ * the state machine startup timers are written to the chip before. Called
+ * with lprf.run_lock held.
+ */
+static int lprf_run(struct lprf_local *lprf)
+{
+	int ret = 0;
+
+	RETURN_ON_ERROR(lprf_write_sm_time(lprf));
 
 	atomic_set(&lprf->rx_polling_active, 1);
 	lprf_phy_status_async(&lprf->phy_status);
-
 	return 0;
 }
 
 /**
- * Called when the WPAN device gets deactivated from user space. Stops the
- * polling and changes to sleep mode.
+ * Stops the polling and changes to sleep mode when the polling is not
+ * wanted anymore. Called with lprf.run_lock held.
  */
-static void lprf_stop_ieee802154(struct ieee802154_hw *hw)
+static void lprf_halt(struct lprf_local *lprf)
 {
-	struct lprf_local *lprf = hw->priv;
 	lprf_stop_polling(lprf);
 
 	/* Wait some time to make sure all pending communication finished*/
 	usleep_range(900, 1000);
 
 	lprf_write_subreg(lprf, SR_SM_COMMAND, STATE_CMD_SLEEP);
-	lprf_write_subreg(lprf, SR_SM_COMMAND, STATE_CMD_NONE);
-	lprf_write_subreg(lprf, SR_DEM_RESETB,  0);
-	lprf_write_subreg(lprf, SR_DEM_RESETB,  1);
-	lprf_write_subreg(lprf, SR_FIFO_RESETB, 0);
-	lprf_write_subreg(lprf, SR_FIFO_RESETB, 1);
-	lprf_write_subreg(lprf, SR_SM_RESETB,   0);
-	lprf_write_subreg(lprf, SR_SM_RESETB,   1);
+
+	lprf_batch_begin(lprf);
+	lprf_batch_write_subreg(lprf, SR_SM_COMMAND, STATE_CMD_NONE);
+	lprf_batch_write_subreg(lprf, SR_DEM_RESETB,  0);
+	lprf_batch_write_subreg(lprf, SR_FIFO_RESETB, 0);
+	lprf_batch_write_subreg(lprf, SR_SM_RESETB,   0);
+	lprf_batch_flush(lprf);
+
+	lprf_batch_begin(lprf);
+	lprf_batch_write_subreg(lprf, SR_DEM_RESETB,  1);
+	lprf_batch_write_subreg(lprf, SR_FIFO_RESETB, 1);
+	lprf_batch_write_subreg(lprf, SR_SM_RESETB,   1);
+	lprf_batch_flush(lprf);
 }
 
 /**
- * callback for setting the RF channel. Sets the PLL values of the chip.
+ * Called when the WPAN device is activated from user space. Starts the
+ * polling of the chip, unless the char device keeps it running already.
+ *
+ * Long frames, aggregation and the forward error correction are only
+ * supported by the char driver interface. The interface does not come up
+ * while one of them is enabled, as it would not receive any frame, and
+ * -EBUSY is returned.
  */
-static int
-lprf_set_ieee802154_channel(struct ieee802154_hw *hw,u8 page, u8 channel)
+static int lprf_start_ieee802154(struct ieee802154_hw *hw)
 {
-	int pll_int = 0;
-	int pll_frac = 0;
-	int rf_freq = 0;
-	int ret = 0;
-	int vco_tune = 0;
 	struct lprf_local *lprf = hw->priv;
+	int ret = 0;
 
-	if (page != 0) {
-		PRINT_DEBUG("Invalid channel page %d.", page);
-		return -EINVAL;
-	}
-
-	rf_freq = calculate_rf_center_freq(channel);
-	PRINT_DEBUG("RF-freq = %u", rf_freq);
-
-	/* for RX */
-	ret = lprf_calculate_pll_values(rf_freq, 1000000, &pll_int, &pll_frac);
-
-	RETURN_ON_ERROR( lprf_write_subreg(lprf, SR_RX_CHAN_INT, pll_int) );
-	RETURN_ON_ERROR( lprf_write_subreg(lprf,
-			SR_RX_CHAN_FRAC_H, BIT24_H_BYTE(pll_frac)) );
-	RETURN_ON_ERROR( lprf_write_subreg(lprf,
-			SR_RX_CHAN_FRAC_M, BIT24_M_BYTE(pll_frac)) );
-	RETURN_ON_ERROR( lprf_write_subreg(lprf,
-			SR_RX_CHAN_FRAC_L, BIT24_L_BYTE(pll_frac)) );
-	PRINT_DEBUG("Set RX PLL values to int=%d and frac=0x%.6x",
-			pll_int, pll_frac);
-
-	/* for TX */
-	ret = lprf_calculate_pll_values(rf_freq, 0, &pll_int, &pll_frac);
-
-	RETURN_ON_ERROR( lprf_write_subreg(lprf, SR_TX_CHAN_INT, pll_int) );
-	RETURN_ON_ERROR( lprf_write_subreg(lprf,
-			SR_TX_CHAN_FRAC_H, BIT24_H_BYTE(pll_frac)) );
-	RETURN_ON_ERROR( lprf_write_subreg(lprf,
-			SR_TX_CHAN_FRAC_M, BIT24_M_BYTE(pll_frac)) );
-	RETURN_ON_ERROR( lprf_write_subreg(lprf,
-			SR_TX_CHAN_FRAC_L, BIT24_L_BYTE(pll_frac)) );
-	PRINT_DEBUG("Set TX PLL values to int=%d and frac=0x%.6x",
-			pll_int, pll_frac);
+	PRINT_DEBUG("Call lprf_start_ieee802154...");
 
-	vco_tune = calc_vco_tune(channel);
-	RETURN_ON_ERROR( lprf_write_subreg(lprf, SR_PLL_VCO_TUNE, vco_tune) );
-	PRINT_DEBUG("Set VCO TUNE to %d", vco_tune);
+	mutex_lock(&lprf->run_lock);
+	if (lprf->long_frames || lprf->aggregation.enabled ||
+			lprf->fec.enabled)
+		ret = -EBUSY;
+	else if (!lprf_polling_wanted(lprf))
+		ret = lprf_run(lprf);
+	if (!ret)
+		lprf->started = true;
+	mutex_unlock(&lprf->run_lock);
 
 	return ret;
 }
 
-/* TODO actually characterize power, values in 0.01dBm */
-static const s32 lprf_tx_powers[] = {
-		0, 100, 200, 300, 400, 500, 600, 700, 800, 900,
-		1000, 1100, 1200, 1300, 1400, 1500
-};
-
 /**
- * Callback for setting the output power of the chip. Adjusts the
- * SR_TX_PWR_CTRL register. Note that the TX characteristics for the
- * settings used in this driver are not determined correctly. So the
- * output power will actually be the value set from user space. A higher
- * value will result in a higher output power.
+ * Called when the WPAN device gets deactivated from user space. Stops the
+ * polling and changes to sleep mode, unless the char device is still open.
+ * Pending rate and frame format changes and a chip restore are finished
+ * before, the other works are cancelled.
  */
-static int lprf_set_tx_power(struct ieee802154_hw *hw, s32 power)
+static void lprf_stop_ieee802154(struct ieee802154_hw *hw)
 {
-	int i;
 	struct lprf_local *lprf = hw->priv;
-
-	for (i = 0; i < lprf->hw->phy->supported.tx_powers_size; i++) {
-		if (lprf->hw->phy->supported.tx_powers[i] == power) {
-			PRINT_DEBUG("Set SR_TX_PWR_CTRL to %d", i);
-			return lprf_write_subreg(lprf, SR_TX_PWR_CTRL, i);
-		}
-	}
-
-	return -EINVAL;
+	cancel_work_sync(&lprf->vco_cal.work);
+	cancel_work_sync(&lprf->scan.work);
+	cancel_work_sync(&lprf->sm_time_work);
+	flush_work(&lprf->rate.work);
+	flush_work(&lprf->mode.work);
+	flush_work(&lprf->restore_work);
+
+	mutex_lock(&lprf->run_lock);
+	lprf->started = false;
+	if (!lprf_polling_wanted(lprf))
+		lprf_halt(lprf);
+	mutex_unlock(&lprf->run_lock);
 }
 
 /**
- * Callback for available TX data. Initiates a phy_status poll get the
- * chip in TX mode and send the available data.
+ * Counts another open file of the char device. The polling is started with
+ * the first one, so that the char driver interface sends and receives
+ * frames while the IEEE 802.15.4 interface is down.
+ */
+static int lprf_char_user_get(struct lprf_local *lprf)
+{
+	int ret = 0;
+
+	mutex_lock(&lprf->run_lock);
+	if (!lprf_polling_wanted(lprf))
+		ret = lprf_run(lprf);
+	if (!ret)
+		++lprf->char_users;
+	mutex_unlock(&lprf->run_lock);
+
+	return ret;
+}
+
+/**
+ * Counts a closed file of the char device. The polling is stopped with the
+ * last one if the IEEE 802.15.4 interface is down.
+ */
+static void lprf_char_user_put(struct lprf_local *lprf)
+{
+	mutex_lock(&lprf->run_lock);
+	--lprf->char_users;
+	if (!lprf_polling_wanted(lprf))
+		lprf_halt(lprf);
+	mutex_unlock(&lprf->run_lock);
+}
+
+static void lprf_set_channel_complete(struct lprf_local *lprf, int status)
+{
+	complete(&lprf->channel_switch.done);
+}
+
+/**
+ * callback for setting the RF channel. Sets the PLL values of the chip
+ * with lprf_async_switch_channel() and waits for the switch to complete.
  */
 static int
-lprf_xmit_ieee802154_async(struct ieee802154_hw *hw, struct sk_buff *skb)
+lprf_set_ieee802154_channel(struct ieee802154_hw *hw,u8 page, u8 channel)
 {
-	int rc = 0;
 	struct lprf_local *lprf = hw->priv;
+	struct lprf_channel_switch *channel_switch = &lprf->channel_switch;
+	unsigned long timeout = 0;
+	int ret = 0;
 
-	if (lprf->tx_skb) {
-		PRINT_DEBUG("ERROR in xmit, buffer not empty yet");
-		return -EBUSY;
+	if (page != 0) {
+		PRINT_DEBUG("Invalid channel page %d.", page);
+		return -EINVAL;
+	}
+
+	reinit_completion(&channel_switch->done);
+	ret = lprf_async_switch_channel(lprf, channel,
+			lprf_set_channel_complete);
+	if (ret)
+		return ret;
+
+	timeout = wait_for_completion_timeout(&channel_switch->done,
+			msecs_to_jiffies(100));
+	if (!timeout)
+		return -ETIMEDOUT;
+
+	PRINT_DEBUG("Switched to channel %d", channel);
+	return channel_switch->spi_message.status;
+}
+
+/* TODO actually characterize power, values in 0.01dBm */
+static const s32 lprf_tx_powers[] = {
+		0, 100, 200, 300, 400, 500, 600, 700, 800, 900,
+		1000, 1100, 1200, 1300, 1400, 1500
+};
+
+/**
+ * Returns the TX power level (SR_TX_PWR_CTRL) of a TX power in mBm or
+ * -EINVAL if the power is not supported.
+ */
+static int lprf_tx_power_to_level(s32 power)
+{
+	int i;
+
+	for (i = 0; i < ARRAY_SIZE(lprf_tx_powers); i++) {
+		if (lprf_tx_powers[i] == power)
+			return i;
 	}
 
-	lprf->tx_skb = skb;
+	return -EINVAL;
+}
+
+/**
+ * Callback for setting the output power of the chip. The SR_TX_PWR_CTRL
+ * register is adjusted before the next frame is sent (see lprf_rx_resets()).
+ * Note that the TX characteristics for the settings used in this driver are
+ * not determined correctly. So the output power will actually be the value
+ * set from user space. A higher value will result in a higher output power.
+ */
+static int lprf_set_tx_power(struct ieee802154_hw *hw, s32 power)
+{
+	struct lprf_local *lprf = hw->priv;
+	int level = lprf_tx_power_to_level(power);
+
+	if (level < 0)
+		return level;
+
+	PRINT_DEBUG("Set SR_TX_PWR_CTRL to %d", level);
+	lprf->tx_power = level;
+	return 0;
+}
+
+/**
+ * Callback for available TX data. Initiates a phy_status poll get the
+ * chip in TX mode and send the available data.
+ */
+static int
+lprf_xmit_ieee802154_async(struct ieee802154_hw *hw, struct sk_buff *skb)
+{
+	int rc = 0;
+	struct lprf_local *lprf = hw->priv;
+
+	lprf_init_skb_cb(skb, false, false, false);
+	skb_queue_tail(&lprf->tx_queue, skb);
 
 	rc = lprf_phy_status_async(&lprf->phy_status);
 	if (rc)
@@ -1407,14 +3986,46 @@ lprf_xmit_ieee802154_async(struct ieee802154_hw *hw, struct sk_buff *skb)
 /**
  * IEEE 802.15.4 uses CSMA-CA algorithms for channel access. Therefore
  * compatible chips need to be able to determine if the channel is currently
- * in use. The LPRF-chip does not support energy detection yet. As this
- * function needs to be implemented for the network stack to work, this
- * provides a dummy implementation for energy detection.
+ * in use. The LPRF-chip does not support energy detection directly, so the
+ * energy level is derived from the gain the AGC currently uses. The chip has
+ * to be in RX mode.
  */
 static int lprf_ieee802154_energy_detection(struct ieee802154_hw *hw, u8 *level)
 {
-	PRINT_DEBUG("Called unsupported function "
-			"lprf_ieee802154_energy_detection()");
+	struct lprf_local *lprf = hw->priv;
+	unsigned int gain = 0;
+	int ret = 0;
+
+	RETURN_ON_ERROR(lprf_read_agc_gain(lprf, &gain));
+	*level = (LPRF_AGC_MAX_GAIN - gain) * 0xff / LPRF_AGC_MAX_GAIN;
+	return 0;
+}
+
+/**
+ * Callback for setting the address filter. The lprf chip does not support
+ * address filtering in hardware, so the values are only stored and used by
+ * lprf_frame_is_for_us() in the RX path.
+ */
+static int lprf_set_hw_addr_filt(struct ieee802154_hw *hw,
+		struct ieee802154_hw_addr_filt *filt, unsigned long changed)
+{
+	struct lprf_local *lprf = hw->priv;
+	unsigned long flags;
+
+	spin_lock_irqsave(&lprf->addr_filt_lock, flags);
+	if (changed & IEEE802154_AFILT_SADDR_CHANGED)
+		lprf->addr_filt.short_addr = filt->short_addr;
+	if (changed & IEEE802154_AFILT_PANID_CHANGED)
+		lprf->addr_filt.pan_id = filt->pan_id;
+	if (changed & IEEE802154_AFILT_IEEEADDR_CHANGED)
+		lprf->addr_filt.ieee_addr = filt->ieee_addr;
+	if (changed & IEEE802154_AFILT_PANC_CHANGED)
+		lprf->addr_filt.pan_coord = filt->pan_coord;
+	spin_unlock_irqrestore(&lprf->addr_filt_lock, flags);
+
+	PRINT_DEBUG("Set address filter: pan_id=0x%04x short_addr=0x%04x",
+			le16_to_cpu(filt->pan_id),
+			le16_to_cpu(filt->short_addr));
 	return 0;
 }
 
@@ -1422,14 +4033,21 @@ static int lprf_ieee802154_energy_detection(struct ieee802154_hw *hw, u8 *level)
  * For the monitor interface to work the chip needs to support promiscuous
  * mode. This means that the chip only works in a kind of monitoring mode
  * with some IEEE specific features like address filtering turned off. As
- * our chip does not support any specific IEEE features on chip it basically
- * always works in promiscuous mode. Therefore this functions does not need
- * to do any specific communication with the chip.
+ * our chip does not support any specific IEEE features on chip, promiscuous
+ * mode only disables the software address filter of the RX path and
+ * no communication with the chip is needed.
  */
 static int
 lprf_set_promiscuous_mode(struct ieee802154_hw *hw, const bool on)
 {
-	PRINT_DEBUG("Set promiscuous mode");
+	struct lprf_local *lprf = hw->priv;
+	unsigned long flags;
+
+	spin_lock_irqsave(&lprf->addr_filt_lock, flags);
+	lprf->promiscuous = on;
+	spin_unlock_irqrestore(&lprf->addr_filt_lock, flags);
+
+	PRINT_DEBUG("Set promiscuous mode %s", on ? "on" : "off");
 	return 0;
 }
 
@@ -1439,9 +4057,9 @@ static const struct ieee802154_ops  ieee802154_lprf_callbacks = {
 	.stop = lprf_stop_ieee802154,
 	.xmit_sync = 0, /* should not be used anymore */
 	.xmit_async = lprf_xmit_ieee802154_async,
-	.ed = lprf_ieee802154_energy_detection, /* not supported by hardware */
+	.ed = lprf_ieee802154_energy_detection,
 	.set_channel = lprf_set_ieee802154_channel,
-	.set_hw_addr_filt = 0,
+	.set_hw_addr_filt = lprf_set_hw_addr_filt,
 	.set_txpower = lprf_set_tx_power,
 	.set_lbt = 0,		   /* Disabled in hw_flags */
 	.set_cca_mode = 0,
@@ -1464,347 +4082,2463 @@ static const struct ieee802154_ops  ieee802154_lprf_callbacks = {
  * proper IEEE 802.15.4 function.
  */
 
-int lprf_open_char_device(struct inode *inode, struct file *filp)
+/**
+ * Creates, replaces or removes the RX ring of a reader.
+ *
+ * @rx_ring: RX ring of the reader
+ * @num_slots: number of slots of the new ring or zero to remove the ring
+ *
+ * Frames stored in the old ring are discarded. Returns zero, -EINVAL for an
+ * unsupported number of slots, -ENOMEM or -EBUSY if the ring is mapped.
+ */
+static int lprf_set_rx_ring(struct lprf_rx_ring *rx_ring, u32 num_slots)
 {
-	struct lprf_local *lprf = 0;
+	struct lprf_rx_slot *slots = NULL;
+	struct lprf_rx_slot *old_slots;
+	unsigned long flags;
+
+	if (num_slots && (!is_power_of_2(num_slots) ||
+			num_slots < LPRF_RX_RING_MIN_SLOTS ||
+			num_slots > LPRF_RX_RING_MAX_SLOTS))
+		return -EINVAL;
+
+	if (num_slots) {
+		slots = vmalloc_user(num_slots * sizeof(*slots));
+		if (!slots)
+			return -ENOMEM;
+	}
+
+	mutex_lock(&rx_ring->mutex);
+	if (atomic_read(&rx_ring->mapped)) {
+		mutex_unlock(&rx_ring->mutex);
+		vfree(slots);
+		return -EBUSY;
+	}
+
+	spin_lock_irqsave(&rx_ring->lock, flags);
+	old_slots = rx_ring->slots;
+	rx_ring->slots = slots;
+	rx_ring->num_slots = num_slots;
+	rx_ring->head = 0;
+	spin_unlock_irqrestore(&rx_ring->lock, flags);
+	mutex_unlock(&rx_ring->mutex);
+
+	vfree(old_slots);
+	PRINT_DEBUG("RX ring with %u slots", num_slots);
+	return 0;
+}
+
+static void lprf_rx_ring_vm_open(struct vm_area_struct *vma)
+{
+	struct lprf_rx_ring *rx_ring = vma->vm_private_data;
+
+	atomic_inc(&rx_ring->mapped);
+}
+
+static void lprf_rx_ring_vm_close(struct vm_area_struct *vma)
+{
+	struct lprf_rx_ring *rx_ring = vma->vm_private_data;
+
+	atomic_dec(&rx_ring->mapped);
+}
+
+/**
+ * Counts the mappings of the RX ring, so it is not freed while mapped
+ */
+static const struct vm_operations_struct lprf_rx_ring_vm_ops = {
+	.open = lprf_rx_ring_vm_open,
+	.close = lprf_rx_ring_vm_close,
+};
+
+/**
+ * Maps the RX ring of the reader to user space. The ring needs to be created
+ * by LPRF_IOC_SET_RX_RING before.
+ */
+static int lprf_mmap_char_device(struct file *filp, struct vm_area_struct *vma)
+{
+	struct lprf_char_reader *reader = filp->private_data;
+	struct lprf_rx_ring *rx_ring = &reader->rx_ring;
 	int ret = 0;
-	lprf = container_of(inode->i_cdev, struct lprf_local, my_char_dev);
-	filp->private_data = lprf;
 
-	if (atomic_inc_return(&lprf_char_driver_interface.is_open) != 1) {
-		atomic_dec(&lprf_char_driver_interface.is_open);
-		return -EMFILE;
+	mutex_lock(&rx_ring->mutex);
+	if (!rx_ring->slots) {
+		ret = -EINVAL;
+		goto unlock;
+	}
+
+	ret = remap_vmalloc_range(vma, rx_ring->slots, vma->vm_pgoff);
+	if (ret)
+		goto unlock;
+
+	vma->vm_ops = &lprf_rx_ring_vm_ops;
+	vma->vm_private_data = rx_ring;
+	atomic_inc(&rx_ring->mapped);
+
+unlock:
+	mutex_unlock(&rx_ring->mutex);
+	return ret;
+}
+
+/**
+ * Drops all frames of a reader that have not been read yet. Needs to be
+ * called with lprf_char_driver_interface.lock held or after the reader has
+ * been removed from the reader list.
+ */
+static void lprf_char_discard(struct lprf_char_reader *reader)
+{
+	struct lprf_char_entry entry;
+
+	while (kfifo_get(&reader->frames, &entry))
+		kref_put(&entry.frame->ref, lprf_char_frame_release);
+	reader->offset = 0;
+}
+
+/**
+ * Switches a reader between record mode and byte stream mode. Frames that
+ * have not been read yet are discarded when the mode changes.
+ */
+static void lprf_set_rx_records(struct lprf_char_reader *reader,
+		bool records)
+{
+	unsigned long flags;
+
+	mutex_lock(&reader->read_mutex);
+	spin_lock_irqsave(&lprf_char_driver_interface.lock, flags);
+	if (reader->records != records) {
+		reader->records = records;
+		lprf_char_discard(reader);
 	}
+	spin_unlock_irqrestore(&lprf_char_driver_interface.lock, flags);
+	mutex_unlock(&reader->read_mutex);
+}
+
+/**
+ * Replaces the buffer of a reader by a buffer for num_frames frames. Frames
+ * that have not been read yet are discarded. Returns zero, -EINVAL for an
+ * unsupported number of frames or -ENOMEM.
+ */
+static int lprf_set_rx_buffer(struct lprf_char_reader *reader,
+		u32 num_frames)
+{
+	struct lprf_char_driver_interface *char_driver =
+			&lprf_char_driver_interface;
+	typeof(reader->frames) frames;
+	unsigned long flags;
+	int ret = 0;
+
+	if (!is_power_of_2(num_frames) ||
+			num_frames < LPRF_RX_BUFFER_MIN_FRAMES ||
+			num_frames > LPRF_RX_BUFFER_MAX_FRAMES)
+		return -EINVAL;
 
-	ret = kfifo_alloc(&lprf_char_driver_interface.data_buffer,
-			2024, GFP_KERNEL);
+	ret = kfifo_alloc(&frames, num_frames, GFP_KERNEL);
 	if (ret)
 		return ret;
 
-	atomic_set(&lprf_char_driver_interface.is_ready, 1);
-	PRINT_DEBUG("LPRF successfully opened as char device");
+	/* The reader stays listed, so every frame is delivered or counted */
+	mutex_lock(&reader->read_mutex);
+	spin_lock_irqsave(&char_driver->lock, flags);
+	lprf_char_discard(reader);
+	swap(reader->frames, frames);
+	spin_unlock_irqrestore(&char_driver->lock, flags);
+	mutex_unlock(&reader->read_mutex);
+
+	/* frames holds the emptied previous buffer now */
+	kfifo_free(&frames);
+
+	PRINT_DEBUG("Reader buffer for %u frames", num_frames);
 	return 0;
+}
+
+/**
+ * Opens the char device for another reader. Every reader has a buffer of its
+ * own for rx_buffer_frames frames and receives all frames in byte stream
+ * mode until it selects another mode.
+ */
+int lprf_open_char_device(struct inode *inode, struct file *filp)
+{
+	struct lprf_char_driver_interface *char_driver =
+			&lprf_char_driver_interface;
+	struct lprf_char_reader *reader;
+	unsigned long flags;
+	u32 num_frames = 0;
+	int ret = 0;
+
+	reader = kzalloc(sizeof(*reader), GFP_KERNEL);
+	if (!reader)
+		return -ENOMEM;
+
+	num_frames = roundup_pow_of_two(clamp_t(u32, rx_buffer_frames,
+			LPRF_RX_BUFFER_MIN_FRAMES, LPRF_RX_BUFFER_MAX_FRAMES));
+	ret = kfifo_alloc(&reader->frames, num_frames, GFP_KERNEL);
+	if (ret) {
+		kfree(reader);
+		return ret;
+	}
+
+	reader->lprf = container_of(inode->i_cdev, struct lprf_local,
+			my_char_dev);
+	ret = lprf_char_user_get(reader->lprf);
+	if (ret) {
+		kfifo_free(&reader->frames);
+		kfree(reader);
+		return ret;
+	}
 
+	mutex_init(&reader->read_mutex);
+	spin_lock_init(&reader->rx_ring.lock);
+	mutex_init(&reader->rx_ring.mutex);
+	filp->private_data = reader;
 
+	spin_lock_irqsave(&char_driver->lock, flags);
+	reader->id = ++char_driver->last_reader_id ?:
+			++char_driver->last_reader_id;
+	list_add_tail(&reader->list, &char_driver->readers);
+	spin_unlock_irqrestore(&char_driver->lock, flags);
+
+	PRINT_DEBUG("LPRF successfully opened as char device");
+	return 0;
 }
 
 int lprf_release_char_device(struct inode *inode, struct file *filp)
 {
-	struct lprf_local *lprf;
-	lprf = container_of(inode->i_cdev, struct lprf_local, my_char_dev);
+	struct lprf_char_reader *reader = filp->private_data;
+	unsigned long flags;
+
+	spin_lock_irqsave(&lprf_char_driver_interface.lock, flags);
+	list_del(&reader->list);
+	spin_unlock_irqrestore(&lprf_char_driver_interface.lock, flags);
+
+	/* All mappings of the RX ring are gone, as they hold the file */
+	lprf_set_rx_ring(&reader->rx_ring, 0);
+	lprf_char_discard(reader);
+	kfifo_free(&reader->frames);
+	lprf_char_user_put(reader->lprf);
+	kfree(reader);
+
+	PRINT_DEBUG("LPRF char device successfully released");
+	return 0;
+}
+
+/**
+ * Copies one record to user space in record mode. The rest of a record that
+ * is longer than the user space buffer is discarded, like for datagram
+ * sockets. If records were dropped before this one, its status contains
+ * LPRF_RX_STATUS_OVERFLOW. Returns the number of bytes copied or a negative
+ * error code.
+ */
+static ssize_t lprf_read_record(struct lprf_char_reader *reader,
+		char __user *buf, size_t count)
+{
+	struct lprf_char_entry entry;
+	struct lprf_rx_record record;
+	ssize_t bytes_copied = 0;
+	size_t header_length = 0;
+
+	if (!kfifo_get(&reader->frames, &entry))
+		return 0;
+
+	/* The header is shared with other readers and patched in a copy */
+	memcpy(&record, entry.frame->data, sizeof(record));
+	if (entry.overflow)
+		record.status |= LPRF_RX_STATUS_OVERFLOW;
+
+	bytes_copied = min_t(size_t, count, entry.frame->length);
+	header_length = min_t(size_t, bytes_copied, sizeof(record));
+	if (copy_to_user(buf, &record, header_length) ||
+			copy_to_user(buf + header_length,
+				entry.frame->data + header_length,
+				bytes_copied - header_length))
+		bytes_copied = -EFAULT;
+
+	kref_put(&entry.frame->ref, lprf_char_frame_release);
+	return bytes_copied;
+}
+
+/**
+ * Copies received raw data to user space in byte stream mode. Data of
+ * several frames is concatenated and a frame is read partly if the user
+ * space buffer ends. Returns the number of bytes copied or -EFAULT.
+ */
+static ssize_t lprf_read_stream(struct lprf_char_reader *reader,
+		char __user *buf, size_t count)
+{
+	struct lprf_char_entry entry;
+	size_t bytes_copied = 0;
+	size_t length = 0;
+
+	while (bytes_copied < count && kfifo_peek(&reader->frames, &entry)) {
+		length = min_t(size_t, count - bytes_copied,
+				entry.frame->length - reader->offset);
+		if (copy_to_user(buf + bytes_copied,
+				entry.frame->data + reader->offset, length))
+			return bytes_copied ? bytes_copied : -EFAULT;
+
+		bytes_copied += length;
+		reader->offset += length;
+		if (reader->offset == entry.frame->length) {
+			kfifo_skip(&reader->frames);
+			reader->offset = 0;
+			kref_put(&entry.frame->ref, lprf_char_frame_release);
+		}
+	}
+
+	return bytes_copied;
+}
+
+ssize_t lprf_read_char_device(struct file *filp,
+		char __user *buf, size_t count, loff_t *f_pos)
+{
+	struct lprf_char_reader *reader = filp->private_data;
+	ssize_t ret = 0;
+
+	PRINT_KRIT("Read from user space with buffer size %d requested", count);
+
+	if (mutex_lock_interruptible(&reader->read_mutex))
+		return -ERESTARTSYS;
+
+	/* Another thread might read the frames before the mutex is taken */
+	while (kfifo_is_empty(&reader->frames)) {
+		mutex_unlock(&reader->read_mutex);
+		if (filp->f_flags & O_NONBLOCK)
+			return -EAGAIN;
+
+		PRINT_KRIT("Read_char_device goes to sleep.");
+		ret = wait_event_interruptible(
+			lprf_char_driver_interface.wait_for_rx_data,
+			!kfifo_is_empty(&reader->frames));
+		if (ret < 0)
+			return ret;
+		PRINT_KRIT("Returned from sleep in read_char_device.");
+
+		if (mutex_lock_interruptible(&reader->read_mutex))
+			return -ERESTARTSYS;
+	}
+
+	if (reader->records)
+		ret = lprf_read_record(reader, buf, count);
+	else
+		ret = lprf_read_stream(reader, buf, count);
+	mutex_unlock(&reader->read_mutex);
+
+	PRINT_KRIT("%zd bytes copied to user.", ret);
+	return ret;
+}
+
+/**
+ * Allocates a frame of the char driver interface, which is sent with the
+ * current frame settings of the char driver interface.
+ */
+static struct sk_buff *lprf_alloc_char_skb(struct lprf_local *lprf,
+		int length)
+{
+	struct sk_buff *skb = dev_alloc_skb(length);
+
+	if (skb)
+		lprf_init_skb_cb(skb, true, lprf->long_frames,
+				lprf->fec.enabled);
+	return skb;
+}
+
+/**
+ * Waits until the TX queue has room for another frame of the char driver
+ * interface. Returns zero, -EAGAIN if the queue is full and filp is non
+ * blocking or -ERESTARTSYS if the wait got interrupted.
+ */
+static int lprf_wait_for_tx_queue(struct lprf_local *lprf, struct file *filp)
+{
+	if (skb_queue_len(&lprf->tx_queue) < LPRF_TX_QUEUE_LEN)
+		return 0;
+
+	if (filp->f_flags & O_NONBLOCK)
+		return -EAGAIN;
+
+	PRINT_KRIT("Write_char_device goes to sleep.");
+	return wait_event_interruptible(
+			lprf_char_driver_interface.wait_for_tx_ready,
+			skb_queue_len(&lprf->tx_queue) < LPRF_TX_QUEUE_LEN);
+}
+
+/**
+ * Queues a frame of the char driver interface. The room in the TX queue is
+ * checked and the frame is queued under the queue lock, so that concurrent
+ * writers never exceed LPRF_TX_QUEUE_LEN.
+ *
+ * @lprf: lprf_local struct
+ * @skb: frame to queue, which is freed on error
+ * @filp: opened char device to wait for room in the TX queue (see
+ * 	lprf_wait_for_tx_queue()) or NULL to fail if the queue is full
+ *
+ * Returns zero, -EAGAIN if the queue is full and the caller does not wait or
+ * -ERESTARTSYS if the wait got interrupted.
+ */
+static int lprf_queue_char_skb(struct lprf_local *lprf, struct sk_buff *skb,
+		struct file *filp)
+{
+	unsigned long flags;
+	bool queued = false;
+	int ret = 0;
+
+	while (!ret) {
+		spin_lock_irqsave(&lprf->tx_queue.lock, flags);
+		queued = skb_queue_len(&lprf->tx_queue) < LPRF_TX_QUEUE_LEN;
+		if (queued)
+			__skb_queue_tail(&lprf->tx_queue, skb);
+		spin_unlock_irqrestore(&lprf->tx_queue.lock, flags);
+		if (queued)
+			return 0;
+
+		ret = filp ? lprf_wait_for_tx_queue(lprf, filp) : -EAGAIN;
+	}
+
+	kfree_skb(skb);
+	return ret;
+}
+
+/**
+ * Moves the aggregated frame to the TX queue. Needs to be called with
+ * aggregation.lock held. Returns true if a frame has been queued.
+ */
+static bool __lprf_aggregation_flush(struct lprf_local *lprf)
+{
+	struct lprf_aggregation *aggregation = &lprf->aggregation;
+
+	if (!aggregation->skb)
+		return false;
+
+	skb_queue_tail(&lprf->tx_queue, aggregation->skb);
+	aggregation->skb = NULL;
+	aggregation->tx_frames++;
+	return true;
+}
+
+/**
+ * Timer callback sending the aggregated frame after the aggregation delay.
+ */
+static enum hrtimer_restart lprf_aggregation_timer(struct hrtimer *timer)
+{
+	struct lprf_aggregation *aggregation =
+			container_of(timer, struct lprf_aggregation, timer);
+	struct lprf_local *lprf = container_of(aggregation,
+			struct lprf_local, aggregation);
+	unsigned long flags;
+	bool queued = false;
+
+	spin_lock_irqsave(&aggregation->lock, flags);
+	queued = __lprf_aggregation_flush(lprf);
+	spin_unlock_irqrestore(&aggregation->lock, flags);
+
+	if (queued)
+		lprf_phy_status_async(&lprf->phy_status);
+
+	return HRTIMER_NORESTART;
+}
+
+/**
+ * Packs a payload of the char driver interface into the aggregated frame.
+ *
+ * @lprf: lprf_local struct
+ * @payload: written data
+ * @length: length of payload, at most the maximum PSDU length minus
+ * 	LPRF_AGG_HEADER_LENGTH
+ *
+ * Every payload is preceded by a sub-frame header containing its length.
+ * Many small payloads share the synchronization header, the physical header
+ * and the state changes of one frame this way. The frame is queued for
+ * transmission as soon as no further payload fits or at the latest
+ * aggregation.delay after its first payload.
+ *
+ * Returns zero, -EMSGSIZE for an empty payload, which would end the
+ * aggregated frame for the receiver (see lprf_deaggregate()), or -ENOMEM.
+ */
+static int lprf_aggregate(struct lprf_local *lprf, const uint8_t *payload,
+		int length)
+{
+	struct lprf_aggregation *aggregation = &lprf->aggregation;
+	struct sk_buff *skb;
+	unsigned long flags;
+	bool queued = false;
+	int max_length = lprf_max_char_payload(lprf);
+	int ret = 0;
+
+	if (length <= 0)
+		return -EMSGSIZE;
+
+	spin_lock_irqsave(&aggregation->lock, flags);
+
+	skb = aggregation->skb;
+	if (skb && (LPRF_SKB_CB(skb)->long_frame != lprf->long_frames ||
+			LPRF_SKB_CB(skb)->fec != lprf->fec.enabled ||
+			skb->len + LPRF_AGG_HEADER_LENGTH + length >
+			max_length))
+		queued = __lprf_aggregation_flush(lprf);
+
+	if (!aggregation->skb) {
+		skb = lprf_alloc_char_skb(lprf, max_length);
+		if (!skb) {
+			ret = -ENOMEM;
+			goto unlock;
+		}
+		aggregation->skb = skb;
+		hrtimer_start(&aggregation->timer, aggregation->delay,
+				HRTIMER_MODE_REL);
+	}
+
+	*skb_put(skb, LPRF_AGG_HEADER_LENGTH) = length;
+	memcpy(skb_put(skb, length), payload, length);
+	aggregation->tx_payloads++;
+
+	/* Not even a one byte payload fits anymore */
+	if (skb->len + LPRF_AGG_HEADER_LENGTH >= max_length)
+		queued |= __lprf_aggregation_flush(lprf);
+
+unlock:
+	spin_unlock_irqrestore(&aggregation->lock, flags);
+
+	if (queued)
+		lprf_phy_status_async(&lprf->phy_status);
+
+	return ret;
+}
+
+/**
+ * Copies written data from user space and packs it into the aggregated
+ * frame. Returns the number of bytes written, -EMSGSIZE for an empty write
+ * or a write that does not fit into a sub-frame or another negative error
+ * code.
+ */
+static ssize_t lprf_write_aggregated(struct lprf_local *lprf,
+		const char __user *buf, size_t count)
+{
+	uint8_t payload[LPRF_LONG_MAX_PSDU];
+	int ret = 0;
+
+	if (!count || count >
+			lprf_max_char_payload(lprf) - LPRF_AGG_HEADER_LENGTH)
+		return -EMSGSIZE;
+
+	if (copy_from_user(payload, buf, count))
+		return -EFAULT;
+
+	ret = lprf_aggregate(lprf, payload, count);
+	if (ret)
+		return ret;
+
+	return count;
+}
+
+/**
+ * Changes the aggregation settings. A frame that is currently aggregated is
+ * sent when aggregation gets disabled. As received frames are not passed to
+ * the IEEE 802.15.4 stack while aggregation is enabled, it can only be
+ * enabled while the IEEE 802.15.4 interface is down. lprf.run_lock keeps the
+ * interface from coming up during the change.
+ *
+ * Returns zero, -EINVAL for a delay above LPRF_MAX_AGGREGATION_DELAY_US or
+ * -EBUSY if aggregation is enabled while the interface is up.
+ */
+static int lprf_set_aggregation(struct lprf_local *lprf,
+		const struct lprf_aggregation_config *config)
+{
+	struct lprf_aggregation *aggregation = &lprf->aggregation;
+	unsigned long flags;
+	bool queued = false;
+
+	if (config->delay_us > LPRF_MAX_AGGREGATION_DELAY_US)
+		return -EINVAL;
+
+	mutex_lock(&lprf->run_lock);
+	if (lprf->started && config->enabled && !aggregation->enabled) {
+		mutex_unlock(&lprf->run_lock);
+		return -EBUSY;
+	}
+
+	spin_lock_irqsave(&aggregation->lock, flags);
+	aggregation->delay = ns_to_ktime(
+			(u64)config->delay_us * NSEC_PER_USEC);
+	aggregation->enabled = config->enabled;
+	if (!aggregation->enabled)
+		queued = __lprf_aggregation_flush(lprf);
+	spin_unlock_irqrestore(&aggregation->lock, flags);
+	mutex_unlock(&lprf->run_lock);
+
+	if (queued)
+		lprf_phy_status_async(&lprf->phy_status);
+
+	PRINT_DEBUG("Aggregation %s, delay %u us",
+			config->enabled ? "enabled" : "disabled",
+			config->delay_us);
+	return 0;
+}
+
+/**
+ * write() of the char driver interface. The written data is sent as one
+ * frame or packed into the aggregated frame. Data longer than the maximum
+ * payload of the current frame format is not truncated but rejected with
+ * -EMSGSIZE, like by writev(). Returns the number of bytes written or a
+ * negative error code.
+ */
+ssize_t lprf_write_char_device(struct file *filp, const char __user *buf,
+		size_t count, loff_t *f_pos)
+{
+	int bytes_copied = 0;
+	int bytes_to_copy = 0;
+	int ret = 0;
+	struct sk_buff *skb;
+	struct lprf_char_reader *reader = filp->private_data;
+	struct lprf_local *lprf = reader->lprf;
+
+	PRINT_KRIT("Enter write char device");
+
+	if (count > lprf_max_char_payload(lprf))
+		return -EMSGSIZE;
+
+	ret = lprf_wait_for_tx_queue(lprf, filp);
+	if (ret < 0)
+		return ret;
+
+	if (lprf->aggregation.enabled)
+		return lprf_write_aggregated(lprf, buf, count);
+
+	bytes_to_copy = count;
+	skb = lprf_alloc_char_skb(lprf, bytes_to_copy);
+	if (!skb)
+		return -ENOMEM;
+
+	if (copy_from_user(skb_put(skb, bytes_to_copy), buf, bytes_to_copy)) {
+		kfree_skb(skb);
+		return -EFAULT;
+	}
+	bytes_copied = bytes_to_copy;
+	PRINT_KRIT("Copied %d/%d files to TX buffer", bytes_copied, count);
+
+	ret = lprf_queue_char_skb(lprf, skb, filp);
+	if (ret)
+		return ret;
+
+	PRINT_KRIT("Call state change from write char device");
+
+	ret = lprf_phy_status_async(&lprf->phy_status);
+	if (ret)
+		PRINT_KRIT("phy status busy in lprf_write_char_device");
+
+	PRINT_KRIT("Return from write char device");
+	return bytes_copied;
+}
+
+/**
+ * Queues the current segment of a writev() as one frame.
+ *
+ * @lprf: lprf_local struct
+ * @filp: opened char device to wait for room in the TX queue or NULL (see
+ * 	lprf_queue_char_skb())
+ * @from: iterator over the written segments, advanced to the next segment
+ * @length: length of the current segment
+ *
+ * With aggregation enabled the segment is packed into the aggregated frame
+ * instead. Returns zero or a negative error code.
+ */
+static int lprf_queue_segment(struct lprf_local *lprf, struct file *filp,
+		struct iov_iter *from, size_t length)
+{
+	uint8_t payload[LPRF_LONG_MAX_PSDU];
+	struct sk_buff *skb;
+
+	if (lprf->aggregation.enabled) {
+		if (copy_from_iter(payload, length, from) != length)
+			return -EFAULT;
+		return lprf_aggregate(lprf, payload, length);
+	}
+
+	skb = lprf_alloc_char_skb(lprf, length);
+	if (!skb)
+		return -ENOMEM;
+
+	if (copy_from_iter(skb_put(skb, length), length, from) != length) {
+		kfree_skb(skb);
+		return -EFAULT;
+	}
+
+	return lprf_queue_char_skb(lprf, skb, filp);
+}
+
+/**
+ * writev() of the char driver interface. Every segment is sent as a frame
+ * of its own.
+ *
+ * All segments are queued before the chip is polled once, so a batch of
+ * frames needs only one system call and is sent as a burst. Like write(),
+ * writev() only blocks while the TX queue is full before the first segment.
+ * Queueing stops at the first segment that does not fit into the TX queue,
+ * is empty or exceeds the maximum payload length. Returns the number of
+ * bytes of all queued segments or a negative error code if not even the
+ * first segment got queued.
+ */
+static ssize_t lprf_write_iter_char_device(struct kiocb *iocb,
+		struct iov_iter *from)
+{
+	struct lprf_char_reader *reader = iocb->ki_filp->private_data;
+	struct lprf_local *lprf = reader->lprf;
+	size_t max_length = lprf_max_char_payload(lprf);
+	size_t length = 0;
+	ssize_t written = 0;
+	int ret = 0;
+
+	ret = lprf_wait_for_tx_queue(lprf, iocb->ki_filp);
+	if (ret < 0)
+		return ret;
+
+	if (lprf->aggregation.enabled)
+		max_length -= LPRF_AGG_HEADER_LENGTH;
+
+	while (iov_iter_count(from)) {
+		length = iov_iter_single_seg_count(from);
+		if (!length || length > max_length) {
+			ret = -EMSGSIZE;
+			break;
+		}
+
+		/* Only the first segment waits for room in the TX queue */
+		ret = lprf_queue_segment(lprf, written ? NULL : iocb->ki_filp,
+				from, length);
+		if (ret)
+			break;
+		written += length;
+	}
+
+	if (!written)
+		return ret;
+
+	ret = lprf_phy_status_async(&lprf->phy_status);
+	if (ret)
+		PRINT_KRIT("phy status busy in lprf_write_iter_char_device");
+
+	PRINT_KRIT("Queued %zd bytes by writev", written);
+	return written;
+}
+
+/**
+ * Queues one frame of a batch for transmission.
+ *
+ * @lprf: lprf_local struct
+ * @reader: reader queueing the frame
+ * @filp: opened char device to wait for room in the TX queue or NULL (see
+ * 	lprf_queue_char_skb())
+ * @frame: frame description copied from user space
+ *
+ * With aggregation enabled the frame gets a sub-frame header, so that the
+ * receiver unpacks it like any aggregated frame with a single payload.
+ * Returns zero, -EINVAL for invalid flags, an unsupported TX power or a send
+ * time more than LPRF_MAX_SEND_DELAY_NS ahead, -EMSGSIZE for an invalid
+ * length or another negative error code.
+ */
+static int lprf_queue_batch_frame(struct lprf_local *lprf,
+		const struct lprf_char_reader *reader, struct file *filp,
+		const struct lprf_tx_frame *frame)
+{
+	const void __user *data = (const void __user *)(uintptr_t)frame->data;
+	bool aggregated = lprf->aggregation.enabled;
+	int header_length = aggregated ? LPRF_AGG_HEADER_LENGTH : 0;
+	int level = LPRF_DEFAULT_TX_POWER;
+	struct sk_buff *skb;
+
+	if (frame->flags & ~(LPRF_TX_FRAME_POWER | LPRF_TX_FRAME_TIME |
+			LPRF_TX_FRAME_REPORT) || frame->reserved)
+		return -EINVAL;
+
+	if (!frame->length || frame->length >
+			lprf_max_char_payload(lprf) - header_length)
+		return -EMSGSIZE;
+
+	if (frame->flags & LPRF_TX_FRAME_POWER) {
+		level = lprf_tx_power_to_level(frame->tx_power);
+		if (level < 0)
+			return level;
+	}
+
+	/* A far future frame would block all frames queued after it */
+	if (frame->flags & LPRF_TX_FRAME_TIME && frame->send_time_ns >
+			ktime_get_ns() + LPRF_MAX_SEND_DELAY_NS)
+		return -EINVAL;
+
+	skb = lprf_alloc_char_skb(lprf, header_length + frame->length);
+	if (!skb)
+		return -ENOMEM;
+
+	if (aggregated)
+		*skb_put(skb, LPRF_AGG_HEADER_LENGTH) = frame->length;
+	if (copy_from_user(skb_put(skb, frame->length), data,
+			frame->length)) {
+		kfree_skb(skb);
+		return -EFAULT;
+	}
+
+	LPRF_SKB_CB(skb)->tx_power = level;
+	if (frame->flags & LPRF_TX_FRAME_TIME)
+		LPRF_SKB_CB(skb)->send_time = ns_to_ktime(frame->send_time_ns);
+	LPRF_SKB_CB(skb)->report = frame->flags & LPRF_TX_FRAME_REPORT;
+	LPRF_SKB_CB(skb)->id = frame->id;
+	LPRF_SKB_CB(skb)->reader_id = reader->id;
+	LPRF_SKB_CB(skb)->queued = ktime_get();
+
+	return lprf_queue_char_skb(lprf, skb, filp);
+}
+
+/**
+ * Queues the frames of LPRF_IOC_SEND_BATCH for transmission.
+ *
+ * @lprf: lprf_local struct
+ * @filp: opened char device
+ * @batch: batch copied from user space, num_queued is set to the number of
+ * 	queued frames
+ *
+ * All frames are queued before the chip is polled once. Returns zero if at
+ * least one frame got queued and a negative error code otherwise.
+ */
+static int lprf_send_batch(struct lprf_local *lprf, struct file *filp,
+		struct lprf_tx_batch *batch)
+{
+	struct lprf_tx_frame __user *frames =
+			(struct lprf_tx_frame __user *)(uintptr_t)batch->frames;
+	struct lprf_tx_frame frame;
+	int ret = 0;
+
+	batch->num_queued = 0;
+	if (!batch->num_frames)
+		return 0;
+
+	ret = lprf_wait_for_tx_queue(lprf, filp);
+	if (ret < 0)
+		return ret;
+
+	while (batch->num_queued < batch->num_frames) {
+		if (copy_from_user(&frame, &frames[batch->num_queued],
+				sizeof(frame))) {
+			ret = -EFAULT;
+			break;
+		}
+
+		/* Only the first frame waits for room in the TX queue */
+		ret = lprf_queue_batch_frame(lprf, filp->private_data,
+				batch->num_queued ? NULL : filp, &frame);
+		if (ret)
+			break;
+		batch->num_queued++;
+	}
+
+	if (!batch->num_queued)
+		return ret;
+
+	if (lprf_phy_status_async(&lprf->phy_status))
+		PRINT_KRIT("phy status busy in lprf_send_batch");
+
+	PRINT_KRIT("Queued %u/%u frames of batch", batch->num_queued,
+			batch->num_frames);
+	return 0;
+}
+
+/**
+ * Returns true if the RX ring contains frames for user space. Like for
+ * PACKET_MMAP rings, this is the case if the last filled slot has not been
+ * handed back yet.
+ */
+static bool lprf_rx_ring_readable(struct lprf_rx_ring *rx_ring)
+{
+	struct lprf_rx_slot *slot;
+	unsigned long flags;
+	bool readable = false;
+
+	spin_lock_irqsave(&rx_ring->lock, flags);
+	if (rx_ring->slots) {
+		slot = &rx_ring->slots[(rx_ring->head - 1) &
+				(rx_ring->num_slots - 1)];
+		flush_dcache_page(vmalloc_to_page(slot));
+		readable = smp_load_acquire(&slot->status) == LPRF_SLOT_USER;
+	}
+	spin_unlock_irqrestore(&rx_ring->lock, flags);
+
+	return readable;
+}
+
+/**
+ * Reports the readiness of the char device for poll(), select() and epoll.
+ * The device is readable if received data or records are available in the
+ * read() buffer or in the RX ring of the reader and writable if the TX queue
+ * has space for another frame.
+ */
+static unsigned int lprf_poll_char_device(struct file *filp,
+		poll_table *wait)
+{
+	struct lprf_char_reader *reader = filp->private_data;
+	struct lprf_local *lprf = reader->lprf;
+	unsigned int mask = 0;
+
+	poll_wait(filp, &lprf_char_driver_interface.wait_for_rx_data, wait);
+	poll_wait(filp, &lprf_char_driver_interface.wait_for_tx_ready, wait);
+
+	if (!kfifo_is_empty(&reader->frames) ||
+			lprf_rx_ring_readable(&reader->rx_ring))
+		mask |= POLLIN | POLLRDNORM;
+
+	if (skb_queue_len(&lprf->tx_queue) < LPRF_TX_QUEUE_LEN)
+		mask |= POLLOUT | POLLWRNORM;
+
+	return mask;
+}
+
+static int lprf_set_data_rate(struct lprf_local *lprf, u32 kbit_rate);
+static int lprf_set_shr(struct lprf_local *lprf,
+		const struct lprf_shr_config *config);
+static int lprf_set_long_frames(struct lprf_local *lprf, bool enable);
+static int lprf_set_fec(struct lprf_local *lprf, bool enable);
+
+/**
+ * ioctl interface of the char device. The commands are defined in
+ * lprf_ioctl.h.
+ */
+static long lprf_ioctl_char_device(struct file *filp, unsigned int cmd,
+		unsigned long arg)
+{
+	struct lprf_char_reader *reader = filp->private_data;
+	struct lprf_local *lprf = reader->lprf;
+	struct lprf_hop_config hop_config;
+	struct lprf_shr_config shr_config;
+	__u32 kbit_rate = 0;
+	__u32 long_frames = 0;
+	struct lprf_aggregation_config aggregation_config;
+	__u32 fec = 0;
+	__u32 records = 0;
+	__u32 num_slots = 0;
+	struct lprf_tx_batch tx_batch;
+	__u32 num_frames = 0;
+	int ret = 0;
+
+	if (_IOC_TYPE(cmd) != LPRF_IOC_MAGIC)
+		return -ENOTTY;
+
+	switch (cmd) {
+	case LPRF_IOC_START_HOPPING:
+		if (copy_from_user(&hop_config, (void __user *)arg,
+				sizeof(hop_config)))
+			return -EFAULT;
+		return lprf_start_hopping(lprf, &hop_config);
+	case LPRF_IOC_STOP_HOPPING:
+		lprf_stop_hopping(lprf);
+		return 0;
+	case LPRF_IOC_SET_DATA_RATE:
+		if (get_user(kbit_rate, (__u32 __user *)arg))
+			return -EFAULT;
+		return lprf_set_data_rate(lprf, kbit_rate);
+	case LPRF_IOC_GET_DATA_RATE:
+		kbit_rate = lprf->rate.profile->kbit_rate;
+		return put_user(kbit_rate, (__u32 __user *)arg);
+	case LPRF_IOC_SET_SHR:
+		if (copy_from_user(&shr_config, (void __user *)arg,
+				sizeof(shr_config)))
+			return -EFAULT;
+		return lprf_set_shr(lprf, &shr_config);
+	case LPRF_IOC_GET_SHR:
+		if (copy_to_user((void __user *)arg, &lprf->shr,
+				sizeof(lprf->shr)))
+			return -EFAULT;
+		return 0;
+	case LPRF_IOC_SET_LONG_FRAMES:
+		if (get_user(long_frames, (__u32 __user *)arg))
+			return -EFAULT;
+		return lprf_set_long_frames(lprf, long_frames);
+	case LPRF_IOC_GET_LONG_FRAMES:
+		long_frames = lprf->long_frames;
+		return put_user(long_frames, (__u32 __user *)arg);
+	case LPRF_IOC_SET_AGGREGATION:
+		if (copy_from_user(&aggregation_config, (void __user *)arg,
+				sizeof(aggregation_config)))
+			return -EFAULT;
+		return lprf_set_aggregation(lprf, &aggregation_config);
+	case LPRF_IOC_GET_AGGREGATION:
+		aggregation_config.enabled = lprf->aggregation.enabled;
+		aggregation_config.delay_us = ktime_to_us(
+				lprf->aggregation.delay);
+		if (copy_to_user((void __user *)arg, &aggregation_config,
+				sizeof(aggregation_config)))
+			return -EFAULT;
+		return 0;
+	case LPRF_IOC_SET_FEC:
+		if (get_user(fec, (__u32 __user *)arg))
+			return -EFAULT;
+		return lprf_set_fec(lprf, fec);
+	case LPRF_IOC_GET_FEC:
+		fec = lprf->fec.enabled;
+		return put_user(fec, (__u32 __user *)arg);
+	case LPRF_IOC_SET_RX_RECORDS:
+		if (get_user(records, (__u32 __user *)arg))
+			return -EFAULT;
+		lprf_set_rx_records(reader, records);
+		return 0;
+	case LPRF_IOC_GET_RX_RECORDS:
+		records = reader->records;
+		return put_user(records, (__u32 __user *)arg);
+	case LPRF_IOC_SET_RX_RING:
+		if (get_user(num_slots, (__u32 __user *)arg))
+			return -EFAULT;
+		return lprf_set_rx_ring(&reader->rx_ring, num_slots);
+	case LPRF_IOC_GET_RX_RING:
+		num_slots = reader->rx_ring.num_slots;
+		return put_user(num_slots, (__u32 __user *)arg);
+	case LPRF_IOC_SEND_BATCH:
+		if (copy_from_user(&tx_batch, (void __user *)arg,
+				sizeof(tx_batch)))
+			return -EFAULT;
+		ret = lprf_send_batch(lprf, filp, &tx_batch);
+		if (ret)
+			return ret;
+		if (copy_to_user((void __user *)arg, &tx_batch,
+				sizeof(tx_batch)))
+			return -EFAULT;
+		return 0;
+	case LPRF_IOC_SET_RX_BUFFER:
+		if (get_user(num_frames, (__u32 __user *)arg))
+			return -EFAULT;
+		return lprf_set_rx_buffer(reader, num_frames);
+	case LPRF_IOC_GET_RX_BUFFER:
+		num_frames = kfifo_size(&reader->frames);
+		return put_user(num_frames, (__u32 __user *)arg);
+	default:
+		return -ENOTTY;
+	}
+}
+
+/**
+ * Defines the callback functions for file operations
+ * when the lprf device is used with the char driver interface
+ */
+static const struct file_operations lprf_fops = {
+	.owner =             THIS_MODULE,
+	.read =              lprf_read_char_device,
+	.write =             lprf_write_char_device,
+	.write_iter =        lprf_write_iter_char_device,
+	.poll =              lprf_poll_char_device,
+	.unlocked_ioctl =    lprf_ioctl_char_device,
+	.mmap =              lprf_mmap_char_device,
+	.open =              lprf_open_char_device,
+	.release =           lprf_release_char_device,
+};
+
+/**
+ * Registers the LPRF-Chip as char-device. Make sure to execute this function
+ * only after the chip has been fully initialized and is ready to use.
+ */
+static int register_char_device(struct lprf_local *lprf)
+{
+	int ret = 0;
+	dev_t dev_number = 0;
+
+	ret = alloc_chrdev_region(&dev_number, 0, 1, "lprf");
+	if (ret) {
+		PRINT_DEBUG("Dynamic Device number allocation failed");
+		return ret;
+	}
+
+	cdev_init(&lprf->my_char_dev, &lprf_fops);
+	lprf->my_char_dev.owner = THIS_MODULE;
+	ret = cdev_add (&lprf->my_char_dev, dev_number, 1);
+	if (ret) {
+		goto unregister;
+	}
+	PRINT_DEBUG("Successfully added char driver to system");
+	return ret;
+
+unregister:
+	unregister_chrdev_region(dev_number, 1);
+	return ret;
+}
+
+static inline void unregister_char_device(struct lprf_local *lprf)
+{
+	dev_t dev_number = lprf->my_char_dev.dev;
+	cdev_del(&lprf->my_char_dev);
+	unregister_chrdev_region(dev_number, 1);
+	PRINT_DEBUG( "Removed Char Device");
+}
+
+
+/***
+ *      ____           _                        __
+ *     |  _ \    ___  | |__    _   _    __ _   / _|  ___
+ *     | | | |  / _ \ | '_ \  | | | |  / _` | | |_  / __|
+ *     | |_| | |  __/ | |_) | | |_| | | (_| | |  _| \__ \
+ *     |____/   \___| |_.__/   \__,_|  \__, | |_|   |___/
+ *                                     |___/
+ *
+ * This section contains the channel scan, the characterisation of the state
+ * machine startup timers and the debugfs interface, which shows the results
+ * of the channel scan and the occupancy of all channels. The startup timers
+ * can be changed in sm_time/ and are written to the chip when the WPAN
+ * device is activated. The debugfs files are located in
+ * /sys/kernel/debug/lprf/.
+ */
+
+/**
+ * Restarts RX mode synchronously by resetting the FIFO, the state machine
+ * and the demodulator.
+ */
+static int lprf_scan_restart_rx(struct lprf_local *lprf)
+{
+	int ret = 0;
+
+	if (lprf->rx_length.shortened) {
+		RETURN_ON_ERROR(lprf_write_rx_length(lprf,
+				lprf->rx_length.max_counter));
+	}
+
+	RETURN_ON_ERROR(lprf_write_subreg(lprf, SR_SM_COMMAND, STATE_CMD_SLEEP));
+
+	lprf_batch_begin(lprf);
+	lprf_batch_write_subreg(lprf, SR_FIFO_RESETB, 0);
+	lprf_batch_write_subreg(lprf, SR_SM_RESETB,   0);
+	lprf_batch_write_subreg(lprf, SR_DEM_RESETB,  0);
+	RETURN_ON_ERROR(lprf_batch_flush(lprf));
+
+	lprf_batch_begin(lprf);
+	lprf_batch_write_subreg(lprf, SR_FIFO_RESETB, 1);
+	lprf_batch_write_subreg(lprf, SR_SM_RESETB,   1);
+	lprf_batch_write_subreg(lprf, SR_DEM_RESETB,  1);
+	RETURN_ON_ERROR(lprf_batch_flush(lprf));
+
+	RETURN_ON_ERROR(lprf_write_subreg(lprf, SR_SM_COMMAND, STATE_CMD_RX));
+	return lprf_write_subreg(lprf, SR_SM_COMMAND, STATE_CMD_NONE);
+}
+
+/**
+ * Scans one channel.
+ *
+ * @lprf: lprf_local struct
+ * @channel: channel to scan
+ * @result: result of the scan
+ *
+ * The chip listens on the channel and samples the physical status and the
+ * AGC gain. A sample is busy if the chip started receiving data. In that
+ * case RX mode is restarted, so every sample is independent of the last
+ * one.
+ */
+static int lprf_scan_channel(struct lprf_local *lprf, u8 channel,
+		struct lprf_scan_result *result)
+{
+	unsigned int gain = 0;
+	int phy_status = 0;
+	int ret = 0;
+	int i = 0;
+
+	memset(result, 0, sizeof(*result));
+
+	RETURN_ON_ERROR(lprf_write_subreg(lprf, SR_SM_COMMAND, STATE_CMD_SLEEP));
+	RETURN_ON_ERROR(lprf_set_ieee802154_channel(lprf->hw, 0, channel));
+	RETURN_ON_ERROR(lprf_scan_restart_rx(lprf));
+
+	for (i = 0; i < lprf->scan.samples; ++i) {
+		usleep_range(LPRF_SCAN_SAMPLE_US, 2 * LPRF_SCAN_SAMPLE_US);
+
+		phy_status = lprf_read_phy_status(lprf);
+		if (phy_status < 0)
+			return phy_status;
+		RETURN_ON_ERROR(lprf_read_agc_gain(lprf, &gain));
+
+		result->samples++;
+		result->gain_sum += gain;
+
+		if (!PHY_FIFO_EMPTY(phy_status) ||
+				PHY_SM_STATUS(phy_status) != PHY_SM_RECEIVING) {
+			result->busy++;
+			RETURN_ON_ERROR(lprf_scan_restart_rx(lprf));
+		}
+	}
+
+	return 0;
+}
+
+/**
+ * Scans all channels and switches back to the previous channel afterwards.
+ * The polling is stopped during the scan, which takes roughly
+ * 16 * samples * 200 us.
+ */
+static void lprf_scan_work(struct work_struct *work)
+{
+	struct lprf_local *lprf =
+			container_of(work, struct lprf_local, scan.work);
+	struct lprf_scan *scan = &lprf->scan;
+	u8 previous_channel = lprf->channel_switch.channel;
+	bool polling = false;
+	int channel = 0;
+	int ret = 0;
+
+	mutex_lock(&lprf->run_lock);
+	polling = lprf_polling_wanted(lprf);
+	if (polling) {
+		lprf_stop_polling(lprf);
+
+		/* Wait some time to make sure all pending communication finished*/
+		usleep_range(900, 1000);
+	}
+
+	mutex_lock(&scan->lock);
+	for (channel = LPRF_FIRST_CHANNEL; channel <= LPRF_LAST_CHANNEL &&
+			!ret; ++channel) {
+		ret = lprf_scan_channel(lprf, channel,
+				&scan->results[channel - LPRF_FIRST_CHANNEL]);
+	}
+	mutex_unlock(&scan->lock);
+
+	if (ret)
+		dev_err(&lprf->spi_device->dev, "Channel scan failed %d\n", ret);
+
+	lprf_write_subreg(lprf, SR_SM_COMMAND, STATE_CMD_SLEEP);
+	lprf_set_ieee802154_channel(lprf->hw, 0, previous_channel);
+
+	if (polling)
+		lprf_resume_polling(lprf);
+	mutex_unlock(&lprf->run_lock);
+}
+
+/**
+ * Shows the results of the last channel scan.
+ */
+static int lprf_scan_show(struct seq_file *file, void *data)
+{
+	struct lprf_local *lprf = file->private;
+	struct lprf_scan_result *result = 0;
+	int i = 0;
+
+	seq_puts(file, "channel  samples  busy[1/1000]  agc_gain\n");
+
+	mutex_lock(&lprf->scan.lock);
+	for (i = 0; i < LPRF_NUM_CHANNELS; ++i) {
+		result = &lprf->scan.results[i];
+		if (!result->samples)
+			continue;
+		seq_printf(file, "%7d  %7u  %12u  %8u\n",
+				i + LPRF_FIRST_CHANNEL, result->samples,
+				result->busy * 1000 / result->samples,
+				result->gain_sum / result->samples);
+	}
+	mutex_unlock(&lprf->scan.lock);
+
+	return 0;
+}
+
+static int lprf_scan_open(struct inode *inode, struct file *file)
+{
+	return single_open(file, lprf_scan_show, inode->i_private);
+}
+
+/**
+ * Starts a channel scan. The number of samples per channel can be written
+ * to the file, zero uses the last number of samples. At most
+ * LPRF_SCAN_MAX_SAMPLES are accepted.
+ */
+static ssize_t lprf_scan_write(struct file *file, const char __user *buf,
+		size_t count, loff_t *ppos)
+{
+	struct lprf_local *lprf =
+			((struct seq_file *)file->private_data)->private;
+	unsigned int samples = 0;
+	int ret = 0;
+
+	ret = kstrtouint_from_user(buf, count, 0, &samples);
+	if (ret)
+		return ret;
+	if (samples > LPRF_SCAN_MAX_SAMPLES)
+		return -EINVAL;
+
+	if (samples)
+		lprf->scan.samples = samples;
+
+	queue_work(lprf->wq, &lprf->scan.work);
+	return count;
+}
+
+static const struct file_operations lprf_scan_fops = {
+	.owner = THIS_MODULE,
+	.open = lprf_scan_open,
+	.read = seq_read,
+	.write = lprf_scan_write,
+	.llseek = seq_lseek,
+	.release = single_release,
+};
+
+/**
+ * Shows the occupancy estimate of all channels that have been used.
+ */
+static int lprf_occupancy_show(struct seq_file *file, void *data)
+{
+	struct lprf_local *lprf = file->private;
+	struct lprf_occupancy *occupancy = 0;
+	int i = 0;
+
+	seq_puts(file, "channel  busy[1/1000]  frames  no_sfd\n");
+
+	for (i = 0; i < LPRF_NUM_CHANNELS; ++i) {
+		occupancy = &lprf->occupancy[i];
+		if (!occupancy->busy_avg && !occupancy->frames)
+			continue;
+		seq_printf(file, "%7d  %12u  %6u  %6u\n",
+				i + LPRF_FIRST_CHANNEL, occupancy->busy_avg,
+				occupancy->frames, occupancy->no_sfd);
+	}
+
+	return 0;
+}
+
+static int lprf_occupancy_open(struct inode *inode, struct file *file)
+{
+	return single_open(file, lprf_occupancy_show, inode->i_private);
+}
+
+static const struct file_operations lprf_occupancy_fops = {
+	.owner = THIS_MODULE,
+	.open = lprf_occupancy_open,
+	.read = seq_read,
+	.llseek = seq_lseek,
+	.release = single_release,
+};
+
+/**
+ * Lists all readers of the char driver interface with the size and the fill
+ * level of their read() buffer, the number of received and dropped frames
+ * and the RX ring. A reader with the overflow flag set has dropped frames
+ * since the last frame it received.
+ */
+static int lprf_char_readers_show(struct seq_file *file, void *data)
+{
+	struct lprf_char_driver_interface *char_driver =
+			&lprf_char_driver_interface;
+	struct lprf_char_reader *reader;
+	unsigned long flags;
+	int i = 0;
+
+	seq_puts(file, "reader  mode    buffer  queued  received  dropped  "
+			"overflow  ring  ring_dropped\n");
+
+	spin_lock_irqsave(&char_driver->lock, flags);
+	list_for_each_entry(reader, &char_driver->readers, list) {
+		seq_printf(file, "%6d  %-6s  %6u  %6u  %8u  %7u  %8d  %4u  "
+				"%12u\n", i++,
+				reader->records ? "record" : "stream",
+				kfifo_size(&reader->frames),
+				kfifo_len(&reader->frames), reader->received,
+				reader->dropped, reader->overflow,
+				reader->rx_ring.num_slots,
+				reader->rx_ring.dropped);
+	}
+	spin_unlock_irqrestore(&char_driver->lock, flags);
+
+	return 0;
+}
+
+static int lprf_char_readers_open(struct inode *inode, struct file *file)
+{
+	return single_open(file, lprf_char_readers_show, inode->i_private);
+}
+
+static const struct file_operations lprf_char_readers_fops = {
+	.owner = THIS_MODULE,
+	.open = lprf_char_readers_open,
+	.read = seq_read,
+	.llseek = seq_lseek,
+	.release = single_release,
+};
+
+static int lprf_vco_tune_locks(struct lprf_local *lprf, uint8_t tune,
+		bool *locks);
+
+/**
+ * Tests the state machine with the current startup timers once.
+ *
+ * The chip has to change to RX mode and the PLL has to reach the channel
+ * frequency. Afterwards a short test frame is sent. As DIRECT_RX is
+ * enabled, the chip has to be back in RX mode with an empty FIFO after the
+ * frame was sent. This covers the RX startup as well as the TX startup and
+ * the TX to RX turnaround. Sets passed to false if any of the checks failed.
+ */
+static int lprf_sm_time_test(struct lprf_local *lprf, bool *passed)
+{
+	static const uint8_t test_payload[] = {
+		0x41, 0x88, 0x00, 0xff, 0xff, 0xff, 0xff, 0x00, 0x00
+	};
+	uint8_t *frame = lprf->state_change.tx_buf;
+	int frame_length = 0;
+	int phy_status = 0;
+	bool locks = false;
+	int ret = 0;
+
+	*passed = false;
+
+	RETURN_ON_ERROR(lprf_scan_restart_rx(lprf));
+	usleep_range(LPRF_SM_TIME_TEST_US, 2 * LPRF_SM_TIME_TEST_US);
+
+	phy_status = lprf_read_phy_status(lprf);
+	if (phy_status < 0)
+		return phy_status;
+	if (PHY_SM_STATUS(phy_status) != PHY_SM_RX_RDY &&
+			PHY_SM_STATUS(phy_status) != PHY_SM_RECEIVING)
+		return 0;
+
+	RETURN_ON_ERROR(lprf_vco_tune_locks(lprf, lprf->channels[
+			lprf->channel_switch.channel - LPRF_FIRST_CHANNEL]
+			.vco_tune, &locks));
+	if (!locks)
+		return 0;
+
+	RETURN_ON_ERROR(lprf_write_subreg(lprf, SR_SM_COMMAND,
+			STATE_CMD_SLEEP));
+	frame_length = lprf_build_frame(lprf, frame, test_payload,
+			sizeof(test_payload), false, false);
+	RETURN_ON_ERROR(spi_write(lprf->spi_device, frame, frame_length));
+	RETURN_ON_ERROR(lprf_write_subreg(lprf, SR_SM_COMMAND, STATE_CMD_TX));
+	RETURN_ON_ERROR(lprf_write_subreg(lprf, SR_SM_COMMAND,
+			STATE_CMD_NONE));
+	usleep_range(LPRF_SM_TIME_TEST_US, 2 * LPRF_SM_TIME_TEST_US);
+
+	phy_status = lprf_read_phy_status(lprf);
+	if (phy_status < 0)
+		return phy_status;
+	if (!PHY_FIFO_EMPTY(phy_status) ||
+			(PHY_SM_STATUS(phy_status) != PHY_SM_RX_RDY &&
+			PHY_SM_STATUS(phy_status) != PHY_SM_RECEIVING))
+		return 0;
+
+	*passed = true;
+	return 0;
+}
+
+/**
+ * Finds the smallest reliable value of one state machine startup timer.
+ *
+ * @lprf: lprf_local struct
+ * @index: index of the timer in lprf_sm_timers
+ *
+ * The current value of the timer is assumed to work. Smaller values are
+ * checked with a binary search, a value is only accepted if
+ * LPRF_SM_TIME_TRIALS tests in a row passed. LPRF_SM_TIME_MARGIN is added to
+ * the smallest working value.
+ */
+static int lprf_characterize_sm_timer(struct lprf_local *lprf, int index)
+{
+	uint8_t addr = lprf_sm_timers[index].addr;
+	int low = 0;
+	int high = lprf->sm_time[index];
+	int value = 0;
+	bool passed = false;
+	int ret = 0;
+	int i = 0;
+
+	while (low < high) {
+		value = (low + high) / 2;
+		RETURN_ON_ERROR(__lprf_write(lprf, addr, value));
+
+		for (i = 0; i < LPRF_SM_TIME_TRIALS; ++i) {
+			RETURN_ON_ERROR(lprf_sm_time_test(lprf, &passed));
+			if (!passed)
+				break;
+		}
+
+		if (passed)
+			high = value;
+		else
+			low = value + 1;
+	}
+
+	lprf->sm_time[index] = min(high + LPRF_SM_TIME_MARGIN, 0xff);
+	PRINT_DEBUG("SM timer %s set to %d", lprf_sm_timers[index].name,
+			lprf->sm_time[index]);
+
+	return __lprf_write(lprf, addr, lprf->sm_time[index]);
+}
+
+/**
+ * Characterises all state machine startup timers one after another, each
+ * with the final values of the timers characterised before. The polling is
+ * stopped during the characterisation. Test frames are sent on the current
+ * channel. The results can be read from the debugfs files in sm_time/ and
+ * should be stored in the device tree of the board.
+ */
+static void lprf_sm_time_work(struct work_struct *work)
+{
+	struct lprf_local *lprf =
+			container_of(work, struct lprf_local, sm_time_work);
+	bool polling = false;
+	int ret = 0;
+	int i = 0;
+
+	mutex_lock(&lprf->run_lock);
+	polling = lprf_polling_wanted(lprf);
+	if (polling) {
+		lprf_stop_polling(lprf);
+
+		/* Wait some time to make sure all pending communication finished*/
+		usleep_range(900, 1000);
+	}
+
+	for (i = 0; i < LPRF_NUM_SM_TIMERS && !ret; ++i)
+		ret = lprf_characterize_sm_timer(lprf, i);
+
+	if (ret) {
+		dev_err(&lprf->spi_device->dev,
+				"SM timer characterisation failed %d\n", ret);
+		lprf_write_sm_time(lprf);
+	}
+
+	lprf_write_subreg(lprf, SR_SM_COMMAND, STATE_CMD_SLEEP);
+
+	if (polling)
+		lprf_resume_polling(lprf);
+	mutex_unlock(&lprf->run_lock);
+}
+
+/**
+ * Starts the characterisation of the state machine startup timers when
+ * anything is written to the file.
+ */
+static ssize_t lprf_sm_time_characterize_write(struct file *file,
+		const char __user *buf, size_t count, loff_t *ppos)
+{
+	struct lprf_local *lprf = file->private_data;
+
+	queue_work(lprf->wq, &lprf->sm_time_work);
+	return count;
+}
+
+static const struct file_operations lprf_sm_time_characterize_fops = {
+	.owner = THIS_MODULE,
+	.open = simple_open,
+	.write = lprf_sm_time_characterize_write,
+};
+
+/**
+ * Creates the debugfs directory and files. Failing to create the debugfs
+ * files is not an error, as they are only needed for debugging.
+ */
+static void init_lprf_debugfs(struct lprf_local *lprf)
+{
+	struct dentry *sm_time_dir = 0;
+	int i = 0;
+
+	lprf->debugfs_dir = debugfs_create_dir("lprf", NULL);
+	if (IS_ERR_OR_NULL(lprf->debugfs_dir))
+		return;
+
+	debugfs_create_file("scan", 0600, lprf->debugfs_dir, lprf,
+			&lprf_scan_fops);
+	debugfs_create_file("occupancy", 0400, lprf->debugfs_dir, lprf,
+			&lprf_occupancy_fops);
+	debugfs_create_bool("rx_drain", 0600, lprf->debugfs_dir,
+			&lprf->rx_drain.enabled);
+	debugfs_create_u32("rx_drain_early_frames", 0400, lprf->debugfs_dir,
+			&lprf->rx_drain.early_frames);
+	debugfs_create_u32("aggregation_tx_frames", 0400, lprf->debugfs_dir,
+			&lprf->aggregation.tx_frames);
+	debugfs_create_u32("aggregation_tx_payloads", 0400, lprf->debugfs_dir,
+			&lprf->aggregation.tx_payloads);
+	debugfs_create_u32("aggregation_rx_payloads", 0400, lprf->debugfs_dir,
+			&lprf->aggregation.rx_payloads);
+	debugfs_create_u32("fec_corrected_frames", 0400, lprf->debugfs_dir,
+			&lprf->fec.corrected_frames);
+	debugfs_create_u32("fec_corrected_bytes", 0400, lprf->debugfs_dir,
+			&lprf->fec.corrected_bytes);
+	debugfs_create_u32("fec_failed_frames", 0400, lprf->debugfs_dir,
+			&lprf->fec.failed_frames);
+	debugfs_create_u32("char_dropped_records", 0400, lprf->debugfs_dir,
+			&lprf_char_driver_interface.dropped_records);
+	debugfs_create_u32("char_dropped_data", 0400, lprf->debugfs_dir,
+			&lprf_char_driver_interface.dropped_data);
+	debugfs_create_file("char_readers", 0400, lprf->debugfs_dir, lprf,
+			&lprf_char_readers_fops);
+	debugfs_create_atomic_t("rx_ring_frames", 0400, lprf->debugfs_dir,
+			&lprf_char_driver_interface.rx_ring_frames);
+	debugfs_create_atomic_t("rx_ring_dropped", 0400, lprf->debugfs_dir,
+			&lprf_char_driver_interface.rx_ring_dropped);
+	debugfs_create_bool("rx_length", 0600, lprf->debugfs_dir,
+			&lprf->rx_length.enabled);
+	debugfs_create_u32("rx_length_shortened_frames", 0400,
+			lprf->debugfs_dir, &lprf->rx_length.shortened_frames);
+
+	sm_time_dir = debugfs_create_dir("sm_time", lprf->debugfs_dir);
+	if (IS_ERR_OR_NULL(sm_time_dir))
+		return;
+
+	for (i = 0; i < LPRF_NUM_SM_TIMERS; ++i)
+		debugfs_create_u8(lprf_sm_timers[i].name, 0600, sm_time_dir,
+				&lprf->sm_time[i]);
+	debugfs_create_file("characterize", 0200, sm_time_dir, lprf,
+			&lprf_sm_time_characterize_fops);
+}
+
+
+/***
+ *      ___         _  _
+ *     |_ _| _ __  (_)| |_  ___
+ *      | | | '_ \ | || __|/ __|
+ *      | | | | | || || |_ \__ \
+ *     |___||_| |_||_| \__||___/
+ *
+ * This section contains all kinds of initializations only during module
+ * loading. The starting point of this module is the lprf_probe()
+ * function, which calls all other initialization functions.
+ */
+
+/**
+ * Writes the values of all registers that were written asynchronously from
+ * the register shadow to the regmap cache, so the cache does not restore
+ * outdated values. The chip itself is not accessed. Polling has to be stopped
+ * before calling this function.
+ */
+static int lprf_shadow_to_regcache(struct lprf_local *lprf)
+{
+	unsigned int reg;
+	int ret = 0;
+
+	regcache_cache_only(lprf->regmap, true);
+	for (reg = 0; reg <= LPRF_MAX_REGISTER && !ret; ++reg) {
+		if (!test_and_clear_bit(reg, lprf->reg_shadow.async_dirty) ||
+				lprf_reg_volatile(&lprf->spi_device->dev, reg))
+			continue;
+		ret = regmap_write(lprf->regmap, reg,
+				lprf->reg_shadow.value[reg]);
+	}
+
+	return ret;
+}
+
+/**
+ * Resets the chip and writes the configuration stored in the register cache
+ * to the chip.
+ *
+ * After the reset all registers have their default values. regcache_sync()
+ * therefore only writes registers that differ from their default value, in
+ * the order of their addresses. Afterwards the FIFO and the state machine
+ * get reset. This is used at probe time after the configuration was built
+ * in the cache, after asynchronous spi errors and after resume.
+ */
+static int lprf_restore_hardware(struct lprf_local *lprf)
+{
+	int ret = 0;
+
+	RETURN_ON_ERROR(lprf_shadow_to_regcache(lprf));
+	regcache_cache_only(lprf->regmap, false);
+
+	/* Reset all and load initial values */
+	RETURN_ON_ERROR(__lprf_write(lprf, RG_GLOBAL_RESETB,  0x00));
+	RETURN_ON_ERROR(__lprf_write(lprf, RG_GLOBAL_RESETB,  0xFF));
+	RETURN_ON_ERROR(__lprf_write(lprf, RG_GLOBAL_initALL, 0xFF));
+
+	regcache_mark_dirty(lprf->regmap);
+	RETURN_ON_ERROR(regcache_sync(lprf->regmap));
+
+	/* Resets */
+	RETURN_ON_ERROR(lprf_write_subreg(lprf, SR_FIFO_RESETB, 0));
+	RETURN_ON_ERROR(lprf_write_subreg(lprf, SR_FIFO_RESETB, 1));
+	RETURN_ON_ERROR(lprf_write_subreg(lprf, SR_SM_EN,       1));
+	RETURN_ON_ERROR(lprf_write_subreg(lprf, SR_SM_RESETB,   0));
+	RETURN_ON_ERROR(lprf_write_subreg(lprf, SR_SM_RESETB,   1));
+
+	return 0;
+}
+
+/**
+ * Resets the chip and restores its configuration after an asynchronous spi
+ * error. Afterwards the polling is started again if it is still wanted. See
+ * lprf_async_error().
+ */
+static void lprf_restore_work(struct work_struct *work)
+{
+	struct lprf_local *lprf =
+			container_of(work, struct lprf_local, restore_work);
+	int ret = 0;
+
+	mutex_lock(&lprf->run_lock);
+	lprf_stop_polling(lprf);
+
+	/* Wait some time to make sure all pending communication finished*/
+	usleep_range(900, 1000);
+
+	ret = lprf_restore_hardware(lprf);
+	if (ret) {
+		dev_err(&lprf->spi_device->dev,
+				"Restoring chip configuration failed %d\n", ret);
+		goto unlock;
+	}
+
+	/* The frame that was sent during the error is sent again */
+	lprf->state_change.tx_complete = false;
+	if (lprf_polling_wanted(lprf))
+		lprf_resume_polling(lprf);
+unlock:
+	mutex_unlock(&lprf->run_lock);
+}
+
+/**
+ * Returns the rate profile of a data rate in kbps or NULL if the data rate
+ * is not supported.
+ */
+static const struct lprf_rate_profile *lprf_find_rate_profile(u32 kbit_rate)
+{
+	int i = 0;
+
+	for (i = 0; i < ARRAY_SIZE(lprf_rate_profiles); ++i)
+		if (lprf_rate_profiles[i].kbit_rate == kbit_rate)
+			return &lprf_rate_profiles[i];
+	return NULL;
+}
+
+/**
+ * Calculates the RX length counter of a maximum length frame for the
+ * current data rate, synchronization header and frame mode.
+ */
+static void lprf_update_max_rx_length(struct lprf_local *lprf)
+{
+	lprf->rx_length.max_counter = get_rx_length_counter(
+			lprf->rate.profile->kbit_rate,
+			lprf_max_frame_length(lprf) - sizeof(SYNC_HEADER) +
+			lprf_shr_length(lprf));
+}
+
+/**
+ * Changes the synchronization header and the frame mode to the ones in
+ * lprf.mode.
+ *
+ * The settings are changed while the polling is stopped and the chip is
+ * idle. The RX length counter is written for the new maximum frame length
+ * and the FIFO is reset, which drops a frame that was received with the
+ * previous settings. Long frames and the forward error correction are not
+ * enabled while the IEEE 802.15.4 interface is up, as it would not receive
+ * any frames anymore. lprf.run_lock keeps the interface from coming up
+ * during the change.
+ */
+static void lprf_mode_work(struct work_struct *work)
+{
+	struct lprf_local *lprf =
+			container_of(work, struct lprf_local, mode.work);
+	struct lprf_mode *mode = &lprf->mode;
+	bool polling = false;
+	int ret = 0;
+
+	mutex_lock(&lprf->run_lock);
+	if (lprf->started && ((mode->long_frames && !lprf->long_frames) ||
+			(mode->fec && !lprf->fec.enabled))) {
+		ret = -EBUSY;
+		goto unlock;
+	}
+
+	polling = lprf_polling_wanted(lprf);
+	if (polling) {
+		lprf_stop_polling(lprf);
+		ret = lprf_wait_for_idle(lprf);
+		if (ret)
+			goto resume;
+	}
+
+	lprf->shr = mode->shr;
+	lprf->long_frames = mode->long_frames;
+	lprf->fec.enabled = mode->fec;
+	lprf_update_max_rx_length(lprf);
+
+	ret = lprf_write_subreg(lprf, SR_SM_COMMAND, STATE_CMD_SLEEP);
+	if (!ret)
+		ret = lprf_write_rx_length(lprf, lprf->rx_length.max_counter);
+	if (!ret)
+		ret = lprf_write_subreg(lprf, SR_FIFO_RESETB, 0);
+	if (!ret)
+		ret = lprf_write_subreg(lprf, SR_FIFO_RESETB, 1);
+
+resume:
+	if (ret)
+		dev_err(&lprf->spi_device->dev,
+				"Changing frame format failed %d\n", ret);
+	if (polling)
+		lprf_resume_polling(lprf);
+unlock:
+	mode->status = ret;
+	mutex_unlock(&lprf->run_lock);
+}
+
+/**
+ * Starts a change of the frame format. The pending settings in lprf.mode are
+ * initialized with the current ones and can be changed until
+ * lprf_mode_commit() is called. Only one change can be active at a time.
+ */
+static void lprf_mode_begin(struct lprf_local *lprf)
+{
+	struct lprf_mode *mode = &lprf->mode;
+
+	mutex_lock(&mode->lock);
+	mode->shr = lprf->shr;
+	mode->long_frames = lprf->long_frames;
+	mode->fec = lprf->fec.enabled;
+}
+
+/**
+ * Applies the pending settings in lprf.mode with lprf_mode_work() and ends
+ * the change. Returns zero or a negative error code.
+ */
+static int lprf_mode_commit(struct lprf_local *lprf)
+{
+	struct lprf_mode *mode = &lprf->mode;
+	int ret = 0;
+
+	queue_work(lprf->wq, &mode->work);
+	flush_work(&mode->work);
+	ret = mode->status;
+
+	mutex_unlock(&mode->lock);
+	return ret;
+}
+
+/**
+ * Changes the synchronization header used for sending and receiving.
+ *
+ * A shorter preamble than the IEEE 802.15.4 preamble saves airtime on links
+ * between LPRF chips, as the hardware preamble detection only needs a few
+ * bits. The change is applied by lprf_mode_work().
+ *
+ * Returns zero, -EINVAL for an unsupported preamble length or the error of
+ * lprf_mode_work().
+ */
+static int lprf_set_shr(struct lprf_local *lprf,
+		const struct lprf_shr_config *config)
+{
+	int ret = 0;
+
+	if (config->preamble_length < LPRF_MIN_PREAMBLE_LENGTH ||
+			config->preamble_length > LPRF_MAX_PREAMBLE_LENGTH)
+		return -EINVAL;
+
+	lprf_mode_begin(lprf);
+	lprf->mode.shr = *config;
+	RETURN_ON_ERROR(lprf_mode_commit(lprf));
+
+	PRINT_DEBUG("Preamble length %d, SFD 0x%02x",
+			config->preamble_length, config->sfd);
+	return 0;
+}
+
+/**
+ * Enables or disables long frames for the raw char driver interface.
+ *
+ * IEEE 802.15.4 limits the PSDU to 127 bytes, so bulk data through the char
+ * driver interface pays the synchronization header, the state changes and
+ * the resets of the chip every 127 bytes. Long frames have a two byte
+ * physical header and carry up to LPRF_LONG_MAX_PSDU bytes, which is limited
+ * by the one byte length of the frame read and write commands. While long
+ * frames are enabled, every received frame is treated as long frame and only
+ * delivered to the char driver interface. Frames of the IEEE 802.15.4 stack
+ * are still sent as IEEE 802.15.4 frames.
+ *
+ * The change is applied by lprf_mode_work(). Returns zero, -EBUSY if long
+ * frames are enabled while the IEEE 802.15.4 interface is up or another
+ * error of lprf_mode_work().
+ */
+static int lprf_set_long_frames(struct lprf_local *lprf, bool enable)
+{
+	int ret = 0;
+
+	lprf_mode_begin(lprf);
+	lprf->mode.long_frames = enable;
+	RETURN_ON_ERROR(lprf_mode_commit(lprf));
+
+	PRINT_DEBUG("Long frames %s", enable ? "enabled" : "disabled");
+	return 0;
+}
+
+/**
+ * Enables or disables the forward error correction of the char driver
+ * interface (see lprf_fec_encode() and lprf_fec_decode()).
+ *
+ * The change is applied by lprf_mode_work(). Returns zero, -EBUSY if the
+ * forward error correction is enabled while the IEEE 802.15.4 interface is
+ * up or another error of lprf_mode_work().
+ */
+static int lprf_set_fec(struct lprf_local *lprf, bool enable)
+{
+	int ret = 0;
+
+	lprf_mode_begin(lprf);
+	lprf->mode.fec = enable;
+	RETURN_ON_ERROR(lprf_mode_commit(lprf));
+
+	PRINT_DEBUG("FEC %s", enable ? "enabled" : "disabled");
+	return 0;
+}
+
+/**
+ * Derives the data rate dependent driver settings from a rate profile: the
+ * polling intervals and the RX length counter. The chip registers and the
+ * symbol duration of the wpan_phy are not written.
+ */
+static void lprf_select_rate_profile(struct lprf_local *lprf,
+		const struct lprf_rate_profile *profile)
+{
+	struct lprf_rate *rate = &lprf->rate;
+	int factor = LPRF_MAX_KBIT_RATE / profile->kbit_rate;
+
+	rate->profile = profile;
+	rate->rx_polling_interval =
+			ns_to_ktime(ktime_to_ns(RX_POLLING_INTERVAL) * factor);
+	rate->rx_rx_interval =
+			ns_to_ktime(ktime_to_ns(RX_RX_INTERVAL) * factor);
+	rate->tx_rx_interval =
+			ns_to_ktime(ktime_to_ns(TX_RX_INTERVAL) * factor);
+	rate->retry_interval =
+			ns_to_ktime(ktime_to_ns(RETRY_INTERVAL) * factor);
+
+	lprf_update_max_rx_length(lprf);
+}
+
+/**
+ * Changes the data rate to lprf.rate.pending. The modem settings and the RX
+ * length counter are written while the polling is stopped and the chip is
+ * idle. A frame that was received with the previous data rate is dropped.
+ * The symbol duration of the wpan_phy is changed by lprf_set_data_rate().
+ */
+static void lprf_rate_work(struct work_struct *work)
+{
+	struct lprf_local *lprf =
+			container_of(work, struct lprf_local, rate.work);
+	const struct lprf_rate_profile *profile = lprf->rate.pending;
+	bool polling = false;
+	int ret = 0;
+
+	mutex_lock(&lprf->run_lock);
+	polling = lprf_polling_wanted(lprf);
+	if (polling) {
+		lprf_stop_polling(lprf);
+		ret = lprf_wait_for_idle(lprf);
+		if (ret) {
+			dev_err(&lprf->spi_device->dev,
+					"Chip not idle for rate change %d\n",
+					ret);
+			lprf->rate.status = ret;
+			goto resume;
+		}
+	}
+
+	lprf_select_rate_profile(lprf, profile);
+
+	lprf_batch_begin(lprf);
+	lprf_batch_write_subreg(lprf, SR_DEM_DATA_RATE_SEL,
+			profile->data_rate_sel);
+	lprf_batch_write_subreg(lprf, SR_PLL_MOD_DATA_RATE,
+			profile->data_rate_sel);
+	lprf_batch_write_subreg(lprf, SR_PLL_MOD_FREQ_DEV, profile->freq_dev);
+	ret = lprf_batch_flush(lprf);
+	if (!ret)
+		ret = lprf_write_rx_length(lprf, lprf->rx_length.max_counter);
+	if (ret)
+		dev_err(&lprf->spi_device->dev,
+				"Changing data rate failed %d\n", ret);
+	lprf->rate.status = ret;
+
+	lprf_write_subreg(lprf, SR_SM_COMMAND, STATE_CMD_SLEEP);
+
+resume:
+	if (polling)
+		lprf_resume_polling(lprf);
+	mutex_unlock(&lprf->run_lock);
+}
+
+/**
+ * Changes the over the air data rate.
+ *
+ * @lprf: lprf_local struct containing chip information
+ * @kbit_rate: new data rate in kbps, see lprf_rate_profiles
+ *
+ * The change is done by lprf_rate_work() on the workqueue of the chip, so
+ * it never runs concurrently with a channel scan or other synchronous chip
+ * access. The symbol duration of the wpan_phy is changed afterwards under
+ * the RTNL lock, like the other PHY settings of the IEEE 802.15.4 stack.
+ * The work itself must not take the RTNL lock, as lprf_stop_ieee802154()
+ * flushes it with the lock held. Returns zero or a negative error code.
+ */
+static int lprf_set_data_rate(struct lprf_local *lprf, u32 kbit_rate)
+{
+	const struct lprf_rate_profile *profile =
+			lprf_find_rate_profile(kbit_rate);
+	int ret = 0;
+
+	if (!profile)
+		return -EINVAL;
+
+	flush_work(&lprf->rate.work);
+	lprf->rate.pending = profile;
+	queue_work(lprf->wq, &lprf->rate.work);
+	flush_work(&lprf->rate.work);
+	ret = lprf->rate.status;
+	if (ret)
+		return ret;
+
+	rtnl_lock();
+	lprf->hw->phy->symbol_duration = profile->symbol_duration;
+	rtnl_unlock();
+
+	PRINT_DEBUG("Data rate changed to %u kbps", kbit_rate);
+	return 0;
+}
+
+/**
+ * Checks whether the PLL reaches the current channel frequency with the
+ * given VCO tune value. The chip has to be in RX mode, so that the PLL is
+ * running.
+ *
+ * @lprf: lprf_local struct
+ * @tune: VCO tune value to check
+ * @locks: set to true if the PLL reaches the channel frequency
+ *
+ * The two point modulation gain calibration of the PLL is restarted for the
+ * tune value. The measured gain is only within the expected range if the
+ * VCO is able to reach the channel frequency. Otherwise the tuning voltage
+ * of the VCO is at its limit and the measured gain is zero or saturated.
+ */
+static int lprf_vco_tune_locks(struct lprf_local *lprf, uint8_t tune,
+		bool *locks)
+{
+	unsigned int gain_l = 0;
+	unsigned int gain_m = 0;
+	unsigned int gain_h = 0;
+	u32 gain = 0;
+	int ret = 0;
 
-	atomic_set(&lprf_char_driver_interface.is_ready, 0);
+	RETURN_ON_ERROR(lprf_write_subreg(lprf, SR_PLL_VCO_TUNE, tune));
+	RETURN_ON_ERROR(lprf_write_subreg(lprf, SR_PLL_TPM_CTRL_CAL_EN, 0));
+	RETURN_ON_ERROR(lprf_write_subreg(lprf, SR_PLL_TPM_CTRL_CAL_EN, 1));
 
-	kfifo_free(&lprf_char_driver_interface.data_buffer);
-	atomic_dec(&lprf_char_driver_interface.is_open);
+	usleep_range(LPRF_VCO_CAL_SETTLE_US, 2 * LPRF_VCO_CAL_SETTLE_US);
 
-	PRINT_DEBUG("LPRF char device successfully released");
+	RETURN_ON_ERROR(lprf_read_subreg(lprf,
+			SR_PLL_TPM_CTRL_GAIN_OUT_L, &gain_l));
+	RETURN_ON_ERROR(lprf_read_subreg(lprf,
+			SR_PLL_TPM_CTRL_GAIN_OUT_M, &gain_m));
+	RETURN_ON_ERROR(lprf_read_subreg(lprf,
+			SR_PLL_TPM_CTRL_GAIN_OUT_H, &gain_h));
+	gain = (gain_h << 16) | (gain_m << 8) | gain_l;
+
+	*locks = gain >= LPRF_VCO_CAL_GAIN_MIN &&
+			gain <= LPRF_VCO_CAL_GAIN_MAX;
 	return 0;
 }
 
-ssize_t lprf_read_char_device(struct file *filp,
-		char __user *buf, size_t count, loff_t *f_pos)
+/**
+ * Measures the VCO tune value of one channel and stores it in the channel
+ * table.
+ *
+ * @lprf: lprf_local struct
+ * @channel: channel to calibrate
+ *
+ * All tune values within LPRF_VCO_CAL_RANGE around the value of
+ * calc_vco_tune() are checked with lprf_vco_tune_locks(). The center of the
+ * longest range of tune values with which the PLL reaches the channel
+ * frequency is used, as it has the most margin for temperature drift. If no
+ * tune value works, the value of calc_vco_tune() is kept. The polling must
+ * be stopped while calibrating, the chip is in sleep mode afterwards.
+ */
+static int lprf_calibrate_vco(struct lprf_local *lprf, u8 channel)
 {
-	int buffer_length = 0;
-	int bytes_to_copy = 0;
-	int bytes_copied = 0;
+	struct lprf_channel *ch = &lprf->channels[channel - LPRF_FIRST_CHANNEL];
+	int center = calc_vco_tune(channel);
+	int first = max(center - LPRF_VCO_CAL_RANGE, 0);
+	int last = min(center + LPRF_VCO_CAL_RANGE, 0xff);
+	int run_start = -1;
+	int best_start = 0;
+	int best_length = 0;
+	bool locks = false;
+	int tune = 0;
 	int ret = 0;
 
-	PRINT_KRIT("Read from user space with buffer size %d requested", count);
+	RETURN_ON_ERROR(lprf_write_subreg(lprf, SR_SM_COMMAND,
+			STATE_CMD_SLEEP));
+	RETURN_ON_ERROR(lprf_set_ieee802154_channel(lprf->hw, 0, channel));
+	RETURN_ON_ERROR(lprf_write_subreg(lprf, SR_SM_COMMAND, STATE_CMD_RX));
 
-	if( kfifo_is_empty(&lprf_char_driver_interface.data_buffer) ) {
-		PRINT_KRIT("Read_char_device goes to sleep.");
-		ret = wait_event_interruptible(
-			lprf_char_driver_interface.wait_for_rx_data,
-			!kfifo_is_empty(
-				&lprf_char_driver_interface.data_buffer));
-		if (ret < 0)
-			return ret;
-		PRINT_KRIT("Returned from sleep in read_char_device.");
-	}
+	for (tune = first; tune <= last; ++tune) {
+		ret = lprf_vco_tune_locks(lprf, tune, &locks);
+		if (ret)
+			break;
 
-	buffer_length = kfifo_len(&lprf_char_driver_interface.data_buffer);
-	bytes_to_copy = (count < buffer_length) ? count : buffer_length;
+		if (!locks) {
+			run_start = -1;
+			continue;
+		}
 
-	ret = kfifo_to_user(&lprf_char_driver_interface.data_buffer,
-			buf, bytes_to_copy, &bytes_copied);
-	if(ret)
+		if (run_start < 0)
+			run_start = tune;
+		if (tune - run_start + 1 > best_length) {
+			best_start = run_start;
+			best_length = tune - run_start + 1;
+		}
+	}
+
+	lprf_write_subreg(lprf, SR_SM_COMMAND, STATE_CMD_SLEEP);
+	if (ret)
 		return ret;
 
-	PRINT_KRIT("%d/%d bytes copied to user.",
-			bytes_copied, buffer_length);
+	if (best_length) {
+		ch->vco_tune = best_start + best_length / 2;
+	} else {
+		dev_warn(&lprf->spi_device->dev,
+				"VCO calibration of channel %d failed\n",
+				channel);
+		ch->vco_tune = center;
+	}
+	PRINT_DEBUG("Channel %d: VCO tune %d", channel, ch->vco_tune);
 
-	return bytes_copied;
+	return lprf_write_subreg(lprf, SR_PLL_VCO_TUNE, ch->vco_tune);
 }
 
-ssize_t lprf_write_char_device(struct file *filp, const char __user *buf,
-		size_t count, loff_t *f_pos)
+/**
+ * Calibrates the VCO for all channels and switches back to the current
+ * channel afterwards. Takes roughly 100 ms.
+ */
+static int lprf_calibrate_all_vco(struct lprf_local *lprf)
 {
-	int bytes_copied = 0;
-	int bytes_to_copy = 0;
+	int channel = 0;
 	int ret = 0;
-	struct sk_buff *skb;
-	struct lprf_local *lprf = filp->private_data;
 
-	PRINT_KRIT("Enter write char device");
-
-	if (lprf->tx_skb) {
-		PRINT_KRIT("Read_char_device goes to sleep.");
-		ret = wait_event_interruptible(
-				lprf_char_driver_interface.wait_for_tx_ready,
-			!lprf->tx_skb);
+	for (channel = LPRF_FIRST_CHANNEL; channel <= LPRF_LAST_CHANNEL;
+			++channel) {
+		RETURN_ON_ERROR(lprf_calibrate_vco(lprf, channel));
 	}
 
-	bytes_to_copy = count < FRAME_LENGTH ? count : FRAME_LENGTH;
-	skb = dev_alloc_skb(bytes_to_copy);
-	if (!skb)
-		return -ENOMEM;
-
-	bytes_copied = bytes_to_copy - copy_from_user(
-			skb_put(skb, bytes_to_copy), buf, bytes_to_copy);
-	PRINT_KRIT("Copied %d/%d files to TX buffer", bytes_copied, count);
-
-	skb->len = bytes_copied;
-	lprf->tx_skb = skb;
-	lprf->free_skb = true;
-
-	PRINT_KRIT("Call state change from write char device");
-
-	ret = lprf_phy_status_async(&lprf->phy_status);
-	if (ret)
-		PRINT_KRIT("phy status busy in lprf_write_char_device");
-
-	PRINT_KRIT("Return from write char device");
-	return bytes_copied;
+	return lprf_set_ieee802154_channel(lprf->hw,
+			lprf->hw->phy->current_page,
+			lprf->hw->phy->current_channel);
 }
 
 /**
- * Defines the callback functions for file operations
- * when the lprf device is used with the char driver interface
- */
-static const struct file_operations lprf_fops = {
-	.owner =             THIS_MODULE,
-	.read =              lprf_read_char_device,
-	.write =             lprf_write_char_device,
-	.unlocked_ioctl =    0, /* can be implemented for additional control */
-	.open =              lprf_open_char_device,
-	.release =           lprf_release_char_device,
-};
-
-/**
- * Registers the LPRF-Chip as char-device. Make sure to execute this function
- * only after the chip has been fully initialized and is ready to use.
+ * Recalibrates the VCO of the current channel after too many corrupted
+ * frames have been received (see lprf_count_rx_frame()). The tune values
+ * are only swept if the PLL does not reach the channel frequency with the
+ * current tune value anymore.
  */
-static int register_char_device(struct lprf_local *lprf)
+static void lprf_vco_cal_work(struct work_struct *work)
 {
+	struct lprf_local *lprf =
+			container_of(work, struct lprf_local, vco_cal.work);
+	u8 channel = lprf->channel_switch.channel;
+	bool locks = false;
 	int ret = 0;
-	dev_t dev_number = 0;
 
-	ret = alloc_chrdev_region(&dev_number, 0, 1, "lprf");
-	if (ret) {
-		PRINT_DEBUG("Dynamic Device number allocation failed");
-		return ret;
-	}
+	mutex_lock(&lprf->run_lock);
+	if (!lprf_polling_wanted(lprf))
+		goto unlock;
 
-	cdev_init(&lprf->my_char_dev, &lprf_fops);
-	lprf->my_char_dev.owner = THIS_MODULE;
-	ret = cdev_add (&lprf->my_char_dev, dev_number, 1);
-	if (ret) {
-		goto unregister;
-	}
-	PRINT_DEBUG("Successfully added char driver to system");
-	return ret;
+	lprf_stop_polling(lprf);
 
-unregister:
-	unregister_chrdev_region(dev_number, 1);
-	return ret;
-}
+	/* Wait some time to make sure all pending communication finished*/
+	usleep_range(900, 1000);
 
-static inline void unregister_char_device(struct lprf_local *lprf)
-{
-	dev_t dev_number = lprf->my_char_dev.dev;
-	cdev_del(&lprf->my_char_dev);
-	unregister_chrdev_region(dev_number, 1);
-	PRINT_DEBUG( "Removed Char Device");
-}
+	lprf_write_subreg(lprf, SR_SM_COMMAND, STATE_CMD_SLEEP);
+	ret = lprf_write_subreg(lprf, SR_SM_COMMAND, STATE_CMD_RX);
+	if (!ret)
+		ret = lprf_vco_tune_locks(lprf, lprf->channels[
+				channel - LPRF_FIRST_CHANNEL].vco_tune, &locks);
+	lprf_write_subreg(lprf, SR_SM_COMMAND, STATE_CMD_SLEEP);
 
+	if (!ret && !locks)
+		ret = lprf_calibrate_vco(lprf, channel);
+	if (ret)
+		dev_err(&lprf->spi_device->dev,
+				"VCO calibration failed %d\n", ret);
 
-/***
- *      ___         _  _
- *     |_ _| _ __  (_)| |_  ___
- *      | | | '_ \ | || __|/ __|
- *      | | | | | || || |_ \__ \
- *     |___||_| |_||_| \__||___/
- *
- * This section contains all kinds of initializations only during module
- * loading. The starting point of this module is the lprf_probe()
- * function, which calls all other initialization functions.
- */
+	WRITE_ONCE(lprf->vco_cal.next_check,
+			jiffies + msecs_to_jiffies(LPRF_VCO_CAL_INTERVAL_MS));
+	atomic_set(&lprf->vco_cal.rx_frames, 0);
+	atomic_set(&lprf->vco_cal.rx_errors, 0);
+
+	lprf_resume_polling(lprf);
+unlock:
+	mutex_unlock(&lprf->run_lock);
+}
 
 /**
  * initializes the lprf chip with the default configuration.
+ *
+ * The configuration is built in the register cache only and written to the
+ * chip at once by lprf_restore_hardware().
  */
 static int init_lprf_hardware(struct lprf_local *lprf)
 {
 	int ret = 0;
-	unsigned int value = 0;
-	int rx_counter_length =
-			get_rx_length_counter(KBIT_RATE, FRAME_LENGTH);
+	int i = 0;
+	int rx_counter_length = lprf->rx_length.max_counter;
 
-	/* Reset all and load initial values */
-	RETURN_ON_ERROR(__lprf_write(lprf, RG_GLOBAL_RESETB,  0x00));
-	RETURN_ON_ERROR(__lprf_write(lprf, RG_GLOBAL_RESETB,  0xFF));
-	RETURN_ON_ERROR(__lprf_write(lprf, RG_GLOBAL_initALL, 0xFF));
+	regcache_cache_only(lprf->regmap, true);
+
+	lprf_batch_begin(lprf);
 
 	/* Clock Reference */
-	RETURN_ON_ERROR(lprf_write_subreg(lprf, SR_CTRL_CLK_CDE_OSC, 0));
-	RETURN_ON_ERROR(lprf_write_subreg(lprf, SR_CTRL_CLK_CDE_PAD, 1));
-	RETURN_ON_ERROR(lprf_write_subreg(lprf, SR_CTRL_CLK_DIG_OSC, 0));
-	RETURN_ON_ERROR(lprf_write_subreg(lprf, SR_CTRL_CLK_DIG_PAD, 1));
-	RETURN_ON_ERROR(lprf_write_subreg(lprf, SR_CTRL_CLK_PLL_OSC, 0));
-	RETURN_ON_ERROR(lprf_write_subreg(lprf, SR_CTRL_CLK_PLL_PAD, 1));
-	RETURN_ON_ERROR(lprf_write_subreg(lprf, SR_CTRL_CLK_C3X_OSC, 0));
-	RETURN_ON_ERROR(lprf_write_subreg(lprf, SR_CTRL_CLK_C3X_PAD, 1));
-	RETURN_ON_ERROR(lprf_write_subreg(lprf, SR_CTRL_CLK_FALLB,   0));
+	lprf_batch_write_subreg(lprf, SR_CTRL_CLK_CDE_OSC, 0);
+	lprf_batch_write_subreg(lprf, SR_CTRL_CLK_CDE_PAD, 1);
+	lprf_batch_write_subreg(lprf, SR_CTRL_CLK_DIG_OSC, 0);
+	lprf_batch_write_subreg(lprf, SR_CTRL_CLK_DIG_PAD, 1);
+	lprf_batch_write_subreg(lprf, SR_CTRL_CLK_PLL_OSC, 0);
+	lprf_batch_write_subreg(lprf, SR_CTRL_CLK_PLL_PAD, 1);
+	lprf_batch_write_subreg(lprf, SR_CTRL_CLK_C3X_OSC, 0);
+	lprf_batch_write_subreg(lprf, SR_CTRL_CLK_C3X_PAD, 1);
+	lprf_batch_write_subreg(lprf, SR_CTRL_CLK_FALLB,   0);
 
 	/* ADC_CLK */
-	RETURN_ON_ERROR(lprf_write_subreg(lprf, SR_CTRL_CDE_ENABLE, 0));
-	RETURN_ON_ERROR(lprf_write_subreg(lprf, SR_CTRL_C3X_ENABLE, 1));
-	RETURN_ON_ERROR(lprf_write_subreg(lprf, SR_CTRL_CLK_ADC,    1));
-	RETURN_ON_ERROR(lprf_write_subreg(lprf, SR_CTRL_C3X_LTUNE,  1));
+	lprf_batch_write_subreg(lprf, SR_CTRL_CDE_ENABLE, 0);
+	lprf_batch_write_subreg(lprf, SR_CTRL_C3X_ENABLE, 1);
+	lprf_batch_write_subreg(lprf, SR_CTRL_CLK_ADC,    1);
+	lprf_batch_write_subreg(lprf, SR_CTRL_C3X_LTUNE,  1);
 
 	/* LDOs */
-	RETURN_ON_ERROR(lprf_write_subreg(lprf, SR_LDO_A_VOUT,     21));
-	RETURN_ON_ERROR(lprf_write_subreg(lprf, SR_LDO_D_VOUT,     24));
-	RETURN_ON_ERROR(lprf_write_subreg(lprf, SR_LDO_PLL_VOUT,   24));
-	RETURN_ON_ERROR(lprf_write_subreg(lprf, SR_LDO_VCO_VOUT,   24));
-	RETURN_ON_ERROR(lprf_write_subreg(lprf, SR_LDO_TX24_VOUT,  23));
+	lprf_batch_write_subreg(lprf, SR_LDO_A_VOUT,     21);
+	lprf_batch_write_subreg(lprf, SR_LDO_D_VOUT,     24);
+	lprf_batch_write_subreg(lprf, SR_LDO_PLL_VOUT,   24);
+	lprf_batch_write_subreg(lprf, SR_LDO_VCO_VOUT,   24);
+	lprf_batch_write_subreg(lprf, SR_LDO_TX24_VOUT,  23);
 
 	/* PLL Configuration */
-	RETURN_ON_ERROR(lprf_write_subreg(lprf, SR_IREF_PLL_CTRLB,   0));
-	RETURN_ON_ERROR(lprf_write_subreg(lprf, SR_PLL_VCO_TUNE,   235));
-	RETURN_ON_ERROR(lprf_write_subreg(lprf, SR_PLL_LPF_C,        0));
-	RETURN_ON_ERROR(lprf_write_subreg(lprf, SR_PLL_LPF_R,        9));
+	lprf_batch_write_subreg(lprf, SR_IREF_PLL_CTRLB,   0);
+	lprf_batch_write_subreg(lprf, SR_PLL_VCO_TUNE,   235);
+	lprf_batch_write_subreg(lprf, SR_PLL_LPF_C,        0);
+	lprf_batch_write_subreg(lprf, SR_PLL_LPF_R,        9);
 
 	/* activate 2.4GHz Band */
-	RETURN_ON_ERROR(lprf_write_subreg(lprf, SR_RX_RF_MODE,     0));
-	RETURN_ON_ERROR(lprf_write_subreg(lprf, SR_RX_LO_EXT,      0));
-	RETURN_ON_ERROR(lprf_write_subreg(lprf, SR_LNA24_ISETT,    7));
-	RETURN_ON_ERROR(lprf_write_subreg(lprf, SR_LNA24_SPCTRIM, 15));
+	lprf_batch_write_subreg(lprf, SR_RX_RF_MODE,     0);
+	lprf_batch_write_subreg(lprf, SR_RX_LO_EXT,      0);
+	lprf_batch_write_subreg(lprf, SR_LNA24_ISETT,    7);
+	lprf_batch_write_subreg(lprf, SR_LNA24_SPCTRIM, 15);
 
 	/* ADC Settings */
-	RETURN_ON_ERROR(lprf_write_subreg(lprf, SR_CTRL_ADC_MULTIBIT, 0));
-	RETURN_ON_ERROR(lprf_write_subreg(lprf, SR_CTRL_ADC_ENABLE,   1));
-	RETURN_ON_ERROR(lprf_write_subreg(lprf, SR_CTRL_ADC_BW_SEL,   1));
-	RETURN_ON_ERROR(lprf_write_subreg(lprf, SR_CTRL_ADC_BW_TUNE,  5));
-	RETURN_ON_ERROR(lprf_write_subreg(lprf, SR_CTRL_ADC_DR_SEL,   2));
+	lprf_batch_write_subreg(lprf, SR_CTRL_ADC_MULTIBIT, 0);
+	lprf_batch_write_subreg(lprf, SR_CTRL_ADC_ENABLE,   1);
+	lprf_batch_write_subreg(lprf, SR_CTRL_ADC_BW_SEL,   1);
+	lprf_batch_write_subreg(lprf, SR_CTRL_ADC_BW_TUNE,  5);
+	lprf_batch_write_subreg(lprf, SR_CTRL_ADC_DR_SEL,   2);
 
 	/* Polyphase Filter Setting */
-	RETURN_ON_ERROR(lprf_write_subreg(lprf, SR_PPF_M0,    0));
-	RETURN_ON_ERROR(lprf_write_subreg(lprf, SR_PPF_M1,    0));
-	RETURN_ON_ERROR(lprf_write_subreg(lprf, SR_PPF_TRIM,  0));
-	RETURN_ON_ERROR(lprf_write_subreg(lprf, SR_PPF_HGAIN, 1));
-	RETURN_ON_ERROR(lprf_write_subreg(lprf, SR_PPF_LLIF,  0));
+	lprf_batch_write_subreg(lprf, SR_PPF_M0,    0);
+	lprf_batch_write_subreg(lprf, SR_PPF_M1,    0);
+	lprf_batch_write_subreg(lprf, SR_PPF_TRIM,  0);
+	lprf_batch_write_subreg(lprf, SR_PPF_HGAIN, 1);
+	lprf_batch_write_subreg(lprf, SR_PPF_LLIF,  0);
 
 	/* Demodulator Settings */
-	RETURN_ON_ERROR(lprf_write_subreg(lprf, SR_DEM_CLK96_SEL,          1));
-	RETURN_ON_ERROR(lprf_write_subreg(lprf, SR_DEM_AGC_EN,             1));
-	RETURN_ON_ERROR(lprf_write_subreg(lprf, SR_DEM_FREQ_OFFSET_CAL_EN, 0));
-	RETURN_ON_ERROR(lprf_write_subreg(lprf, SR_DEM_OSR_SEL,            0));
-	RETURN_ON_ERROR(lprf_write_subreg(lprf, SR_DEM_BTLE_MODE,          1));
-	RETURN_ON_ERROR(lprf_write_subreg(lprf, SR_DEM_IF_SEL,             2));
-	RETURN_ON_ERROR(lprf_write_subreg(lprf, SR_DEM_DATA_RATE_SEL,      3));
-	RETURN_ON_ERROR(lprf_write_subreg(lprf, SR_DEM_IQ_CROSS,           1));
-	RETURN_ON_ERROR(lprf_write_subreg(lprf, SR_DEM_IQ_INV,             0));
+	lprf_batch_write_subreg(lprf, SR_DEM_CLK96_SEL,          1);
+	lprf_batch_write_subreg(lprf, SR_DEM_AGC_EN,             1);
+	lprf_batch_write_subreg(lprf, SR_DEM_FREQ_OFFSET_CAL_EN, 0);
+	lprf_batch_write_subreg(lprf, SR_DEM_OSR_SEL,            0);
+	lprf_batch_write_subreg(lprf, SR_DEM_BTLE_MODE,          1);
+	lprf_batch_write_subreg(lprf, SR_DEM_IF_SEL,             2);
+	lprf_batch_write_subreg(lprf, SR_DEM_DATA_RATE_SEL,
+			lprf->rate.profile->data_rate_sel);
+	lprf_batch_write_subreg(lprf, SR_DEM_IQ_CROSS,           1);
+	lprf_batch_write_subreg(lprf, SR_DEM_IQ_INV,             0);
 
 	/* initial CIC Filter gain settings */
-	RETURN_ON_ERROR(lprf_write_subreg(lprf, SR_DEM_GC1, 0));
-	RETURN_ON_ERROR(lprf_write_subreg(lprf, SR_DEM_GC2, 0));
-	RETURN_ON_ERROR(lprf_write_subreg(lprf, SR_DEM_GC3, 1));
-	RETURN_ON_ERROR(lprf_write_subreg(lprf, SR_DEM_GC4, 0));
-	RETURN_ON_ERROR(lprf_write_subreg(lprf, SR_DEM_GC5, 0));
-	RETURN_ON_ERROR(lprf_write_subreg(lprf, SR_DEM_GC6, 1));
-	RETURN_ON_ERROR(lprf_write_subreg(lprf, SR_DEM_GC7, 4));
+	lprf_batch_write_subreg(lprf, SR_DEM_GC1, 0);
+	lprf_batch_write_subreg(lprf, SR_DEM_GC2, 0);
+	lprf_batch_write_subreg(lprf, SR_DEM_GC3, 1);
+	lprf_batch_write_subreg(lprf, SR_DEM_GC4, 0);
+	lprf_batch_write_subreg(lprf, SR_DEM_GC5, 0);
+	lprf_batch_write_subreg(lprf, SR_DEM_GC6, 1);
+	lprf_batch_write_subreg(lprf, SR_DEM_GC7, 4);
 
 	/* General TX Settings */
-	RETURN_ON_ERROR(lprf_write_subreg(lprf, SR_PLL_MOD_DATA_RATE,   3));
-	RETURN_ON_ERROR(lprf_write_subreg(lprf, SR_PLL_MOD_FREQ_DEV,   21));
-	RETURN_ON_ERROR(lprf_write_subreg(lprf, SR_TX_EN,               1));
-	RETURN_ON_ERROR(lprf_write_subreg(lprf, SR_TX_ON_CHIP_MOD,      1));
-	RETURN_ON_ERROR(lprf_write_subreg(lprf, SR_TX_UPS,              0));
-	RETURN_ON_ERROR(lprf_write_subreg(lprf, SR_TX_ON_CHIP_MOD_SP,   0));
-	RETURN_ON_ERROR(lprf_write_subreg(lprf, SR_TX_AMPLI_OUT_MAN_H,  1));
-	RETURN_ON_ERROR(lprf_write_subreg(lprf, SR_TX_AMPLI_OUT_MAN_L, 255));
+	lprf_batch_write_subreg(lprf, SR_PLL_MOD_DATA_RATE,
+			lprf->rate.profile->data_rate_sel);
+	lprf_batch_write_subreg(lprf, SR_PLL_MOD_FREQ_DEV,
+			lprf->rate.profile->freq_dev);
+	lprf_batch_write_subreg(lprf, SR_TX_EN,               1);
+	lprf_batch_write_subreg(lprf, SR_TX_ON_CHIP_MOD,      1);
+	lprf_batch_write_subreg(lprf, SR_TX_UPS,              0);
+	lprf_batch_write_subreg(lprf, SR_TX_ON_CHIP_MOD_SP,   0);
+	lprf_batch_write_subreg(lprf, SR_TX_AMPLI_OUT_MAN_H,  1);
+	lprf_batch_write_subreg(lprf, SR_TX_AMPLI_OUT_MAN_L, 255);
 
 
 	/* STATE MASCHINE CONFIGURATION */
 
 	/* General state machine settings */
-	RETURN_ON_ERROR(lprf_write_subreg(lprf, SR_FIFO_MODE_EN,    1));
-	RETURN_ON_ERROR(lprf_write_subreg(lprf, SR_WAKEUPONSPI,     1));
-	RETURN_ON_ERROR(lprf_write_subreg(lprf, SR_WAKEUPONRX,      0));
-	RETURN_ON_ERROR(lprf_write_subreg(lprf, SR_WAKEUP_MODES_EN, 0));
-
-	/* Startup counter Settings */
-	RETURN_ON_ERROR(lprf_write_subreg(lprf, SR_SM_TIME_POWER_TX, 0xff));
-	RETURN_ON_ERROR(lprf_write_subreg(lprf, SR_SM_TIME_POWER_RX, 0xff));
-	RETURN_ON_ERROR(lprf_write_subreg(lprf, SR_SM_TIME_PLL_PON,  0xff));
-	RETURN_ON_ERROR(lprf_write_subreg(lprf, SR_SM_TIME_PLL_SET,  0xff));
-	RETURN_ON_ERROR(lprf_write_subreg(lprf, SR_SM_TIME_TX,       0xff));
-	RETURN_ON_ERROR(lprf_write_subreg(lprf, SR_SM_TIME_PD_EN,    0xff));
+	lprf_batch_write_subreg(lprf, SR_FIFO_MODE_EN,    1);
+	lprf_batch_write_subreg(lprf, SR_WAKEUPONSPI,     1);
+	lprf_batch_write_subreg(lprf, SR_WAKEUPONRX,      0);
+	lprf_batch_write_subreg(lprf, SR_WAKEUP_MODES_EN, 0);
+
+	/* Startup counter Settings (see init_lprf_sm_time()) */
+	for (i = 0; i < LPRF_NUM_SM_TIMERS; ++i)
+		lprf_batch_write_subreg(lprf, lprf_sm_timers[i].addr, 0xff, 0,
+				lprf->sm_time[i]);
 
 	/* SM TX */
-	RETURN_ON_ERROR(lprf_write_subreg(lprf, SR_TX_MODE,          0));
-	RETURN_ON_ERROR(lprf_write_subreg(lprf, SR_INVERT_FIFO_CLK,  0));
-	RETURN_ON_ERROR(lprf_write_subreg(lprf, SR_DIRECT_RX,        1));
-	RETURN_ON_ERROR(lprf_write_subreg(lprf, SR_TX_ON_FIFO_IDLE,  0));
-	RETURN_ON_ERROR(lprf_write_subreg(lprf, SR_TX_ON_FIFO_SLEEP, 0));
-	RETURN_ON_ERROR(lprf_write_subreg(lprf, SR_TX_IDLE_MODE_EN,  0));
-	RETURN_ON_ERROR(lprf_write_subreg(lprf, SR_TX_PWR_CTRL,     15));
-	RETURN_ON_ERROR(lprf_write_subreg(lprf, SR_TX_MAXAMP,        0));
+	lprf_batch_write_subreg(lprf, SR_TX_MODE,          0);
+	lprf_batch_write_subreg(lprf, SR_INVERT_FIFO_CLK,  0);
+	lprf_batch_write_subreg(lprf, SR_DIRECT_RX,        1);
+	lprf_batch_write_subreg(lprf, SR_TX_ON_FIFO_IDLE,  0);
+	lprf_batch_write_subreg(lprf, SR_TX_ON_FIFO_SLEEP, 0);
+	lprf_batch_write_subreg(lprf, SR_TX_IDLE_MODE_EN,  0);
+	lprf_batch_write_subreg(lprf, SR_TX_PWR_CTRL,     lprf->tx_power);
+	lprf_batch_write_subreg(lprf, SR_TX_MAXAMP,        0);
 
 	/* SM RX */
-	RETURN_ON_ERROR(lprf_write_subreg(lprf, SR_DIRECT_TX,          0));
-	RETURN_ON_ERROR(lprf_write_subreg(lprf, SR_DIRECT_TX_IDLE,     0));
-	RETURN_ON_ERROR(lprf_write_subreg(lprf, SR_RX_HOLD_MODE_EN,    0));
-	RETURN_ON_ERROR(lprf_write_subreg(lprf, SR_RX_TIMEOUT_EN,      0));
-	RETURN_ON_ERROR(lprf_write_subreg(lprf, SR_RX_HOLD_ON_TIMEOUT, 0));
-	RETURN_ON_ERROR(lprf_write_subreg(lprf, SR_AGC_AUTO_GAIN,      0));
+	lprf_batch_write_subreg(lprf, SR_DIRECT_TX,          0);
+	lprf_batch_write_subreg(lprf, SR_DIRECT_TX_IDLE,     0);
+	lprf_batch_write_subreg(lprf, SR_RX_HOLD_MODE_EN,    0);
+	lprf_batch_write_subreg(lprf, SR_RX_TIMEOUT_EN,      0);
+	lprf_batch_write_subreg(lprf, SR_RX_HOLD_ON_TIMEOUT, 0);
+	lprf_batch_write_subreg(lprf, SR_AGC_AUTO_GAIN,      0);
 
 	/* Package counter */
-	RETURN_ON_ERROR(lprf_write_subreg(lprf, SR_RX_LENGTH_H,
-			BIT24_H_BYTE(rx_counter_length)));
-	RETURN_ON_ERROR(lprf_write_subreg(lprf, SR_RX_LENGTH_M,
-			BIT24_M_BYTE(rx_counter_length)));
-	RETURN_ON_ERROR(lprf_write_subreg(lprf, SR_RX_LENGTH_L,
-			BIT24_L_BYTE(rx_counter_length)));
+	lprf_batch_write_subreg(lprf, SR_RX_LENGTH_H,
+			BIT24_H_BYTE(rx_counter_length));
+	lprf_batch_write_subreg(lprf, SR_RX_LENGTH_M,
+			BIT24_M_BYTE(rx_counter_length));
+	lprf_batch_write_subreg(lprf, SR_RX_LENGTH_L,
+			BIT24_L_BYTE(rx_counter_length));
 
 	/* Timeout counter */
-	RETURN_ON_ERROR(lprf_write_subreg(lprf, SR_RX_TIMEOUT_H, 0xFF));
-	RETURN_ON_ERROR(lprf_write_subreg(lprf, SR_RX_TIMEOUT_M, 0xFF));
-	RETURN_ON_ERROR(lprf_write_subreg(lprf, SR_RX_TIMEOUT_L, 0xFF));
-
-	/* Resets */
-	RETURN_ON_ERROR(lprf_write_subreg(lprf, SR_FIFO_RESETB, 0));
-	RETURN_ON_ERROR(lprf_write_subreg(lprf, SR_FIFO_RESETB, 1));
-	RETURN_ON_ERROR(lprf_write_subreg(lprf, SR_SM_EN,       1));
-	RETURN_ON_ERROR(lprf_write_subreg(lprf, SR_SM_RESETB,   0));
-	RETURN_ON_ERROR(lprf_write_subreg(lprf, SR_SM_RESETB,   1));
+	lprf_batch_write_subreg(lprf, SR_RX_TIMEOUT_H, 0xFF);
+	lprf_batch_write_subreg(lprf, SR_RX_TIMEOUT_M, 0xFF);
+	lprf_batch_write_subreg(lprf, SR_RX_TIMEOUT_L, 0xFF);
 
-	/* Save configuration of SM_MAIN and DEM_MAIN for async SPI transfers */
-	__lprf_read(lprf, RG_SM_MAIN, &value);
-	lprf->state_change.sm_main_value = value & 0x0f;
-	__lprf_read(lprf, RG_DEM_MAIN, &value);
-	lprf->state_change.dem_main_value = value;
+	RETURN_ON_ERROR(lprf_batch_flush(lprf));
 
-	/* Set PLL to correct RF channel */
+	/*
+	 * Set PLL to correct RF channel. The channel registers are written
+	 * asynchronously and get into the cache by lprf_restore_hardware().
+	 */
 	lprf_set_ieee802154_channel(lprf->hw,
 			lprf->hw->phy->current_page,
 			lprf->hw->phy->current_channel);
 
+	/* Write configuration to the chip */
+	RETURN_ON_ERROR(lprf_restore_hardware(lprf));
+
+	RETURN_ON_ERROR(lprf_calibrate_all_vco(lprf));
+
+	return 0;
+}
+
+/**
+ * Calculates the register values of all supported channels and prepares the
+ * spi message for asynchronous channel switches.
+ */
+static int init_lprf_channels(struct lprf_local *lprf)
+{
+	struct lprf_channel_switch *channel_switch = &lprf->channel_switch;
+	struct lprf_channel *ch = 0;
+	uint32_t rf_freq = 0;
+	int channel = 0;
+	int ret = 0;
+	int i = 0;
+
+	for (channel = LPRF_FIRST_CHANNEL; channel <= LPRF_LAST_CHANNEL;
+			++channel) {
+		ch = &lprf->channels[channel - LPRF_FIRST_CHANNEL];
+		rf_freq = calculate_rf_center_freq(channel);
+
+		RETURN_ON_ERROR(lprf_calculate_pll_values(rf_freq,
+				LPRF_RX_IF_FREQ, &ch->rx_pll_int,
+				&ch->rx_pll_frac));
+		RETURN_ON_ERROR(lprf_calculate_pll_values(rf_freq, 0,
+				&ch->tx_pll_int, &ch->tx_pll_frac));
+		ch->vco_tune = calc_vco_tune(channel);
+
+		PRINT_DEBUG("Channel %d: RX int=%d frac=0x%.5x, "
+				"TX int=%d frac=0x%.5x, VCO tune %d",
+				channel, ch->rx_pll_int, ch->rx_pll_frac,
+				ch->tx_pll_int, ch->tx_pll_frac, ch->vco_tune);
+	}
+
+	spi_message_init(&channel_switch->spi_message);
+	channel_switch->spi_message.complete = __lprf_channel_switch_complete;
+	channel_switch->spi_message.context = lprf;
+	for (i = 0; i < LPRF_CHANNEL_SWITCH_REGS; ++i) {
+		channel_switch->spi_transfers[i].tx_buf = channel_switch->tx_buf[i];
+		channel_switch->spi_transfers[i].len = LPRF_REG_WRITE_LENGTH;
+		channel_switch->spi_transfers[i].cs_change =
+				i < LPRF_CHANNEL_SWITCH_REGS - 1;
+		spi_message_add_tail(&channel_switch->spi_transfers[i],
+				&channel_switch->spi_message);
+	}
+	atomic_set(&channel_switch->is_active, 0);
+	init_completion(&channel_switch->done);
+
 	return 0;
 }
 
+/**
+ * Initializes the regmap of the lprf chip.
+ *
+ * The chip gets reset and the default values of all cached registers are
+ * read once and handed to regmap as register defaults. With the defaults
+ * known regmap can build the configuration in the cache without accessing
+ * the chip and regcache_sync() can skip registers with default values.
+ * The chip ID is checked later by lprf_detect_device().
+ */
+static int init_lprf_regmap(struct lprf_local *lprf)
+{
+	struct spi_device *spi = lprf->spi_device;
+	struct regmap_config regmap_config = lprf_regmap_spi_config;
+	struct reg_default *reg_defaults = 0;
+	int num_reg_defaults = 0;
+	uint8_t reset_cmd[][LPRF_REG_WRITE_LENGTH] = {
+		{REGW, RG_GLOBAL_RESETB,  0x00},
+		{REGW, RG_GLOBAL_RESETB,  0xFF},
+		{REGW, RG_GLOBAL_initALL, 0xFF},
+	};
+	uint8_t read_cmd[2];
+	uint8_t value = 0;
+	unsigned int reg;
+	int ret = 0;
+	int i;
+
+	reg_defaults = kcalloc(LPRF_MAX_REGISTER + 1, sizeof(*reg_defaults),
+			GFP_KERNEL);
+	if (!reg_defaults)
+		return -ENOMEM;
+
+	for (i = 0; i < ARRAY_SIZE(reset_cmd); ++i) {
+		ret = spi_write(spi, reset_cmd[i], sizeof(reset_cmd[i]));
+		if (ret)
+			goto free_defaults;
+	}
+
+	for (reg = 0; reg <= LPRF_MAX_REGISTER; ++reg) {
+		if (!lprf_reg_writeable(&spi->dev, reg) ||
+				(lprf_reg_volatile(&spi->dev, reg) &&
+				reg != RG_SM_MAIN))
+			continue;
+
+		read_cmd[0] = REGR;
+		read_cmd[1] = reg;
+		ret = spi_write_then_read(spi, read_cmd, sizeof(read_cmd),
+				&value, 1);
+		if (ret)
+			goto free_defaults;
+
+		lprf->reg_shadow.value[reg] = value;
+		if (lprf_reg_volatile(&spi->dev, reg))
+			continue;
+
+		reg_defaults[num_reg_defaults].reg = reg;
+		reg_defaults[num_reg_defaults].def = value;
+		num_reg_defaults++;
+	}
+
+	regmap_config.reg_defaults = reg_defaults;
+	regmap_config.num_reg_defaults = num_reg_defaults;
+
+	lprf->regmap = devm_regmap_init(&spi->dev, &lprf_regmap_bus, lprf,
+			&regmap_config);
+	if (IS_ERR(lprf->regmap)) {
+		ret = PTR_ERR(lprf->regmap);
+		dev_err(&spi->dev, "Failed to allocate register map: %d", ret);
+	}
+
+free_defaults:
+	kfree(reg_defaults);
+	return ret;
+}
+
 /**
  * Reads the chip ID and sets the IEEE device capabilities
  * for this chip.
@@ -1829,6 +6563,7 @@ static int lprf_detect_device(struct lprf_local *lprf)
 
 
 	lprf->hw->flags = IEEE802154_HW_PROMISCUOUS |
+			IEEE802154_HW_AFILT |
 			IEEE802154_HW_RX_DROP_BAD_CKSUM;
 
 	lprf->hw->phy->flags = WPAN_PHY_FLAG_TXPOWER;
@@ -1841,7 +6576,7 @@ static int lprf_detect_device(struct lprf_local *lprf)
 
 	lprf->hw->phy->supported.channels[0] = 0x7FFF800;
 	lprf->hw->phy->current_channel = 11;
-	lprf->hw->phy->symbol_duration = 16;
+	lprf->hw->phy->symbol_duration = lprf->rate.profile->symbol_duration;
 	lprf->hw->phy->supported.tx_powers = lprf_tx_powers;
 	lprf->hw->phy->supported.tx_powers_size =
 			ARRAY_SIZE(lprf_tx_powers);
@@ -1855,6 +6590,83 @@ static int lprf_detect_device(struct lprf_local *lprf)
 
 }
 
+/**
+ * Initializes the state machine startup timers. All timers default to the
+ * maximum value and can be set per board with the device tree properties
+ * "ias,sm-time-<name>" (see lprf_sm_timers).
+ */
+static void init_lprf_sm_time(struct lprf_local *lprf)
+{
+	struct device_node *np = lprf->spi_device->dev.of_node;
+	char property[32];
+	u32 value = 0;
+	int i = 0;
+
+	for (i = 0; i < LPRF_NUM_SM_TIMERS; ++i) {
+		lprf->sm_time[i] = 0xff;
+
+		snprintf(property, sizeof(property), "ias,sm-time-%s",
+				lprf_sm_timers[i].name);
+		if (np && !of_property_read_u32(np, property, &value))
+			lprf->sm_time[i] = min_t(u32, value, 0xff);
+	}
+}
+
+/**
+ * Initializes the synchronization header. The IEEE 802.15.4 header
+ * SYNC_HEADER is used unless the device tree properties ias,preamble-length
+ * or ias,sfd are set.
+ */
+static int init_lprf_shr(struct lprf_local *lprf)
+{
+	struct device_node *np = lprf->spi_device->dev.of_node;
+	u32 value = 0;
+
+	lprf->shr.preamble_length = sizeof(SYNC_HEADER) - 1;
+	lprf->shr.sfd = SYNC_HEADER[sizeof(SYNC_HEADER) - 1];
+	if (!np)
+		return 0;
+
+	if (!of_property_read_u32(np, "ias,preamble-length", &value)) {
+		if (value < LPRF_MIN_PREAMBLE_LENGTH ||
+				value > LPRF_MAX_PREAMBLE_LENGTH) {
+			dev_err(&lprf->spi_device->dev,
+					"unsupported preamble length %u\n",
+					value);
+			return -EINVAL;
+		}
+		lprf->shr.preamble_length = value;
+	}
+	if (!of_property_read_u32(np, "ias,sfd", &value))
+		lprf->shr.sfd = value;
+
+	return 0;
+}
+
+/**
+ * Selects the data rate set by the device tree property ias,data-rate-kbps
+ * or LPRF_DEFAULT_KBIT_RATE.
+ */
+static int init_lprf_rate(struct lprf_local *lprf)
+{
+	struct device_node *np = lprf->spi_device->dev.of_node;
+	const struct lprf_rate_profile *profile = 0;
+	u32 kbit_rate = LPRF_DEFAULT_KBIT_RATE;
+
+	if (np)
+		of_property_read_u32(np, "ias,data-rate-kbps", &kbit_rate);
+
+	profile = lprf_find_rate_profile(kbit_rate);
+	if (!profile) {
+		dev_err(&lprf->spi_device->dev,
+				"unsupported data rate %u kbps\n", kbit_rate);
+		return -EINVAL;
+	}
+
+	lprf_select_rate_profile(lprf, profile);
+	return 0;
+}
+
 /**
  * Initializes the lprf_local struct
  */
@@ -1866,6 +6678,41 @@ static void init_lprf_local(struct lprf_local *lprf, struct spi_device *spi)
 
 	lprf->spi_device = spi;
 	spi_set_drvdata(spi, lprf);
+
+	spin_lock_init(&lprf->reg_shadow.lock);
+	mutex_init(&lprf->reg_batch.lock);
+	mutex_init(&lprf->run_lock);
+	INIT_WORK(&lprf->restore_work, lprf_restore_work);
+	INIT_WORK(&lprf->vco_cal.work, lprf_vco_cal_work);
+	lprf->vco_cal.next_check = jiffies;
+	INIT_WORK(&lprf->scan.work, lprf_scan_work);
+	INIT_WORK(&lprf->sm_time_work, lprf_sm_time_work);
+	INIT_WORK(&lprf->rate.work, lprf_rate_work);
+	INIT_WORK(&lprf->mode.work, lprf_mode_work);
+	mutex_init(&lprf->mode.lock);
+	mutex_init(&lprf->scan.lock);
+	lprf->scan.samples = LPRF_SCAN_DEFAULT_SAMPLES;
+
+	hrtimer_init(&lprf->hopping.timer, CLOCK_MONOTONIC, HRTIMER_MODE_ABS);
+	lprf->hopping.timer.function = lprf_hop_timer;
+	mutex_init(&lprf->hopping.lock);
+
+	skb_queue_head_init(&lprf->tx_queue);
+	hrtimer_init(&lprf->tx_timer, CLOCK_MONOTONIC, HRTIMER_MODE_ABS);
+	lprf->tx_timer.function = lprf_tx_timer;
+	lprf->tx_power = ARRAY_SIZE(lprf_tx_powers) - 1;
+
+	hrtimer_init(&lprf->aggregation.timer, CLOCK_MONOTONIC,
+			HRTIMER_MODE_REL);
+	lprf->aggregation.timer.function = lprf_aggregation_timer;
+	spin_lock_init(&lprf->aggregation.lock);
+	lprf->aggregation.delay = ktime_set(0,
+			LPRF_AGG_DEFAULT_DELAY_US * NSEC_PER_USEC);
+
+	spin_lock_init(&lprf->addr_filt_lock);
+	lprf->addr_filt.pan_id = cpu_to_le16(MAC_BROADCAST);
+	lprf->addr_filt.short_addr = cpu_to_le16(MAC_BROADCAST);
+	lprf->promiscuous = false;
 }
 
 /**
@@ -1902,11 +6749,35 @@ static void init_phy_status(struct lprf_phy_status *phy_status,
 			&phy_status->spi_message);
 }
 
+/**
+ * Initializes the lprf_rx_length struct
+ */
+static void init_rx_length(struct lprf_rx_length *rx_length,
+		struct lprf_local *lprf, struct spi_device *spi)
+{
+	int i = 0;
+
+	spi_message_init(&rx_length->spi_message);
+	rx_length->spi_message.context = lprf;
+	rx_length->spi_message.spi = spi;
+	for (i = 0; i < LPRF_RX_LENGTH_REGS; ++i) {
+		rx_length->spi_transfers[i].tx_buf = rx_length->tx_buf[i];
+		rx_length->spi_transfers[i].len = LPRF_REG_WRITE_LENGTH;
+		rx_length->spi_transfers[i].cs_change =
+				i < LPRF_RX_LENGTH_REGS - 1;
+		spi_message_add_tail(&rx_length->spi_transfers[i],
+				&rx_length->spi_message);
+	}
+	rx_length->enabled = true;
+}
+
 /**
  * Initializes the char_driver struct
  */
 static void init_char_driver(void)
 {
+	INIT_LIST_HEAD(&lprf_char_driver_interface.readers);
+	spin_lock_init(&lprf_char_driver_interface.lock);
 	init_waitqueue_head(&lprf_char_driver_interface.wait_for_rx_data);
 	init_waitqueue_head(&lprf_char_driver_interface.wait_for_tx_ready);
 }
@@ -1938,39 +6809,64 @@ static int lprf_probe(struct spi_device *spi)
 	init_lprf_local(lprf, spi);
 	init_phy_status(phy_status, lprf, spi);
 	init_state_change(state_change, lprf, spi);
+	init_rx_length(&lprf->rx_length, lprf, spi);
+	lprf_fec_init_tables();
+	lprf->rx_drain.enabled = true;
 	init_char_driver();
 
+	ret = init_lprf_channels(lprf);
+	if(ret)
+		goto free_lprf;
+
+	init_lprf_sm_time(lprf);
+
+	ret = init_lprf_shr(lprf);
+	if(ret)
+		goto free_lprf;
+
+	ret = init_lprf_rate(lprf);
+	if(ret)
+		goto free_lprf;
+
+	lprf->wq = alloc_ordered_workqueue("lprf", 0);
+	if (!lprf->wq) {
+		ret = -ENOMEM;
+		goto free_lprf;
+	}
+
 	hw->parent = &lprf->spi_device->dev;
 	ieee802154_random_extended_addr(&hw->phy->perm_extended_addr);
 
-	lprf->regmap = devm_regmap_init_spi(spi, &lprf_regmap_spi_config);
-	if (IS_ERR(lprf->regmap)) {
-		dev_err(&spi->dev, "Failed to allocate register map: %d",
-				(int) PTR_ERR(lprf->regmap));
-	}
+	ret = init_lprf_regmap(lprf);
+	if(ret)
+		goto free_workqueue;
 
 	ret = lprf_detect_device(lprf);
 	if(ret)
-		goto free_lprf;
+		goto free_workqueue;
 
 	ret = init_lprf_hardware(lprf);
 	if(ret)
-		goto free_lprf;
+		goto free_workqueue;
 	PRINT_DEBUG("Hardware successfully initialized");
 
 	ret = register_char_device(lprf);
 	if(ret)
-		goto free_lprf;
+		goto free_workqueue;
 
 	ret = ieee802154_register_hw(hw);
 	if (ret)
 		goto unregister_char_device;
 	PRINT_DEBUG("Successfully registered IEEE 802.15.4 device");
 
+	init_lprf_debugfs(lprf);
+
 	return ret;
 
 unregister_char_device:
 	unregister_char_device(lprf);
+free_workqueue:
+	destroy_workqueue(lprf->wq);
 free_lprf:
 	ieee802154_free_hw(hw);
 
@@ -1984,16 +6880,80 @@ static int lprf_remove(struct spi_device *spi)
 {
 	struct lprf_local *lprf = spi_get_drvdata(spi);
 
-	lprf_stop_ieee802154(lprf->hw);
+	/* Stops the interface, so the stack does not queue any more frames */
+	ieee802154_unregister_hw(lprf->hw);
+	debugfs_remove_recursive(lprf->debugfs_dir);
 	unregister_char_device(lprf);
 
-	ieee802154_unregister_hw(lprf->hw);
+	/* Files of the char device that are still open keep the chip polled */
+	mutex_lock(&lprf->run_lock);
+	if (lprf_polling_wanted(lprf))
+		lprf_halt(lprf);
+	lprf->removing = true;
+	mutex_unlock(&lprf->run_lock);
+
+	/* No work or timer may access the chip anymore */
+	hrtimer_cancel(&lprf->hopping.timer);
+	hrtimer_cancel(&lprf->aggregation.timer);
+	hrtimer_cancel(&lprf->tx_timer);
+	cancel_work_sync(&lprf->restore_work);
+	cancel_work_sync(&lprf->vco_cal.work);
+	cancel_work_sync(&lprf->rate.work);
+	cancel_work_sync(&lprf->mode.work);
+	cancel_work_sync(&lprf->scan.work);
+	cancel_work_sync(&lprf->sm_time_work);
+	destroy_workqueue(lprf->wq);
+
+	kfree_skb(lprf->aggregation.skb);
+	kfree_skb(lprf->tx_skb);
+	skb_queue_purge(&lprf->tx_queue);
 	ieee802154_free_hw(lprf->hw);
 	dev_dbg(&spi->dev, "unregistered LPRF chip\n");
 
 	return 0;
 }
 
+/**
+ * Stops the polling and marks the register cache as dirty, as the chip
+ * might lose its configuration while the system is suspended.
+ */
+static int __maybe_unused lprf_suspend(struct device *dev)
+{
+	struct lprf_local *lprf = spi_get_drvdata(to_spi_device(dev));
+
+	mutex_lock(&lprf->run_lock);
+	lprf_stop_polling(lprf);
+
+	/* Wait some time to make sure all pending communication finished*/
+	usleep_range(900, 1000);
+
+	regcache_cache_only(lprf->regmap, true);
+	regcache_mark_dirty(lprf->regmap);
+	mutex_unlock(&lprf->run_lock);
+	return 0;
+}
+
+/**
+ * Restores the chip configuration from the register cache after resume
+ * and restarts the polling if it is wanted (see lprf_polling_wanted()).
+ */
+static int __maybe_unused lprf_resume(struct device *dev)
+{
+	struct lprf_local *lprf = spi_get_drvdata(to_spi_device(dev));
+	int ret = 0;
+
+	mutex_lock(&lprf->run_lock);
+	ret = lprf_restore_hardware(lprf);
+	if (!ret && lprf_polling_wanted(lprf)) {
+		atomic_set(&lprf->rx_polling_active, 1);
+		lprf_phy_status_async(&lprf->phy_status);
+	}
+	mutex_unlock(&lprf->run_lock);
+	return ret;
+}
+
+static SIMPLE_DEV_PM_OPS(lprf_pm_ops, lprf_suspend, lprf_resume);
+
 static const struct of_device_id lprf_of_match[] = {
 	{ .compatible = "ias,lprf", },
 	{ },
@@ -2011,6 +6971,7 @@ static struct spi_driver lprf_driver = {
 	.driver = {
 		.of_match_table = of_match_ptr(lprf_of_match),
 		.name	= "lprf",
+		.pm	= &lprf_pm_ops,
 	},
 	.probe      = lprf_probe,
 	.remove     = lprf_remove,
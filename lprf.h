@@ -46,19 +46,36 @@ static const int PHY_HEADER_LENGTH = 1;
  * problems during post processing like shifting the received bytes. */
 #define FRAME_LENGTH (130 + sizeof(SYNC_HEADER))
 
+/*
+ * Long frames of the raw char driver interface (see lprf_set_long_frames()).
+ * The frame read and write commands transfer the frame length in one byte,
+ * which limits LPRF_LONG_FRAME_LENGTH. Like in FRAME_LENGTH, the
+ * synchronization header, the physical header and 2 extra bytes are included.
+ * The physical header of long frames contains an 11 bit PSDU length.
+ */
+#define LPRF_LONG_FRAME_LENGTH      255
+#define LPRF_LONG_PHR_LENGTH        2
+#define LPRF_LONG_PSDU_LENGTH_MASK  0x07ff
+#define LPRF_LONG_MAX_PSDU (LPRF_LONG_FRAME_LENGTH - sizeof(SYNC_HEADER) - \
+		LPRF_LONG_PHR_LENGTH - 2)
+
 /**
  * Required size of the SPI buffers for frame reading and writing
  */
-#define MAX_SPI_BUFFER_SIZE (FRAME_LENGTH + 2)
+#define MAX_SPI_BUFFER_SIZE (LPRF_LONG_FRAME_LENGTH + 2)
 
 /**
- * Over the air data rate in kbps. Used to calculate RX counter length.
+ * Over the air data rate in kbps, that is used if no other rate is set in
+ * the device tree (ias,data-rate-kbps), and highest supported data rate.
+ * See lprf_rate_profiles for all supported data rates.
  */
-#define KBIT_RATE 2000
+#define LPRF_DEFAULT_KBIT_RATE 2000
+#define LPRF_MAX_KBIT_RATE 2000
 
 /**
- * Intervals for polling. The first value is in seconds and the second in
- * nanoseconds.
+ * Intervals for polling at LPRF_MAX_KBIT_RATE. The first value is in seconds
+ * and the second in nanoseconds. For lower data rates the intervals are
+ * scaled with the airtime (see lprf_select_rate_profile()).
  *
  * RX_POLLING_INTERVAL: Time between two status polls when the chip is in
  * 	RX mode and waiting for data.
@@ -71,6 +88,26 @@ static const int PHY_HEADER_LENGTH = 1;
 #define TX_RX_INTERVAL ktime_set(0, 600000)
 #define RETRY_INTERVAL ktime_set(0, 100000)
 
+/**
+ * Maximum time in milliseconds lprf_wait_for_idle() waits for pending
+ * asynchronous SPI access and for a frame the chip is still sending. A long
+ * frame takes less than 10 ms on air at 250 kbps.
+ */
+#define LPRF_IDLE_TIMEOUT_MS 50
+
+/**
+ * Highest register address of the chip
+ */
+#define LPRF_MAX_REGISTER 0xF3
+
+/**
+ * Maximum number of register writes that are combined into one SPI message
+ * (see lprf_regmap_write()). A register write consists of three bytes:
+ * command, address and value.
+ */
+#define LPRF_MAX_MULTI_WRITE 32
+#define LPRF_REG_WRITE_LENGTH 3
+
 #define REGR 0x80 /* Register read access command */
 #define REGW 0xc0 /* Register write access command */
 #define FRMR 0x20 /* Frame read access command */
@@ -84,6 +121,133 @@ static const int PHY_HEADER_LENGTH = 1;
 #define PHY_FIFO_EMPTY(phy_status)  (((phy_status) & 0x08) >> 3)
 #define PHY_FIFO_FULL(phy_status)   (((phy_status) & 0x04) >> 2)
 
+/*
+ * Supported IEEE 802.15.4 channels (2.4 GHz band, channel page 0) and number
+ * of registers written for a channel switch (RX PLL, TX PLL and VCO tune)
+ */
+#define LPRF_FIRST_CHANNEL          11
+#define LPRF_LAST_CHANNEL           26
+#define LPRF_NUM_CHANNELS           (LPRF_LAST_CHANNEL - LPRF_FIRST_CHANNEL + 1)
+#define LPRF_CHANNEL_SWITCH_REGS    9
+#define LPRF_RX_IF_FREQ             1000000
+
+/*
+ * VCO calibration: range of tune values swept around the value of
+ * calc_vco_tune(), settling time of the PLL for every tune value and the
+ * range of the TPM gain measurement for a PLL that reaches the channel
+ * frequency. A recalibration of the current channel is started if more
+ * than LPRF_VCO_CAL_MAX_ERRORS of LPRF_VCO_CAL_WINDOW received frames are
+ * corrupted, but at most once every LPRF_VCO_CAL_INTERVAL_MS.
+ */
+#define LPRF_VCO_CAL_RANGE          8
+#define LPRF_VCO_CAL_SETTLE_US      200
+#define LPRF_VCO_CAL_GAIN_MIN       0x00100
+#define LPRF_VCO_CAL_GAIN_MAX       0x7FEFF
+#define LPRF_VCO_CAL_WINDOW         64
+#define LPRF_VCO_CAL_MAX_ERRORS     16
+#define LPRF_VCO_CAL_INTERVAL_MS    10000
+
+/*
+ * Channel scan and occupancy estimation: default and maximum number of
+ * samples per channel, time between two samples of a scan, number of polls
+ * the busy ratio of a channel is calculated from and the weight of a new
+ * busy ratio in the moving average (1/LPRF_OCCUPANCY_WEIGHT).
+ * LPRF_AGC_MAX_GAIN is the sum of the maximum gain settings of all seven
+ * gain stages.
+ */
+#define LPRF_SCAN_DEFAULT_SAMPLES   100
+#define LPRF_SCAN_MAX_SAMPLES       10000
+#define LPRF_SCAN_SAMPLE_US         100
+#define LPRF_OCCUPANCY_WINDOW       256
+#define LPRF_OCCUPANCY_WEIGHT       8
+#define LPRF_AGC_MAX_GAIN           (7 * 15)
+
+/*
+ * Characterisation of the state machine startup timers: number of test
+ * runs that need to pass for every timer value, time to wait for state
+ * changes during a test and margin added to the smallest working value.
+ */
+#define LPRF_NUM_SM_TIMERS          6
+#define LPRF_SM_TIME_TRIALS         10
+#define LPRF_SM_TIME_TEST_US        1000
+#define LPRF_SM_TIME_MARGIN         4
+
+/*
+ * TX related state machine settings in RG_SM_TX_SET (SR_DIRECT_RX,
+ * SR_TX_ON_FIFO_IDLE, SR_TX_ON_FIFO_SLEEP and SR_TX_IDLE_MODE_EN).
+ * In normal mode the chip changes to RX mode directly after sending a
+ * frame. In burst mode it stays in TX idle mode and sends again as soon as
+ * the next frame is written to the FIFO.
+ */
+#define LPRF_TX_MODE_MASK           0x0f
+#define LPRF_TX_MODE_NORMAL         0x08
+#define LPRF_TX_MODE_BURST          0x05
+
+/*
+ * Maximum number of bytes read from the FIFO at once while the chip is still
+ * receiving and number of received bytes needed to decode the physical
+ * header for a preamble length and physical header length (rest of the
+ * preamble, SFD, PHR and one more byte, as the data might be shifted by up to
+ * two bits). A complete frame consists of LPRF_RX_PHR_BYTES plus the PSDU
+ * length bytes.
+ */
+#define LPRF_RX_DRAIN_CHUNK         32
+#define LPRF_RX_PHR_BYTES(preamble_length, phr_length) \
+		((preamble_length) + (phr_length) + 1)
+
+/*
+ * Byte the preamble of the synchronization header consists of
+ */
+#define LPRF_PREAMBLE_BYTE          0x55
+
+/*
+ * Adapting the RX length counter to the received frame: number of counter
+ * registers, bytes of the frame that need to be outstanding for the counter
+ * to be changed and extra bytes received after the frame, as in
+ * FRAME_LENGTH.
+ */
+#define LPRF_RX_LENGTH_REGS         3
+#define LPRF_RX_LENGTH_MIN_REMAINING 8
+#define LPRF_RX_LENGTH_MARGIN       2
+
+/*
+ * Aggregation of small payloads of the char driver interface into one frame:
+ * length of the sub-frame header in front of every payload and maximum time
+ * a payload waits for further payloads, if not set by
+ * LPRF_IOC_SET_AGGREGATION.
+ */
+#define LPRF_AGG_HEADER_LENGTH      1
+#define LPRF_AGG_DEFAULT_DELAY_US   2000
+
+/*
+ * Forward error correction of the char driver interface by a shortened
+ * Reed-Solomon code over GF(256): parity bytes per codeword, which corrects
+ * LPRF_FEC_PARITY / 2 bytes, maximum number of data bytes per codeword,
+ * resulting maximum codeword length and primitive polynomial of GF(256).
+ */
+#define LPRF_FEC_PARITY             8
+#define LPRF_FEC_BLOCK_DATA         32
+#define LPRF_FEC_BLOCK              (LPRF_FEC_BLOCK_DATA + LPRF_FEC_PARITY)
+#define LPRF_FEC_POLY               0x11d
+
+/*
+ * Maximum number of frames the char driver interface queues for
+ * transmission before a write blocks
+ */
+#define LPRF_TX_QUEUE_LEN           16
+
+/*
+ * Number of received frames the read() buffer of every open file of the char
+ * driver interface holds until it is changed by LPRF_IOC_SET_RX_BUFFER
+ */
+#define LPRF_RX_BUFFER_DEFAULT_FRAMES 64
+
+/*
+ * TX power level of a queued frame that is sent with the TX power set by the
+ * IEEE 802.15.4 stack
+ */
+#define LPRF_DEFAULT_TX_POWER       -1
+
 /*
  * state machine states as returned in phy_status
  */
@@ -95,6 +259,22 @@ static const int PHY_HEADER_LENGTH = 1;
 #define PHY_SM_RX_RDY               0x06
 #define PHY_SM_RECEIVING            0x07
 
+/*
+ * Macros for evaluation of the IEEE 802.15.4 MAC header
+ */
+#define MAC_FC_DST_ADDR_MODE(fc)    (((fc) & 0x0c00) >> 10)
+#define MAC_ADDR_MODE_NONE          0x00
+#define MAC_ADDR_MODE_SHORT         0x02
+#define MAC_ADDR_MODE_LONG          0x03
+#define MAC_BROADCAST               0xffff
+
+/*
+ * Byte offsets in the MAC header: frame control (2 bytes), sequence
+ * number (1 byte), destination PAN ID (2 bytes), destination address
+ */
+#define MAC_DST_PAN_OFFSET          3
+#define MAC_DST_ADDR_OFFSET         5
+
 /*
  * Macros for H-, M-, L-Byte of 24 bit value
  */
@@ -125,6 +305,15 @@ static const int PHY_HEADER_LENGTH = 1;
 #endif
 
 
+/*
+ * Macros for getting the mask and the shift of a sub register definition like
+ * SR_SM_COMMAND, which expands to address, mask and shift.
+ */
+#define __SUBREG_MASK(addr, mask, shift) (mask)
+#define SUBREG_MASK(subreg) __SUBREG_MASK(subreg)
+#define __SUBREG_SHIFT(addr, mask, shift) (shift)
+#define SUBREG_SHIFT(subreg) __SUBREG_SHIFT(subreg)
+
 /*
  * Macro for evaluating the return value of a function and returning
  * in case of a non zero return value.
@@ -0,0 +1,335 @@
+/*
+ * IAS LPRF driver
+ *
+ * Copyright (C) 2015 IAS RWTH Aachen
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2
+ * as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details
+ *
+ * This file defines the ioctl interface of the char device /dev/lprf.
+ * It is included by the driver and can be included by user space
+ * applications as well.
+ */
+
+#ifndef _LPRF_IOCTL_H_
+#define _LPRF_IOCTL_H_
+
+#include <linux/ioctl.h>
+#include <linux/types.h>
+
+#define LPRF_IOC_MAGIC              'L'
+
+/*
+ * Channel hopping
+ */
+#define LPRF_MAX_HOP_SEQUENCE       64
+#define LPRF_MIN_HOP_SLOT_US        1000
+
+/**
+ * lprf_hop_config describes a channel hopping schedule.
+ *
+ * @start_time_ns: CLOCK_MONOTONIC time of the first slot boundary in ns.
+ * 	Zero starts hopping immediately.
+ * @slot_duration_us: duration of one slot in us, at least
+ * 	LPRF_MIN_HOP_SLOT_US
+ * @num_channels: number of valid entries in channels
+ * @channels: hop sequence of IEEE 802.15.4 channels (11 - 26). The sequence
+ * 	is repeated after the last entry.
+ */
+struct lprf_hop_config {
+	__u64 start_time_ns;
+	__u32 slot_duration_us;
+	__u32 num_channels;
+	__u8 channels[LPRF_MAX_HOP_SEQUENCE];
+};
+
+#define LPRF_IOC_START_HOPPING  _IOW(LPRF_IOC_MAGIC, 1, struct lprf_hop_config)
+#define LPRF_IOC_STOP_HOPPING   _IO(LPRF_IOC_MAGIC, 2)
+
+/*
+ * Over the air data rate in kbps. Supported are 2000, 1000, 500 and 250.
+ */
+#define LPRF_IOC_SET_DATA_RATE  _IOW(LPRF_IOC_MAGIC, 3, __u32)
+#define LPRF_IOC_GET_DATA_RATE  _IOR(LPRF_IOC_MAGIC, 4, __u32)
+
+/*
+ * Synchronization header
+ */
+#define LPRF_MIN_PREAMBLE_LENGTH    1
+#define LPRF_MAX_PREAMBLE_LENGTH    4
+
+/**
+ * lprf_shr_config describes the synchronization header of sent and received
+ * frames. The IEEE 802.15.4 header has a preamble length of 4 and the SFD
+ * 0xe5. Shorter preambles only work between LPRF chips.
+ *
+ * @preamble_length: number of preamble bytes (0x55), LPRF_MIN_PREAMBLE_LENGTH
+ * 	to LPRF_MAX_PREAMBLE_LENGTH
+ * @sfd: start of frame delimiter
+ */
+struct lprf_shr_config {
+	__u8 preamble_length;
+	__u8 sfd;
+};
+
+#define LPRF_IOC_SET_SHR  _IOW(LPRF_IOC_MAGIC, 5, struct lprf_shr_config)
+#define LPRF_IOC_GET_SHR  _IOR(LPRF_IOC_MAGIC, 6, struct lprf_shr_config)
+
+/*
+ * Long frames with a two byte physical header and a PSDU of up to 246 bytes.
+ * Written data is sent in long frames while enabled (nonzero) and received
+ * frames are expected to be long frames. Both nodes of a link need to enable
+ * long frames, as they are not compatible with IEEE 802.15.4. As the
+ * IEEE 802.15.4 interface does not receive any frames while long frames are
+ * enabled, enabling fails with EBUSY while the interface is up and the
+ * interface does not come up (EBUSY) while they are enabled.
+ */
+#define LPRF_IOC_SET_LONG_FRAMES  _IOW(LPRF_IOC_MAGIC, 7, __u32)
+#define LPRF_IOC_GET_LONG_FRAMES  _IOR(LPRF_IOC_MAGIC, 8, __u32)
+
+/*
+ * Aggregation of small payloads
+ */
+#define LPRF_MAX_AGGREGATION_DELAY_US 1000000
+
+/**
+ * lprf_aggregation_config controls the aggregation of written data.
+ *
+ * @enabled: nonzero to pack every write into a sub-frame of an aggregated
+ * 	frame. Empty writes fail with EMSGSIZE, as a zero length ends the
+ * 	sub-frames of a frame. Received frames are unpacked and every payload is read with
+ * 	its one byte length in front. Both nodes of a link need to enable
+ * 	aggregation. Received frames are not passed to the IEEE 802.15.4
+ * 	interface, so enabling fails with EBUSY while the interface is up
+ * 	and the interface does not come up (EBUSY) while it is enabled.
+ * @delay_us: maximum time a payload waits for further payloads before the
+ * 	frame is sent, at most LPRF_MAX_AGGREGATION_DELAY_US
+ */
+struct lprf_aggregation_config {
+	__u32 enabled;
+	__u32 delay_us;
+};
+
+#define LPRF_IOC_SET_AGGREGATION \
+		_IOW(LPRF_IOC_MAGIC, 9, struct lprf_aggregation_config)
+#define LPRF_IOC_GET_AGGREGATION \
+		_IOR(LPRF_IOC_MAGIC, 10, struct lprf_aggregation_config)
+
+/*
+ * Forward error correction (nonzero enables). Written data is encoded by an
+ * interleaved Reed-Solomon code, which corrects 4 bytes per 32 data bytes.
+ * Received frames are corrected and only the data is read. Both nodes of a
+ * link need to enable the forward error correction. Received frames are not
+ * passed to the IEEE 802.15.4 interface, so enabling fails with EBUSY while
+ * the interface is up and the interface does not come up (EBUSY) while it is
+ * enabled.
+ */
+#define LPRF_IOC_SET_FEC  _IOW(LPRF_IOC_MAGIC, 11, __u32)
+#define LPRF_IOC_GET_FEC  _IOR(LPRF_IOC_MAGIC, 12, __u32)
+
+/*
+ * Record mode (nonzero enables). Every read returns exactly one received
+ * frame with a struct lprf_rx_record in front. Data that has not been read
+ * yet is discarded when the mode changes. The mode belongs to the open file,
+ * every open starts with the byte stream of raw data.
+ */
+#define LPRF_IOC_SET_RX_RECORDS  _IOW(LPRF_IOC_MAGIC, 13, __u32)
+#define LPRF_IOC_GET_RX_RECORDS  _IOR(LPRF_IOC_MAGIC, 14, __u32)
+
+/*
+ * Status flags of a received record
+ *
+ * LPRF_RX_STATUS_NO_SFD: No SFD was found, the raw data received from the
+ * 	chip follows the header.
+ * LPRF_RX_STATUS_BAD_LENGTH: The physical header contains an invalid length
+ * 	or the frame is longer than the received data. All received data
+ * 	following the SFD follows the header.
+ * LPRF_RX_STATUS_FEC_CORRECTED: The forward error correction corrected
+ * 	errors of the frame.
+ * LPRF_RX_STATUS_FEC_FAILED: The frame could not be corrected, the encoded
+ * 	data follows the header.
+ * LPRF_RX_STATUS_AGGREGATED: The record contains one payload of an
+ * 	aggregated frame.
+ * LPRF_RX_STATUS_TX_DONE: The record reports the transmission of a frame
+ * 	queued with LPRF_TX_FRAME_REPORT, a struct lprf_tx_completion follows
+ * 	the header.
+ * LPRF_RX_STATUS_OVERFLOW: Records were dropped right before this one,
+ * 	because the read() buffer or the RX ring was full.
+ */
+#define LPRF_RX_STATUS_NO_SFD           0x01
+#define LPRF_RX_STATUS_BAD_LENGTH       0x02
+#define LPRF_RX_STATUS_FEC_CORRECTED    0x04
+#define LPRF_RX_STATUS_FEC_FAILED       0x08
+#define LPRF_RX_STATUS_AGGREGATED       0x10
+#define LPRF_RX_STATUS_TX_DONE          0x20
+#define LPRF_RX_STATUS_OVERFLOW         0x40
+
+/**
+ * lprf_rx_record is the header in front of every frame read in record mode.
+ *
+ * @timestamp_ns: CLOCK_MONOTONIC time in ns the frame was read from the chip
+ * @raw_length: number of bytes received from the chip
+ * @length: number of bytes following the header. This is the PSDU of the
+ * 	frame, the corrected data or the payload of an aggregated frame
+ * 	unless the status says otherwise.
+ * @shift: bit shift of the received data found by the SFD search (6 - 8) or
+ * 	zero if no SFD was found
+ * @status: LPRF_RX_STATUS_* flags
+ * @lqi: reserved for a link quality indicator, always zero. The chip does
+ * 	not report the signal quality of a received frame.
+ * @reserved: always zero
+ */
+struct lprf_rx_record {
+	__u64 timestamp_ns;
+	__u16 raw_length;
+	__u16 length;
+	__u8 shift;
+	__u8 status;
+	__u8 lqi;
+	__u8 reserved;
+};
+
+/*
+ * RX ring shared by mmap()
+ *
+ * LPRF_IOC_SET_RX_RING sets the number of slots of the ring, a power of two
+ * from LPRF_RX_RING_MIN_SLOTS to LPRF_RX_RING_MAX_SLOTS, or zero to remove
+ * the ring. Every open file has a ring of its own, which is mapped by mmap()
+ * with offset zero and can not be changed while it is mapped. While the ring
+ * exists, every received frame is stored as record in the next slot instead
+ * of the read() buffer.
+ *
+ * A slot belongs to user space while its status is LPRF_SLOT_USER. User space
+ * hands a slot back by setting the status to LPRF_SLOT_KERNEL. The driver
+ * fills the slots in order and drops frames while the next slot still belongs
+ * to user space.
+ */
+#define LPRF_RX_RING_SLOT_SIZE      512
+#define LPRF_RX_RING_MIN_SLOTS      8
+#define LPRF_RX_RING_MAX_SLOTS      1024
+
+#define LPRF_SLOT_KERNEL            0
+#define LPRF_SLOT_USER              1
+
+/**
+ * lprf_rx_slot is one slot of the RX ring.
+ *
+ * @status: LPRF_SLOT_KERNEL or LPRF_SLOT_USER
+ * @reserved: always zero
+ * @record: record header of the frame (see struct lprf_rx_record)
+ * @data: record.length bytes of the frame
+ */
+struct lprf_rx_slot {
+	__u32 status;
+	__u32 reserved;
+	struct lprf_rx_record record;
+	__u8 data[LPRF_RX_RING_SLOT_SIZE - 8 - sizeof(struct lprf_rx_record)];
+};
+
+#define LPRF_IOC_SET_RX_RING  _IOW(LPRF_IOC_MAGIC, 15, __u32)
+#define LPRF_IOC_GET_RX_RING  _IOR(LPRF_IOC_MAGIC, 16, __u32)
+
+/*
+ * read() buffer
+ *
+ * Every open file has a read() buffer of its own and receives all frames.
+ * The initial size is set by the module parameter rx_buffer_frames.
+ * LPRF_IOC_SET_RX_BUFFER sets the number of frames or records the buffer
+ * holds, a power of two from LPRF_RX_BUFFER_MIN_FRAMES to
+ * LPRF_RX_BUFFER_MAX_FRAMES. Data that has not been read yet is discarded.
+ * Frames received while the buffer is full are dropped and counted in
+ * debugfs, the next record read has LPRF_RX_STATUS_OVERFLOW set.
+ */
+#define LPRF_RX_BUFFER_MIN_FRAMES   4
+#define LPRF_RX_BUFFER_MAX_FRAMES   4096
+
+#define LPRF_IOC_SET_RX_BUFFER  _IOW(LPRF_IOC_MAGIC, 18, __u32)
+#define LPRF_IOC_GET_RX_BUFFER  _IOR(LPRF_IOC_MAGIC, 19, __u32)
+
+/*
+ * Batched transmission
+ *
+ * LPRF_IOC_SEND_BATCH queues an array of frames for transmission with a
+ * single system call. Frames are queued in order until the array ends, the
+ * TX queue is full or a frame is invalid. The ioctl only blocks while the
+ * TX queue is full before the first frame (unless O_NONBLOCK is set) and
+ * fails if not even the first frame could be queued. Otherwise num_queued
+ * returns the number of queued frames. Every frame is sent on its own. With
+ * aggregation enabled it is sent as an aggregated frame with a single
+ * sub-frame, which the receiver unpacks like any other aggregated frame, and
+ * the maximum payload is one byte shorter. Frames are sent in order, so a
+ * frame with a send time delays all frames queued after it. Send times more
+ * than LPRF_MAX_SEND_DELAY_NS in the future are rejected with EINVAL.
+ *
+ * LPRF_TX_FRAME_POWER: tx_power is valid
+ * LPRF_TX_FRAME_TIME: send_time_ns is valid
+ * LPRF_TX_FRAME_REPORT: A record with the status LPRF_RX_STATUS_TX_DONE is
+ * 	read or stored in the RX ring of the file that queued the frame after
+ * 	the frame has been sent. Requires record mode or an RX ring. The
+ * 	record is dropped if the file has been closed.
+ */
+#define LPRF_TX_FRAME_POWER             0x0001
+#define LPRF_TX_FRAME_TIME              0x0002
+#define LPRF_TX_FRAME_REPORT            0x0004
+
+#define LPRF_MAX_SEND_DELAY_NS          1000000000ULL
+
+/**
+ * lprf_tx_frame describes one frame of a batch.
+ *
+ * @data: user space address of the frame payload
+ * @send_time_ns: CLOCK_MONOTONIC time in ns the frame is sent at the earliest
+ * @id: identifier returned in the completion record
+ * @tx_power: TX power in mBm as supported by the IEEE 802.15.4 interface of
+ * 	the chip. The TX power of the interface is used otherwise.
+ * @length: number of payload bytes
+ * @flags: LPRF_TX_FRAME_* flags
+ * @reserved: must be zero
+ */
+struct lprf_tx_frame {
+	__u64 data;
+	__u64 send_time_ns;
+	__u32 id;
+	__s32 tx_power;
+	__u16 length;
+	__u16 flags;
+	__u32 reserved;
+};
+
+/**
+ * lprf_tx_batch is the argument of LPRF_IOC_SEND_BATCH.
+ *
+ * @frames: user space address of an array of struct lprf_tx_frame
+ * @num_frames: number of entries of frames
+ * @num_queued: returns the number of frames queued for transmission
+ */
+struct lprf_tx_batch {
+	__u64 frames;
+	__u32 num_frames;
+	__u32 num_queued;
+};
+
+/**
+ * lprf_tx_completion follows the header of a record with the status
+ * LPRF_RX_STATUS_TX_DONE. The timestamp of the header is the time the
+ * transmission completed.
+ *
+ * @queued_ns: CLOCK_MONOTONIC time in ns the frame was queued
+ * @id: identifier of the frame (see struct lprf_tx_frame)
+ * @reserved: always zero
+ */
+struct lprf_tx_completion {
+	__u64 queued_ns;
+	__u32 id;
+	__u32 reserved;
+};
+
+#define LPRF_IOC_SEND_BATCH  _IOWR(LPRF_IOC_MAGIC, 17, struct lprf_tx_batch)
+
+#endif /* _LPRF_IOCTL_H_ */
@@ -1,4 +1,5 @@
 import argparse
+import os
 
 if __name__ == "__main__":
     
@@ -15,6 +16,9 @@ if __name__ == "__main__":
                         default data will be used.""")
     parser.add_argument('-n', type=int, default=1, 
                         help="number of times the input data will be written to /dev/lprf")
+    parser.add_argument('-b', '--batch', type=int, default=1,
+                        help="""number of frames queued with a single writev() call. Every frame
+                        contains the input data.""")
     
     args = parser.parse_args()
     
@@ -31,10 +35,19 @@ if __name__ == "__main__":
 
     lprf = open("/dev/lprf", 'wb')
 
-    for i in range(args.n):
-        lprf.write(data)
-        lprf.flush()
-        print(str(i) + ": Wrote " + str(len(data)) + " bytes to /dev/lprf.")
+    if args.batch > 1:
+        i = 0
+        while i < args.n:
+            frames = [data] * min(args.batch, args.n - i)
+            written = os.writev(lprf.fileno(), frames)
+            queued = written // len(data)
+            print(str(i) + ": Queued " + str(queued) + " frames of " + str(len(data)) + " bytes to /dev/lprf.")
+            i += queued
+    else:
+        for i in range(args.n):
+            lprf.write(data)
+            lprf.flush()
+            print(str(i) + ": Wrote " + str(len(data)) + " bytes to /dev/lprf.")
     
     lprf.close()
     
\ No newline at end of file